@@ -84,6 +84,18 @@ typedef struct __attribute__ ((packed))
 #define MADT_IC_LX2APIC		0x9	/* local x2APIC */
 #define MADT_IC_LX2APIC_NMI	0xa	/* local x2APIC NMI */
 
+/* Interrupt controller structure for a processor local APIC. */
+typedef struct __attribute__ ((packed))
+{
+  acpi_madt_ic_header_t header;		/* header, type MADT_IC_LAPIC */
+  uint8_t acpi_proc_uid;		/* ACPI processor UID */
+  uint8_t apic_id;			/* local APIC id. */
+  uint32_t flags;			/* local APIC flags */
+} acpi_madt_ic_lapic_t;
+
+/* Flags in acpi_madt_ic_lapic_t::flags. */
+#define MADT_LAPIC_ENABLED	(1 <<  0)
+
 /* Interrupt controller structure for an I/O APIC. */
 typedef struct __attribute__ ((packed))
 {
@@ -105,6 +117,7 @@ typedef struct __attribute__ ((packed))
 typedef union __attribute__ ((packed))
 {
   acpi_madt_ic_header_t header;
+  acpi_madt_ic_lapic_t lapic;
   acpi_madt_ic_ioapic_t ioapic;
   acpi_madt_ic_lapic_addr_t lapic_addr;
 } acpi_madt_ic_union_t;
@@ -103,6 +103,13 @@ typedef volatile struct __attribute__ ((packed))
 #define IOREDTBLLO(idx)	(0x10 + 2 * (idx))	/* I/O redirection table */
 #define IOREDTBLHI(idx)	(0x10 + 2 * (idx) + 1)
 
+/* Field values for the local APIC interrupt command register, ICR[0]. */
+#define ICR_INIT	0x00000500U	/* INIT delivery mode */
+#define ICR_SIPI	0x00000600U	/* startup IPI delivery mode */
+#define ICR_BUSY	0x00001000U	/* delivery status: pending */
+#define ICR_ASSERT	0x00004000U	/* level: assert */
+#define ICR_LEVEL	0x00008000U	/* trigger mode: level */
+
 /* Field values for I/O APIC redirection table entries. */
 #define IOAPIC_RTLO_MASKED 0x00010000U	/* whether interrupt is masked */
 
@@ -70,6 +70,17 @@ typedef struct __attribute__ ((packed))
 					   boot params. */
   uint16_t runtime_bmem_top_seg;	/* real mode seg. for end of base
 					   mem. avail. at run time */
+  uint16_t shadow_blks;			/* bit mask of 16 KiB blocks from
+					   0xc0000 on which stage 1 made
+					   into read/write shadow RAM for
+					   option ROMs; stage 2 should make
+					   them read-only once the ROMs
+					   are initialized; bit
+					   PAM_FSEG_BLK is for 0xf0000~
+					   0xfffff, which is stage 2's */
+  uint8_t pam1_off;			/* PCI conf. space offset of host
+					   bridge's PAM reg. for 0xc0000,
+					   or 0 if no shadow RAM control */
 } bdat_bmem_t;
 
 /* "MRNG" boot data, describing a single memory address range at run time. */
@@ -95,29 +106,161 @@ typedef struct __attribute__ ((packed))
   uint32_t rsdp_sz;			/* size of RSDP */
 } bdat_rsdp_t;
 
-/* Node type for linked list of boot parameters. */
-struct __attribute__ ((packed)) bparm
+/* Maximum no. of boot timeline events which stage 1 can record. */
+#define TL_MAX_EVS_1	24
+/* Maximum length of a boot timeline event name. */
+#define TL_NAME_LEN	19
+
+/* A single event in a boot timeline. */
+typedef struct __attribute__ ((packed))
 {
-  struct bparm *next;			/* pointer to next boot param. node */
-#ifndef __x86_64__
-  uint32_t reserved;
-#endif
-  uint32_t type;			/* "PCID", etc. */
-  uint32_t size;			/* size of boot param. data only */
-  union
-  {					/* boot param. data */
-    bdat_pci_dev_t pci_dev;
-    bdat_bmem_t bmem;
-    bdat_mem_range_t mem_range;
-    bdat_rsdp_t rsdp;
-  } u[];
-};
+  uint64_t tsc;				/* time stamp counter value */
+  uint32_t arg;				/* event argument (e.g. PCI locn.) */
+  char kind;				/* TL_BEGIN or TL_END */
+  char name[TL_NAME_LEN];		/* name of boot phase, NUL-padded
+					   but not always NUL-terminated */
+} bdat_tl_ev_t;
 
-typedef struct bparm bparm_t;
+/* bdat_tl_ev_t::kind values. */
+#define TL_BEGIN	'B'		/* start of boot phase */
+#define TL_END		'E'		/* end of boot phase */
+
+/*
+ * "TIML" boot data, giving the times at which stage 1 started & ended each
+ * of its boot phases.
+ */
+typedef struct __attribute__ ((packed))
+{
+  uint32_t num_evs;			/* no. of events recorded */
+  bdat_tl_ev_t evs[TL_MAX_EVS_1];	/* events, in chronological order */
+} bdat_timeline_t;
+
+/*
+ * Memory accounting tags, saying which subsystem a block of memory or a
+ * boot parameter record is for.
+ */
+#define MTAG_MISC	0U		/* anything else */
+#define MTAG_BPARM	1U		/* boot parameter block */
+#define MTAG_MEM	2U		/* memory maps */
+#define MTAG_PCI	3U		/* PCI device info. */
+#define MTAG_ROM	4U		/* option ROM images */
+#define MTAG_ROM_RT	5U		/* option ROM run time areas */
+#define MTAG_ACPI	6U		/* ACPI info. */
+#define MTAG_TL		7U		/* boot timeline */
+#define MTAG_PGTBL	8U		/* page tables */
+#define MTAG_RT16	9U		/* resident 16-bit runtime data */
+#define MTAG_SLAB	10U		/* slab allocator */
+#define MTAG_DMA	11U		/* DMA buffers */
+#define MTAG_SMP	12U		/* AP trampoline & stacks */
+#define MTAG_SCRUB	13U		/* memory scrubber */
+#define MTAG_TEST	14U		/* self tests */
+#define MTAG_MAX	15U
+
+/* Short names for the memory accounting tags, in order, for reports. */
+#define MTAG_NAMES \
+	"misc.", "boot params.", "mem. maps", "PCI devs.", "ROM imgs.", \
+	"ROM run time", "ACPI", "timeline", "page tables", "16-bit rt.", \
+	"slabs", "DMA", "SMP", "scrubber", "self tests"
+
+/*
+ * "MACC" boot data, saying how much memory stage 1 used for one memory
+ * accounting tag.  There is one record per tag, indexed by tag.  Stage 1
+ * never frees base memory, so its totals are also its high-water marks.
+ */
+typedef struct __attribute__ ((packed))
+{
+  uint32_t bmem_sz;			/* base mem. allocated for use at
+					   run time */
+  uint32_t bmem_bt_sz;			/* base mem. allocated for use at
+					   boot time only */
+  uint32_t bparm_sz;			/* total size of boot param.
+					   records */
+  uint32_t num_allocs;			/* no. of base mem. allocations */
+} bdat_mem_acct_t;
 
 #define BP_PCID		MAGIC32('P', 'C', 'I', 'D')
 #define BP_BMEM		MAGIC32('B', 'M', 'E', 'M')
 #define BP_MRNG		MAGIC32('M', 'R', 'N', 'G')
 #define BP_RSDP		MAGIC32('R', 'S', 'D', 'P')
+#define BP_TIML		MAGIC32('T', 'I', 'M', 'L')
+#define BP_MACC		MAGIC32('M', 'A', 'C', 'C')
+
+/*
+ * Indices of the boot parameter types in the directory of a boot
+ * parameter block.  Each type always has the same directory slot, so that
+ * stage 2 can get at all the records of a given type in O(1) time.
+ */
+#define BPI_PCID	0
+#define BPI_BMEM	1
+#define BPI_MRNG	2
+#define BPI_RSDP	3
+#define BPI_TIML	4
+#define BPI_MACC	5
+#define BPI_MAX		6
+
+/* Directory entry in a boot parameter block, for one boot param. type. */
+typedef struct __attribute__ ((packed))
+{
+  uint32_t type;			/* "PCID", etc. */
+  uint32_t off;				/* offset of record array from start
+					   of block */
+  uint32_t count;			/* no. of records */
+  uint32_t rec_sz;			/* size of each record */
+} bparm_dir_t;
+
+/*
+ * Boot parameter block.  This is a header, followed by a directory of
+ * boot parameter types, followed by densely packed arrays of records, one
+ * array per type.
+ */
+struct __attribute__ ((packed)) bparm
+{
+  uint32_t magic;			/* BP_BLK_MAGIC */
+  uint16_t ver;				/* BP_BLK_VER */
+  uint16_t num_dirs;			/* no. of directory entries */
+  uint32_t size;			/* total size of block */
+  uint32_t reserved;
+  bparm_dir_t dir[];			/* directory, indexed by BPI_... */
+};
+
+typedef struct bparm bparm_t;
+
+#define BP_BLK_MAGIC	MAGIC32('B', 'P', 'B', 'K')
+#define BP_BLK_VER	1
+
+/*
+ * Return a pointer to the array of boot parameter records with directory
+ * index IDX in the block BLK, & store the no. of records in *P_COUNT.
+ * Return NULL if there are no such records, or if the records are not of
+ * the expected size REC_SZ.
+ */
+static inline void *
+bparm_recs (const bparm_t * blk, unsigned idx, uint32_t rec_sz,
+	    uint32_t * p_count)
+{
+  const bparm_dir_t *dir;
+  if (idx >= blk->num_dirs || !blk->dir[idx].count
+      || blk->dir[idx].rec_sz != rec_sz)
+    {
+      *p_count = 0;
+      return 0;
+    }
+  dir = &blk->dir[idx];
+  *p_count = dir->count;
+  return (char *) blk + dir->off;
+}
+
+/*
+ * Iterate over all the boot parameter records with directory index IDX in
+ * the block BLK.  This works even if a newer stage 1 passes bigger records
+ * than this code knows about.
+ */
+#define FOR_EACH_BPARM(rec, blk, idx, iter) \
+	for ((iter) = (idx) < (blk)->num_dirs ? (blk)->dir[idx].count : 0, \
+	     (rec) = (iter) ? (void *) ((char *) (blk) \
+					+ (blk)->dir[idx].off) : 0; \
+	     (iter); \
+	     --(iter), \
+	     (rec) = (void *) ((char *) (rec) + (blk)->dir[idx].rec_sz))
 
 #endif
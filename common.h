@@ -35,6 +35,7 @@
 #define PARA_SIZE	0x10UL		/* no. of bytes in a paragraph */
 #define KIBYTE		1024UL		/* no. of bytes in a KiB */
 #define HKIBYTE		(KIBYTE / 2)	/* no. of bytes in half a KiB */
+#define MIBYTE		(KIBYTE * KIBYTE) /* no. of bytes in a MiB */
 #define BMEM_MAX_ADDR	0x100000ULL	/* end of base memory, i.e. the
 					   1 MiB mark */
 
@@ -69,6 +70,9 @@
 #define E820_DISABLED	6U		/* disabled memory (ACPI 6.3) */
 #define E820_PMEM	7U		/* persistent memory (ACPI 6.3) */
 
+/* Extended attributes for int 0x15, ax = 0xe820 (ACPI 3.0). */
+#define E820_ATTR_ENABLED 1U		/* address range is enabled */
+
 /* Wait for an asynchronous interrupt. */
 static inline void
 hlt (void)
@@ -85,10 +89,59 @@ rdmsr (uint32_t idx)
   return (uint64_t) hi << 32 | lo;
 }
 
+/* Write an x86 model-specific register. */
+static inline void
+wrmsr (uint32_t idx, uint64_t v)
+{
+  __asm volatile ("wrmsr" : : "c" (idx), "d" ((uint32_t) (v >> 32)),
+			      "a" ((uint32_t) v) : "memory");
+}
+
+/* Read the time stamp counter. */
+static inline uint64_t
+rdtsc (void)
+{
+  uint32_t hi, lo;
+  __asm volatile ("rdtsc" : "=d" (hi), "=a" (lo));
+  return (uint64_t) hi << 32 | lo;
+}
+
+/* Write back & invalidate all caches. */
+static inline void
+wbinvd (void)
+{
+  __asm volatile ("wbinvd" : : : "memory");
+}
+
 /* Model-specific register numbers. */
 #define MSR_APIC_BASE	0x0000001bU
+#define     APIC_BASE_BSP 0x00000100U
+#define     APIC_BASE_EXTD 0x00000400U
+#define     APIC_BASE_EN 0x00000800U
 #define MSR_MISC_ENABLE	0x000001a0U
 #define     MCEN_LCMV	0x00400000U
+#define MSR_PAT		0x00000277U
+#define MSR_MTRRCAP	0x000000feU
+#define     MTRRCAP_VCNT 0x000000ffU
+#define     MTRRCAP_FIX	0x00000100U
+#define     MTRRCAP_WC	0x00000400U
+#define MSR_MTRR_PHYSBASE(n) (0x00000200U + 2 * (n))
+#define MSR_MTRR_PHYSMASK(n) (0x00000201U + 2 * (n))
+#define     PHYSMASK_V	0x00000800U
+#define MSR_MTRR_FIX64K_00000 0x00000250U
+#define MSR_MTRR_FIX16K_80000 0x00000258U
+#define MSR_MTRR_FIX16K_A0000 0x00000259U
+#define MSR_MTRR_FIX4K_C0000 0x00000268U
+#define MSR_MTRR_DEF_TYPE 0x000002ffU
+#define     DEF_TYPE_FE	0x00000400U
+#define     DEF_TYPE_E	0x00000800U
+
+/* MTRR memory types. */
+#define MTRR_UC		0x00U
+#define MTRR_WC		0x01U
+#define MTRR_WT		0x04U
+#define MTRR_WP		0x05U
+#define MTRR_WB		0x06U
 
 /* Obtain processor information. */
 static inline void
@@ -111,6 +164,14 @@ cpuid (uint32_t leaf, uint32_t * pa, uint32_t * pb,
 /* Bit fields in various CPUID leaves. */
 #define ID1C_MON	0x00000008U	/* monitor, MISC_ENABLE.LCMV, etc.
 					   (leaf 1, ecx) */
+#define ID1D_MTRR	0x00001000U	/* memory type range registers
+					   (leaf 1, edx) */
+#define ID1D_PGE	0x00002000U	/* page global enable
+					   (leaf 1, edx) */
+#define ID1D_PAT	0x00010000U	/* page attribute table
+					   (leaf 1, edx) */
+#define ID1D_SSE2	0x04000000U	/* SSE2 instructions
+					   (leaf 1, edx) */
 #define ID6A_ARAT	0x00000004U	/* always-on APIC timer
 					   (leaf 6, eax) */
 
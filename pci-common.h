@@ -120,6 +120,45 @@ pci_make_id (uint16_t vendor, uint16_t dev)
 #define PCI_VENDOR_ID_VBOX	0x80ee	/* Innotek GmbH (creator of
 					   VirtualBox VM hypervisor) */
 #define PCI_DEVICE_ID_VBOX_VESA	0xbeef	/* VirtualBox graphics card */
+#define PCI_VENDOR_ID_INTEL	0x8086	/* Intel Corporation */
+#define PCI_DEVICE_ID_I440FX	0x1237	/* 440FX PCI & memory controller */
+#define PCI_DEVICE_ID_Q35_MCH	0x29c0	/* Q35 memory controller hub */
+
+/*
+ * Shadow RAM in the upper memory area.  The host bridge's Programmable
+ * Attribute Map (PAM) registers say, for each 16 KiB block from 0xc0000 to
+ * 0xeffff, whether reads & writes go to DRAM or to the PCI bus.  Each PAM
+ * register covers two blocks, one per nibble.
+ */
+#define PAM_SHADOW_START 0xc0000U	/* start of shadow RAM window */
+#define PAM_SHADOW_END	0xf0000U	/* end of shadow RAM window */
+#define PAM_BLK_SZ	0x4000U		/* size of each block */
+#define PAM_NUM_BLKS	((PAM_SHADOW_END - PAM_SHADOW_START) / PAM_BLK_SZ)
+#define PAM_FSEG_BLK	PAM_NUM_BLKS	/* block no. standing for the whole
+					   of 0xf0000~0xfffff */
+#define PAM_RE		0x1U		/* reads go to DRAM */
+#define PAM_WE		0x2U		/* writes go to DRAM */
+#define I440FX_PAM1	0x5a	/* conf. space offset of 440FX PAM reg.
+				   for 0xc0000~0xc7fff */
+#define Q35_PAM1	0x91	/* ditto for Q35 */
+
+/*
+ * Return the configuration space offset of the PAM register for shadow RAM
+ * block number BLK, given the offset PAM1 of the register for 0xc0000, &
+ * store in *P_SHIFT the position of the block's nibble.  The 0xf0000 block
+ * has the upper nibble of the register just before.
+ */
+static inline uint8_t
+pam_reg (uint8_t pam1, unsigned blk, unsigned *p_shift)
+{
+  if (blk == PAM_FSEG_BLK)
+    {
+      *p_shift = 4;
+      return pam1 - 1;
+    }
+  *p_shift = blk % 2 * 4;
+  return pam1 + blk / 2;
+}
 
 /* Say whether a PCI Base Address Register (BAR) value is for an I/O port. */
 static inline bool
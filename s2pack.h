@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Format of the compressed stage 2 container.  tools/s2pack makes this out
+ * of the linked stage 2 ELF file, if the build is configured with
+ * `make COMPRESS_STAGE2=1'.
+ *
+ * The container has a header, then a table of loadable segments, then the
+ * compressed data for each segment.  Each segment's data is compressed as
+ * a single LZ4 block (no LZ4 frame), & is to be decompressed to the
+ * segment's physical address; the rest of the segment, up to its memory
+ * size, is then zero-filled.
+ */
+
+#ifndef H_S2PACK
+#define H_S2PACK
+
+#include <inttypes.h>
+#include "common.h"
+
+#define S2PK_MAGIC	MAGIC32('B', 'S', '2', 'Z')
+#define S2PK_VER	1
+#define S2PK_MAX_SEGS	16
+
+typedef struct __attribute__ ((packed))
+{
+  uint32_t magic;			/* S2PK_MAGIC */
+  uint16_t ver;				/* S2PK_VER */
+  uint16_t num_segs;			/* no. of segments */
+  uint32_t entry;			/* entry point */
+  uint32_t data_sz;			/* total compressed data size */
+} s2pk_hdr_t;
+
+typedef struct __attribute__ ((packed))
+{
+  uint32_t paddr;			/* segment physical address */
+  uint32_t filesz;			/* decompressed data size */
+  uint32_t memsz;			/* segment memory size */
+  uint32_t comp_off;			/* offset of compressed data in file */
+  uint32_t comp_sz;			/* compressed data size */
+} s2pk_seg_t;
+
+/* LZ4 block format parameters. */
+#define LZ4_MIN_MATCH	4
+#define LZ4_MAX_OFF	0xffffU
+/* The last match must start at least this many bytes before the end. */
+#define LZ4_MF_LIMIT	12
+/* The last this many bytes are always literals. */
+#define LZ4_LAST_LITS	5
+
+#endif
@@ -99,7 +99,7 @@ acpi_init (acpi_xsdp_t * rsdp)
     }
 
   /* Add a boot parameter for the RSDP. */
-  bd_rsdp = bparm_add (BP_RSDP, sizeof (bdat_rsdp_t));
+  bd_rsdp = bparm_add (BP_RSDP, sizeof (bdat_rsdp_t), MTAG_ACPI);
   bd_rsdp->rsdp_phy_addr = rsdp;
   bd_rsdp->rsdp_sz = sz;
 }
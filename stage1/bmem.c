@@ -46,6 +46,8 @@
  */
 
 #define MAX_BMEM_BLKS	(BMEM_MAX_ADDR / EFI_PAGE_SIZE / 2)
+/* Max. no. of passes to make at reserving base memory, if UEFI races us. */
+#define MAX_BMEM_TRIES	4
 
 #ifndef EFI_MEMORY_RO
 #define EFI_MEMORY_RO	(1ULL << 17)
@@ -86,13 +88,51 @@ static UINT64 bmem_uefi_attr = EFI_MEMORY_UC | EFI_MEMORY_WC | EFI_MEMORY_WB
 			       | EFI_MEMORY_RP | EFI_MEMORY_XP
 			       | EFI_MEMORY_RO | EFI_MEMORY_CPU_CRYPTO;
 
+/*
+ * Per-subsystem totals of base memory allocated, & of boot parameter
+ * records added, indexed by memory accounting tag.
+ */
+static bdat_mem_acct_t acct[MTAG_MAX];
+static const char *const acct_names[MTAG_MAX] = { MTAG_NAMES };
+
+/* Check a memory accounting tag. */
+static void
+bmem_check_tag (unsigned tag)
+{
+  if (tag >= MTAG_MAX)
+    error (u"bad mem. acct. tag!");
+}
+
+/*
+ * Say who has taken how much base memory so far.  This is mainly for
+ * figuring out what went wrong when we run out of base memory.
+ */
+static void
+bmem_acct_dump (void)
+{
+  unsigned tag;
+  info (u"base mem. used by:");
+  for (tag = 0; tag < MTAG_MAX; ++tag)
+    {
+      const bdat_mem_acct_t *ac = &acct[tag];
+      if (!ac->num_allocs)
+	continue;
+      infof (u"  %a 0x%x+0x%x", acct_names[tag],
+	     ac->bmem_sz, ac->bmem_bt_sz);
+    }
+  info (u"\r\n");
+}
+
 /* Check if we have enough base memory left. */
 static void
 bmem_check_enough (void)
 {
   if (runtime_bmem_top < 192 * KIBYTE
       || boottime_bmem_bot > runtime_bmem_top - 128 * KIBYTE)
-    error (u"not enough base mem.!");
+    {
+      bmem_acct_dump ();
+      error (u"not enough base mem.!");
+    }
 }
 
 /*
@@ -169,43 +209,92 @@ add_our_mem_bparms (void)
     }
 }
 
+/*
+ * Ask UEFI to hand over the base memory pages from page `idx' up to (but
+ * not including) page `end_idx', which the memory map said were free, &
+ * mark them in `ours'.  Return the status from UEFI.
+ */
+static EFI_STATUS
+bmem_grab_run (UINT32 idx, UINT32 end_idx, void *ours)
+{
+  EFI_PHYSICAL_ADDRESS start = (EFI_PHYSICAL_ADDRESS) idx * EFI_PAGE_SIZE;
+  EFI_STATUS status = BS->AllocatePages (AllocateAddress,
+					 EfiRuntimeServicesData,
+					 end_idx - idx, &start);
+  if (EFI_ERROR (status))
+    return status;
+  while (idx < end_idx)
+    {
+      bvec_set (ours, idx);
+      ++idx;
+    }
+  return status;
+}
+
 /* Initialize base memory allocation. */
 void
 bmem_init (void)
 {
-  UINTN page_count = BMEM_MAX_ADDR / EFI_PAGE_SIZE / 2;
   EFI_MEMORY_DESCRIPTOR *desc, *descs;
   EFI_PHYSICAL_ADDRESS start, end;
   UINT32 idx, end_idx;
   UINTN num_ents, map_key, desc_sz, ent_iter, num_extra_blks = 0;
-  /* Bit vector saying whether each page is available for use. */
-  BVEC_TYPE (BMEM_MAX_ADDR / EFI_PAGE_SIZE) avail;
+  EFI_STATUS status;
+  unsigned tries = 0;
+  bool raced, failed;
+  /*
+   * Bit vectors saying whether each page is available for use, & whether
+   * we have reserved each page from UEFI.
+   */
+  BVEC_TYPE (BMEM_MAX_ADDR / EFI_PAGE_SIZE) avail, ours;
 
-  memset (&avail, 0, sizeof avail);
+  memset (&ours, 0, sizeof ours);
   /*
-   * Grab all the base memory pages we can grab from UEFI.  Mark as
-   * available all the pages we can grab at boot time.
+   * Grab all the base memory pages we can grab from UEFI.  Take a
+   * snapshot of the memory map, & reserve the free pages below 1 MiB in
+   * each memory descriptor with one AllocateAddress call.  A run of free
+   * pages may span several descriptors, but UEFI (EDK2 at least) refuses
+   * AllocateAddress requests which cross descriptors, so do not merge
+   * them.
+   *
+   * If UEFI says it cannot find pages which were free in the memory map,
+   * something else must have grabbed some of them after we got the map
+   * --- e.g. LibMemoryMap (...) may itself allocate from base memory.  In
+   * that case, get a fresh memory map & try again for the remaining free
+   * pages.  Pages that we did reserve will no longer show up as free.  For
+   * any other failure, a new map will not help, so just skip the pages.
    */
-  do
+  for (;;)
     {
-      for (;;)
-	{
-	  start = BMEM_MAX_ADDR;
-	  EFI_STATUS status = BS->AllocatePages (AllocateMaxAddress,
-						 EfiRuntimeServicesData,
-						 page_count, &start);
-	  if (EFI_ERROR (status))
-	    break;
-	  idx = (UINT32) (start / EFI_PAGE_SIZE);
-	  while (page_count-- != 0)
-	    {
-	      bvec_set (&avail, idx);
-	      ++idx;
-	    }
-	}
-      page_count /= 2;
+      raced = failed = false;
+      descs = get_mem_map (&num_ents, &map_key, &desc_sz);
+      FOR_EACH_MEM_DESC (desc, descs, desc_sz, num_ents, ent_iter)
+      {
+	if (desc->Type != EfiConventionalMemory)
+	  continue;
+	start = desc->PhysicalStart;
+	if (start >= BMEM_MAX_ADDR)
+	  continue;
+	idx = start / EFI_PAGE_SIZE;
+	end_idx = idx + desc->NumberOfPages;
+	if (end_idx > BMEM_MAX_ADDR / EFI_PAGE_SIZE)
+	  end_idx = BMEM_MAX_ADDR / EFI_PAGE_SIZE;
+	if (idx == end_idx)
+	  continue;
+	status = bmem_grab_run (idx, end_idx, &ours);
+	if (status == EFI_NOT_FOUND)
+	  raced = true;
+	else if (EFI_ERROR (status))
+	  failed = true;
+      }
+      if (!raced || ++tries == MAX_BMEM_TRIES)
+	break;
+      FreePool (descs);
     }
-  while (page_count);
+  if (raced || failed)
+    info (u"some base mem. could not be reserved\r\n");
+  /* Mark as available all the pages we grabbed. */
+  avail = ours;
 
   /*
    * Group the available base memory into blocks for ease of tracking. 
@@ -248,10 +337,10 @@ bmem_init (void)
    * be available at run time (for filling in 0x40:0x13 later).  For
    * this, we should also count existing EfiBootServices{Code, Data} &
    * EfiLoader{Code, Data} pages, which will effectively be freed once
-   * we exit boot services.  To count this, we need to obtain a UEFI
-   * memory map.
+   * we exit boot services.  The memory map we got above tells us about
+   * these.  It may also still list the pages we just grabbed as free, so
+   * skip over those.
    */
-  descs = get_mem_map (&num_ents, &map_key, &desc_sz);
   FOR_EACH_MEM_DESC (desc, descs, desc_sz, num_ents, ent_iter)
   {
     switch (desc->Type)
@@ -267,6 +356,8 @@ bmem_init (void)
 	if (start >= BMEM_MAX_ADDR)
 	  break;
 	idx = start / EFI_PAGE_SIZE;
+	if (bvec_test (&ours, idx))
+	  break;
 	end_idx = idx + desc->NumberOfPages;
 	if (end_idx > BMEM_MAX_ADDR / EFI_PAGE_SIZE)
 	  end_idx = BMEM_MAX_ADDR / EFI_PAGE_SIZE;
@@ -328,17 +419,20 @@ bmem_init (void)
   if (idx < (192 * KIBYTE) / EFI_PAGE_SIZE)
     error (u"not enough base mem.!");
   runtime_bmem_top = (UINT32) idx *EFI_PAGE_SIZE;
+  FreePool (descs);
   bmem_check_enough ();
 }
 
 /*
  * Allocate base memory for use at run time.  `align' gives the requested
- * alignment, which should be a power of 2.
+ * alignment, which should be a power of 2.  `tag' says which subsystem the
+ * memory is for.
  */
 void *
-bmem_alloc (UINTN size, UINTN align)
+bmem_alloc (UINTN size, UINTN align, unsigned tag)
 {
   UINTN blk_idx;
+  bmem_check_tag (tag);
   /* Try to allocate from higher-addressed blocks first. */
   blk_idx = num_blks;
   while (blk_idx-- != 0)
@@ -354,8 +448,11 @@ bmem_alloc (UINTN size, UINTN align)
       if (runtime_bmem_top > astart)
 	runtime_bmem_top = astart;
       blk[blk_idx].end = astart;
+      acct[tag].bmem_sz += bend - astart;
+      ++acct[tag].num_allocs;
       return (void *) (EFI_PHYSICAL_ADDRESS) astart;
     }
+  bmem_acct_dump ();
   error (u"cannot alloc. from base mem.!");
 }
 
@@ -363,12 +460,14 @@ bmem_alloc (UINTN size, UINTN align)
  * Allocate base memory, but only for use at boot time.  This is mainly used
  * for boot parameters & other information which are to be consumed by the
  * stage 2 bootloader at startup.  `align' gives the requested alignment,
- * which should be a power of 2.
+ * which should be a power of 2.  `tag' says which subsystem the memory is
+ * for.
  */
 void *
-bmem_alloc_boottime (UINTN size, UINTN align)
+bmem_alloc_boottime (UINTN size, UINTN align, unsigned tag)
 {
   UINTN blk_idx;
+  bmem_check_tag (tag);
   /* Try to allocate from lower-addressed blocks first. */
   for (blk_idx = 0; blk_idx < num_blks; ++blk_idx)
     {
@@ -382,11 +481,31 @@ bmem_alloc_boottime (UINTN size, UINTN align)
       if (bend - astart < size)
 	continue;
       if (astart >= runtime_bmem_top)
-	error (u"cannot alloc. for boot time from base mem.!");
+	break;
       /* Success! */
       aend = astart + size;
       if (boottime_bmem_bot < aend)
 	boottime_bmem_bot = aend;
+      acct[tag].bmem_bt_sz += size;
+      ++acct[tag].num_allocs;
+      if (astart != bstart && num_blks < MAX_BMEM_BLKS)
+	{
+	  /*
+	   * Keep any alignment slack below the allocation as a block of
+	   * its own.
+	   */
+	  UINTN i = num_blks;
+	  while (i > blk_idx)
+	    {
+	      blk[i] = blk[i - 1];
+	      --i;
+	    }
+	  ++num_blks;
+	  blk[blk_idx].end = blk[blk_idx].orig_end = astart;
+	  ++blk_idx;
+	}
+      else if (astart != bstart)
+	acct[tag].bmem_bt_sz += astart - bstart;
       if (aend != bend)
 	blk[blk_idx].start = aend;
       else
@@ -400,22 +519,54 @@ bmem_alloc_boottime (UINTN size, UINTN align)
 	}
       return (void *) (EFI_PHYSICAL_ADDRESS) astart;
     }
+  bmem_acct_dump ();
   error (u"cannot alloc. for boot time from base mem.!");
 }
 
 /*
- * Wrap up base memory allocation.  As part of this, add information about
- * memory address ranges below the 1 MiB mark, as boot parameters.
+ * Account for `delta' bytes' worth of boot parameter records being added
+ * (or removed) for the subsystem `tag'.
+ */
+void
+bmem_acct_bparm (unsigned tag, int32_t delta)
+{
+  bmem_check_tag (tag);
+  acct[tag].bparm_sz += delta;
+}
+
+/*
+ * Fill in the "MACC" boot parameter records, which should be an array
+ * indexed by memory accounting tag.  This should be called after
+ * bmem_fini (...).
+ */
+void
+bmem_acct_fini (bdat_mem_acct_t * bd)
+{
+  memcpy (bd, acct, sizeof acct);
+}
+
+/*
+ * Add information about memory address ranges below the 1 MiB mark, as
+ * boot parameters.
  *
  * This routine accepts a memory map which the caller should have retrieved
  * via BS->GetMemoryMap(...) or some such.
  */
 void
-bmem_fini (EFI_MEMORY_DESCRIPTOR * descs, UINTN num_ents, UINTN desc_sz,
-	   uint32_t * p_boottime_bmem_bot, uint32_t * p_runtime_bmem_top)
+bmem_add_bparms (EFI_MEMORY_DESCRIPTOR * descs, UINTN num_ents,
+		 UINTN desc_sz)
 {
   add_uefi_mem_bparms (descs, num_ents, desc_sz);
   add_our_mem_bparms ();
+}
+
+/*
+ * Wrap up base memory allocation.  This should be called after the boot
+ * parameters are packed into base memory, via bparm_fini ().
+ */
+void
+bmem_fini (uint32_t * p_boottime_bmem_bot, uint32_t * p_runtime_bmem_top)
+{
   boottime_bmem_bot = (boottime_bmem_bot + PARA_SIZE - 1) & -PARA_SIZE;
   runtime_bmem_top &= -KIBYTE;
 #if 0
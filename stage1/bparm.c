@@ -33,33 +33,83 @@
 #include <string.h>
 #include "stage1/stage1.h"
 
-static bparm_t *bp_head = NULL, *bp_tail = NULL;
+/*
+ * Boot parameter records are first staged in chunks of UEFI pool memory,
+ * one list of chunks per boot parameter type, so that pointers to the
+ * records stay valid as more records are added.  bparm_fini () then packs
+ * all the records into a single block in base memory.
+ */
+#define CHUNK_RECS	32
+
+typedef struct bp_chunk
+{
+  struct bp_chunk *next;
+  uint32_t count;
+  uint64_t data[];
+} bp_chunk_t;
+
+typedef struct
+{
+  uint32_t rec_sz, count;
+  bp_chunk_t *head, *tail;
+} bp_staged_t;
+
+static const uint32_t bp_types[BPI_MAX] =
+  { BP_PCID, BP_BMEM, BP_MRNG, BP_RSDP, BP_TIML, BP_MACC };
+static bp_staged_t bp_staged[BPI_MAX];
+static bparm_t *bp_blk = NULL;
+
+static unsigned
+bparm_type_idx (uint32_t type)
+{
+  unsigned idx;
+  for (idx = 0; idx < BPI_MAX; ++idx)
+    if (bp_types[idx] == type)
+      return idx;
+  error (u"unknown boot param. type!");
+}
 
 /*
- * Add a boot parameter node with the given type & a data field of the given
- * size.  Return a pointer to the data field, which the caller should then
- * fill with the actual data.
+ * Add a boot parameter record with the given type & size, on behalf of the
+ * subsystem `tag'.  Return a pointer to the record, which the caller should
+ * then fill with the actual data.  The pointer is only valid until
+ * bparm_fini () is called.
  */
 void *
-bparm_add (uint32_t type, uint32_t size)
+bparm_add (uint32_t type, uint32_t size, unsigned tag)
 {
-  bparm_t *bp = bmem_alloc_boottime (sizeof (bparm_t) + size, sizeof (void *));
-  if (!bp_head)
-    bp_head = bp_tail = bp;
-  else
+  bp_staged_t *st = &bp_staged[bparm_type_idx (type)];
+  bp_chunk_t *chunk = st->tail;
+  void *rec;
+  if (bp_blk)
+    error (u"boot params. already packed!");
+  if (!st->count)
+    st->rec_sz = size;
+  else if (st->rec_sz != size)
+    error (u"boot param. size mismatch!");
+  if (!chunk || chunk->count == CHUNK_RECS)
     {
-      bp_tail->next = bp;
-      bp_tail = bp;
+      chunk = AllocatePool (sizeof (bp_chunk_t) + CHUNK_RECS * size);
+      if (!chunk)
+	error (u"no mem. for boot params.!");
+      chunk->next = NULL;
+      chunk->count = 0;
+      if (!st->head)
+	st->head = chunk;
+      else
+	st->tail->next = chunk;
+      st->tail = chunk;
     }
-  bp->next = NULL;
-  bp->type = type;
-  bp->size = size;
-  memset (bp->u, 0, size);
-  return bp->u;
+  rec = (char *) chunk->data + chunk->count * size;
+  ++chunk->count;
+  ++st->count;
+  bmem_acct_bparm (tag, size);
+  memset (rec, 0, size);
+  return rec;
 }
 
 /*
- * Convenience function: add a boot parameter node for a memory address
+ * Convenience function: add a boot parameter record for a memory address
  * range.  If the range is empty, do nothing.
  */
 bdat_mem_range_t *
@@ -70,7 +120,7 @@ bparm_add_mem_range (uint64_t start, uint64_t len,
   bdat_mem_range_t *bd;
   if (!len)
     return NULL;
-  bd = bparm_add (BP_MRNG, sizeof (bdat_mem_range_t));
+  bd = bparm_add (BP_MRNG, sizeof (bdat_mem_range_t), MTAG_MEM);
   bd->start = start;
   bd->len = len;
   bd->e820_type = e820_type;
@@ -79,9 +129,144 @@ bparm_add_mem_range (uint64_t start, uint64_t len,
   return bd;
 }
 
-/* Return the linked list of boot parameters built up. */
+/*
+ * Merge the staged "MRNG" records into a single chunk, sort them by
+ * starting address, & coalesce each run of exactly adjacent ranges which
+ * have the same E820 type & attributes into one range.  UEFI tends to
+ * split memory into many small descriptors that differ only in their
+ * memory types, & stage 2 has less work to do if it sees fewer records.
+ */
+static void
+bparm_compact_mem_ranges (void)
+{
+  bp_staged_t *st = &bp_staged[bparm_type_idx (BP_MRNG)];
+  bp_chunk_t *chunk = st->head, *next, *all;
+  bdat_mem_range_t *bdmrs, *prev;
+  uint32_t num_in = st->count, num_out = 0, idx;
+  if (num_in < 2)
+    return;
+  all = AllocatePool (sizeof (bp_chunk_t)
+		      + num_in * sizeof (bdat_mem_range_t));
+  if (!all)
+    error (u"no mem. for boot params.!");
+  bdmrs = (bdat_mem_range_t *) all->data;
+  /*
+   * Gather the records.  The UEFI memory map is mostly sorted already,
+   * so an insertion sort is good enough here.
+   */
+  idx = 0;
+  while (chunk)
+    {
+      next = chunk->next;
+      memcpy (&bdmrs[idx], chunk->data,
+	      chunk->count * sizeof (bdat_mem_range_t));
+      idx += chunk->count;
+      FreePool (chunk);
+      chunk = next;
+    }
+  for (idx = 1; idx < num_in; ++idx)
+    {
+      bdat_mem_range_t tmp = bdmrs[idx];
+      uint32_t hole = idx;
+      while (hole && bdmrs[hole - 1].start > tmp.start)
+	{
+	  bdmrs[hole] = bdmrs[hole - 1];
+	  --hole;
+	}
+      bdmrs[hole] = tmp;
+    }
+  /* Coalesce. */
+  prev = NULL;
+  for (idx = 0; idx < num_in; ++idx)
+    {
+      bdat_mem_range_t *bdmr = &bdmrs[idx];
+      if (prev && prev->start + prev->len == bdmr->start
+	  && prev->e820_type == bdmr->e820_type
+	  && prev->e820_ext_attr == bdmr->e820_ext_attr
+	  && prev->uefi_attr == bdmr->uefi_attr)
+	{
+	  prev->len += bdmr->len;
+	  continue;
+	}
+      prev = &bdmrs[num_out++];
+      *prev = *bdmr;
+    }
+  all->next = NULL;
+  all->count = num_out;
+  st->head = st->tail = all;
+  st->count = num_out;
+  bmem_acct_bparm (MTAG_MEM, -(int32_t) ((num_in - num_out)
+					  * sizeof (bdat_mem_range_t)));
+  infof (u"mem. ranges: %u -> %u\r\n", num_in, num_out);
+}
+
+/*
+ * Pack all the boot parameter records added so far into a single block in
+ * base memory, & free the staging area.  This must be called before
+ * bmem_fini (...).  No more records can be added after this.
+ */
+void
+bparm_fini (void)
+{
+  uint32_t size = sizeof (bparm_t) + BPI_MAX * sizeof (bparm_dir_t),
+    num_recs = 0;
+  unsigned idx;
+  bparm_compact_mem_ranges ();
+  for (idx = 0; idx < BPI_MAX; ++idx)
+    {
+      bp_staged_t *st = &bp_staged[idx];
+      size = (size + sizeof (uint64_t) - 1) & -(uint32_t) sizeof (uint64_t);
+      size += st->count * st->rec_sz;
+      num_recs += st->count;
+    }
+  bp_blk = bmem_alloc_boottime (size, sizeof (uint64_t), MTAG_BPARM);
+  memset (bp_blk, 0, sizeof (bparm_t) + BPI_MAX * sizeof (bparm_dir_t));
+  bp_blk->magic = BP_BLK_MAGIC;
+  bp_blk->ver = BP_BLK_VER;
+  bp_blk->num_dirs = BPI_MAX;
+  bp_blk->size = size;
+  size = sizeof (bparm_t) + BPI_MAX * sizeof (bparm_dir_t);
+  for (idx = 0; idx < BPI_MAX; ++idx)
+    {
+      bp_staged_t *st = &bp_staged[idx];
+      bparm_dir_t *dir = &bp_blk->dir[idx];
+      bp_chunk_t *chunk = st->head, *next;
+      size = (size + sizeof (uint64_t) - 1) & -(uint32_t) sizeof (uint64_t);
+      dir->type = bp_types[idx];
+      dir->off = size;
+      dir->count = st->count;
+      dir->rec_sz = st->rec_sz;
+      while (chunk)
+	{
+	  next = chunk->next;
+	  memcpy ((char *) bp_blk + size, chunk->data,
+		  chunk->count * st->rec_sz);
+	  size += chunk->count * st->rec_sz;
+	  FreePool (chunk);
+	  chunk = next;
+	}
+      st->head = st->tail = NULL;
+    }
+  infof (u"boot params.: %u recs. in 0x%x bytes @0x%lx\r\n",
+	 num_recs, bp_blk->size, bp_blk);
+}
+
+/*
+ * Return a pointer to the first packed boot parameter record of the given
+ * type, or NULL if there is none.  This is for filling in records after
+ * bparm_fini () is called.
+ */
+void *
+bparm_find (uint32_t type)
+{
+  unsigned idx = bparm_type_idx (type);
+  uint32_t count;
+  return bparm_recs (bp_blk, idx, bp_staged[idx].rec_sz, &count);
+}
+
+/* Return the packed block of boot parameters. */
 bparm_t *
 bparm_get (void)
 {
-  return bp_head;
+  return bp_blk;
 }
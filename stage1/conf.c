@@ -33,6 +33,7 @@
 
 static EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL *inputx;
 static volatile bool slow_step = false;
+static EFI_EVENT slow_step_ev = NULL;
 
 static EFI_STATUS EFIAPI
 key_slow_step (IN EFI_KEY_DATA * key)
@@ -40,6 +41,8 @@ key_slow_step (IN EFI_KEY_DATA * key)
   EFI_KEY_DATA reap_key;
   slow_step = true;
   inputx->ReadKeyStrokeEx (inputx, &reap_key);
+  if (slow_step_ev)
+    BS->SignalEvent (slow_step_ev);
   return EFI_SUCCESS;
 }
 
@@ -53,17 +56,29 @@ conf_init (void)
   if (EFI_ERROR (status))
     error_with_status (u"cannot get EFI_SIMPLE_TEXT_INPUT_EX_"
 		       "PROTOCOL", status);
+  /*
+   * Create an event for the key notification to wake up the wait below.
+   * If this fails, the wait will simply not be cut short.
+   */
+  status = BS->CreateEvent (0, 0, NULL, NULL, &slow_step_ev);
+  if (EFI_ERROR (status))
+    slow_step_ev = NULL;
   status = inputx->RegisterKeyNotify (inputx, &key1, key_slow_step, &notify1);
   if (EFI_ERROR (status))
     error_with_status (u"lolwut?", status);
   status = inputx->RegisterKeyNotify (inputx, &key2, key_slow_step, &notify2);
   if (EFI_ERROR (status))
     error_with_status (u"lolwut?", status);
-  infof (u"%Hpress `S' within 2 seconds to enable slow-stepping mode%N");
-  sleepx (2, &slow_step);
+  infof (u"%Hpress `S' within 2 seconds to enable slow-stepping mode%N"
+	 u"\r\n");
+  sleep_ms (2000, slow_step_ev, &slow_step);
   inputx->UnregisterKeyNotify (inputx, notify1);
   inputx->UnregisterKeyNotify (inputx, notify2);
-  info (u"\r                                                       \r");
+  if (slow_step_ev)
+    {
+      BS->CloseEvent (slow_step_ev);
+      slow_step_ev = NULL;
+    }
 }
 
 void
@@ -28,8 +28,9 @@
  */
 
 /*
- * Definitions for the UEFI Firmware Volume Protocol.  These are derived
- * from <Protocol/FirmwareVolume2.h>, <Pi/PiFirmwareFile.h>, &
+ * Definitions for the UEFI Firmware Volume & Firmware Volume Block
+ * Protocols.  These are derived from <Protocol/FirmwareVolume2.h>,
+ * <Protocol/FirmwareVolumeBlock.h>, <Pi/PiFirmwareFile.h>, &
  * <Pi/PiFirmwareVolume.h> in Intel's EDK II development environment.
  */
 
@@ -44,8 +45,28 @@ typedef UINT64 EFI_FV_ATTRIBUTES;
 
 /* EFI_FV_FILETYPE values. */
 #define EFI_FV_FILETYPE_ALL			0x00
+#define EFI_FV_FILETYPE_RAW			0x01
+#define EFI_FV_FILETYPE_FREEFORM		0x02
+#define EFI_FV_FILETYPE_SECURITY_CORE		0x03
+#define EFI_FV_FILETYPE_PEI_CORE		0x04
+#define EFI_FV_FILETYPE_DXE_CORE		0x05
+#define EFI_FV_FILETYPE_PEIM			0x06
+#define EFI_FV_FILETYPE_DRIVER			0x07
+#define EFI_FV_FILETYPE_COMBINED_PEIM_DRIVER	0x08
+#define EFI_FV_FILETYPE_APPLICATION		0x09
+#define EFI_FV_FILETYPE_MM			0x0a
 #define EFI_FV_FILETYPE_FIRMWARE_VOLUME_IMAGE	0x0b
+#define EFI_FV_FILETYPE_COMBINED_MM_DXE		0x0c
+#define EFI_FV_FILETYPE_MM_CORE			0x0d
+#define EFI_FV_FILETYPE_MM_STANDALONE		0x0e
+#define EFI_FV_FILETYPE_MM_CORE_STANDALONE	0x0f
+#define EFI_FV_FILETYPE_OEM_MIN			0xc0
+#define EFI_FV_FILETYPE_OEM_MAX			0xdf
+#define EFI_FV_FILETYPE_DEBUG_MIN		0xe0
+#define EFI_FV_FILETYPE_DEBUG_MAX		0xef
+#define EFI_FV_FILETYPE_FFS_MIN			0xf0
 #define EFI_FV_FILETYPE_FFS_PAD			0xf0
+#define EFI_FV_FILETYPE_FFS_MAX			0xff
 
 /* EFI_SECTION_TYPE values. */
 #define EFI_SECTION_ALL		0x00
@@ -89,4 +110,52 @@ typedef struct EFI_FIRMWARE_VOLUME2_PROTOCOL
 	       IN CONST EFI_GUID *, IN UINTN, IN CONST VOID *);
 } EFI_FIRMWARE_VOLUME2_PROTOCOL;
 
+typedef UINT32 EFI_FVB_ATTRIBUTES_2;
+
+/* Firmware volume header. */
+typedef struct
+{
+  UINT8 ZeroVector[16];
+  EFI_GUID FileSystemGuid;
+  UINT64 FvLength;
+  UINT32 Signature;
+  EFI_FVB_ATTRIBUTES_2 Attributes;
+  UINT16 HeaderLength;
+  UINT16 Checksum;
+  UINT16 ExtHeaderOffset;
+  UINT8 Reserved[1];
+  UINT8 Revision;
+  /* Block map follows. */
+} EFI_FIRMWARE_VOLUME_HEADER;
+
+/* EFI_FIRMWARE_VOLUME_HEADER::Signature value. */
+#define EFI_FVH_SIGNATURE	MAGIC32('_', 'F', 'V', 'H')
+
+struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL;
+
+typedef struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL
+{
+  EFI_STATUS (EFIAPI * GetAttributes)
+	      (IN CONST struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *,
+	       OUT EFI_FVB_ATTRIBUTES_2 *);
+  EFI_STATUS (EFIAPI * SetAttributes)
+	      (IN CONST struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *,
+	       IN OUT EFI_FVB_ATTRIBUTES_2 *);
+  EFI_STATUS (EFIAPI * GetPhysicalAddress)
+	      (IN CONST struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *,
+	       OUT EFI_PHYSICAL_ADDRESS *);
+  EFI_STATUS (EFIAPI * GetBlockSize)
+	      (IN CONST struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *,
+	       IN EFI_LBA, OUT UINTN *, OUT UINTN *);
+  EFI_STATUS (EFIAPI * Read)
+	      (IN CONST struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *,
+	       IN EFI_LBA, IN UINTN, IN OUT UINTN *, OUT UINT8 *);
+  EFI_STATUS (EFIAPI * Write)
+	      (IN CONST struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *,
+	       IN EFI_LBA, IN UINTN, IN OUT UINTN *, IN UINT8 *);
+  EFI_STATUS (EFIAPI * EraseBlocks)
+	      (IN CONST struct EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *, ...);
+  EFI_HANDLE ParentHandle;
+} EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL;
+
 #endif
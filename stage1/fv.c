@@ -37,18 +37,78 @@ static EFI_GUID gEfiFirmwareVolume2ProtocolGuid
       { 0x84, 0x05, 0xb9, 0x74, 0xb1, 0x08, 0x61, 0x9a }
     };
 
+static EFI_GUID gEfiFirmwareVolumeBlock2ProtocolGuid
+  = {
+      0x8f644fa9, 0xe850, 0x4db1,
+      { 0x9c, 0xe2, 0x0b, 0x44, 0x69, 0x8e, 0x8d, 0xa4 }
+    };
+
 #define MAX_OROM_SZ	0xf0000ULL
 #define HASH_BUCKETS	1381
 
+/*
+ * Option ROM index file.  This records where in the firmware volumes each
+ * PC-AT option ROM image lives, so that later boots on the same firmware
+ * need not search through the firmware volumes again.  A partial index
+ * only covers the FFS files up to where the search that made it stopped.
+ */
+#define ROMIDX_FILE	u"EFI\\biefirc\\romindex.bin"
+#define ROMIDX_MAGIC	MAGIC32('B', 'R', 'I', 'X')
+#define ROMIDX_VER	2
+#define ROMIDX_MAX_ENTS	0x10000U
+#define ROMIDX_PARTIAL	0x1U		/* index covers only part of FVs */
+
+typedef struct __attribute__ ((packed))
+{
+  uint32_t magic;			/* ROMIDX_MAGIC */
+  uint16_t ver;				/* ROMIDX_VER */
+  uint16_t ent_sz;			/* size of each index entry */
+  uint32_t num_ents;			/* no. of index entries */
+  uint32_t flags;			/* ROMIDX_PARTIAL */
+  uint32_t fw_rev;			/* firmware revision */
+  uint64_t fw_vendor_hash;		/* hash of firmware vendor string */
+  uint64_t fv_hash;			/* hash of firmware volume headers */
+  uint64_t ents_hash;			/* hash of index entries */
+} romidx_hdr_t;
+
+typedef struct __attribute__ ((packed))
+{
+  EFI_GUID file;			/* FFS file name */
+  uint32_t fv_idx;			/* firmware volume no. */
+  uint32_t instance;			/* raw section instance no. */
+  uint32_t off;				/* offset of ROM image in section */
+  uint32_t rimg_sz;			/* ROM image size */
+  uint32_t pci_id, class_if;		/* PCI id. & class code */
+} romidx_ent_t;
+
+/*
+ * Node in the hash table of PCI devices for which we want option ROM
+ * images from the firmware volumes.
+ */
 typedef struct ht_node
 {
   struct ht_node *next;
   uint32_t pci_id, class_if;
-  void *rimg_copy;
-  uint32_t rimg_sz;
+  bdat_pci_dev_t *bd;
 } ht_node_t;
 
+/* State of a search through the firmware volumes. */
+typedef struct
+{
+  void *sxn;				/* buffer for section data */
+  bool incomplete;			/* whether some index entries
+					   could not be recorded */
+  uint32_t fv_idx, instance;		/* current FV & raw section */
+  EFI_GUID file;			/* current FFS file */
+  romidx_ent_t *ents;			/* index entries gathered */
+  uint32_t num_ents, max_ents;
+} fv_search_t;
+
 static ht_node_t *ht[HASH_BUCKETS];
+static EFI_HANDLE *fv_handles = NULL;
+static UINTN fv_num_handles = 0;
+/* No. of wanted PCI devices which are still without option ROM images. */
+static unsigned num_wanted = 0;
 
 static unsigned
 fv_hash_bucket (uint32_t pci_id, uint32_t class_if)
@@ -56,87 +116,165 @@ fv_hash_bucket (uint32_t pci_id, uint32_t class_if)
   return (unsigned) (((uint64_t) pci_id << 32 | class_if) % HASH_BUCKETS);
 }
 
+/*
+ * Say whether an FFS file of the given type might contain a raw section
+ * holding a legacy option ROM image.  The files for SEC, PEI, & MM code
+ * are executed in place or in SMM, & raw files & pad files have no
+ * sections at all, so we skip all these.
+ */
+static bool
+fv_file_may_have_rimg (EFI_FV_FILETYPE type)
+{
+  switch (type)
+    {
+    case EFI_FV_FILETYPE_FREEFORM:
+    case EFI_FV_FILETYPE_DRIVER:
+    case EFI_FV_FILETYPE_COMBINED_PEIM_DRIVER:
+    case EFI_FV_FILETYPE_APPLICATION:
+      return true;
+    default:
+      return type >= EFI_FV_FILETYPE_OEM_MIN
+	     && type <= EFI_FV_FILETYPE_OEM_MAX;
+    }
+}
+
+/*
+ * Say whether there is a wanted PCI device with the given PCI id. & class
+ * code which is still without an image.
+ */
+static bool
+fv_is_wanted (uint32_t pci_id, uint32_t class_if)
+{
+  ht_node_t *node = ht[fv_hash_bucket (pci_id, class_if)];
+  while (node)
+    {
+      if (node->pci_id == pci_id && node->class_if == class_if
+	  && ! node->bd->rimg_seg)
+	return true;
+      node = node->next;
+    }
+  return false;
+}
+
+/*
+ * Hand a ROM image to every wanted PCI device with the given PCI id. &
+ * class code which is still without an image.
+ */
 static void
-fv_add_hash_entry (uint32_t pci_id, uint32_t class_if,
-		   void *rimg_copy, uint32_t sz)
+fv_match_one_id (const void *rimg, uint32_t sz, const rimg_pcir_t * pcir,
+		 uint32_t pci_id, uint32_t class_if)
 {
-  unsigned bucket = fv_hash_bucket (pci_id, class_if);
-  ht_node_t *node = AllocatePool (sizeof (ht_node_t));
-  if (!node)
-    error (u"no mem. to cache option ROM image!");
-  node->next = ht[bucket];
-  node->pci_id = pci_id;
-  node->class_if = class_if;
-  node->rimg_copy = rimg_copy;
-  node->rimg_sz = sz;
-  ht[bucket] = node;
+  ht_node_t *node = ht[fv_hash_bucket (pci_id, class_if)];
+  while (node)
+    {
+      bdat_pci_dev_t *bd = node->bd;
+      if (node->pci_id == pci_id && node->class_if == class_if
+	  && ! bd->rimg_seg)
+	{
+	  uint32_t pci_locn = bd->pci_locn;
+	  infof (u"  FV ROM img. for %04x:%02x:%02x.%x\r\n",
+		 pci_locn >> 16, (pci_locn >> 8) & 0xffU,
+		 (pci_locn >> 3) & 0x1fU, pci_locn & 7U);
+	  rimg_install (bd, rimg, sz, pcir);
+	  --num_wanted;
+	}
+      node = node->next;
+    }
 }
 
+/* Add an entry to the option ROM index being built up. */
 static void
-fv_cache_rimg (const void *rimg, uint32_t sz, const rimg_pcir_t * pcir)
+fv_add_idx_ent (fv_search_t * srch, uint32_t off, uint32_t sz,
+		uint32_t pci_id, uint32_t class_if)
+{
+  romidx_ent_t *ent;
+  if (srch->num_ents >= srch->max_ents)
+    {
+      uint32_t max_ents = srch->max_ents ? 2 * srch->max_ents : 64;
+      romidx_ent_t *ents;
+      if (max_ents > ROMIDX_MAX_ENTS)
+	{
+	  srch->incomplete = true;
+	  return;
+	}
+      ents = AllocatePool (max_ents * sizeof (romidx_ent_t));
+      if (! ents)
+	{
+	  srch->incomplete = true;
+	  return;
+	}
+      if (srch->ents)
+	{
+	  memcpy (ents, srch->ents, srch->num_ents * sizeof (romidx_ent_t));
+	  FreePool (srch->ents);
+	}
+      srch->ents = ents;
+      srch->max_ents = max_ents;
+    }
+  ent = &srch->ents[srch->num_ents++];
+  ent->file = srch->file;
+  ent->fv_idx = srch->fv_idx;
+  ent->instance = srch->instance;
+  ent->off = off;
+  ent->rimg_sz = sz;
+  ent->pci_id = pci_id;
+  ent->class_if = class_if;
+}
+
+/*
+ * Process a PC-AT option ROM image found in a firmware volume: hand it to
+ * any wanted PCI devices that match it, & (if SRCH is not NULL) record it
+ * in the option ROM index.
+ */
+static void
+fv_match_rimg (fv_search_t * srch, const void *rimg, uint32_t sz,
+	       const rimg_pcir_t * pcir)
 {
   uint32_t class_if = (uint32_t) pcir->class_if[2] << 24
 		      | (uint32_t) pcir->class_if[1] << 16
 		      | (uint32_t) pcir->class_if[0] << 8;
-  uint32_t pci_id_0 = pcir->pci_id, pci_id;
+  uint32_t pci_id_0 = pcir->pci_id, pci_id, off = 0;
   uint16_t vendor = pci_id_vendor (pci_id_0);
   const uint16_t *dev_ids;
   uint16_t dev;
-  unsigned i = 0;
   const void *rimg_end = (const char *) rimg + sz;
-  void *rimg_copy = AllocatePool (sz);
-  if (! rimg_copy)
-    error (u"no mem. to cache ROM img.!");
-  memcpy (rimg_copy, rimg, sz);
-  dev_ids = rimg_pcir_find_dev_id_list (pcir, rimg_end);
-  infof (u"      cache ROM img. @0x%lx~@0x%lx for %04x:%04x%s "
-	 "%02x %02x %02x\r\n",
-	 rimg_copy, (char *) rimg_copy + sz - 1,
-	 (UINT32) vendor, (UINT32) pci_id_dev (pci_id_0),
-	 dev_ids ? u" etc." : u"",
-	 class_if >> 24, (class_if >> 16) & 0xffU, (class_if >> 8) & 0xffU);
-  fv_add_hash_entry (pci_id_0, class_if, rimg_copy, sz);
-  if (dev_ids)
+  if (srch)
     {
-      info (u"        additional dev. list:");
-      while ((dev = *dev_ids++) != 0)
-	{
-	  if (! i)
-	    {
-	      info (u"\r\n");
-	      info (u"        ");
-	    }
-	  ++i;
-	  if (i == 14)
-	    i = 0;
-	  infof (u" %04x", (uint32_t) dev);
-	  pci_id = pci_make_id (vendor, dev);
-	  if (pci_id != pci_id_0)
-	    fv_add_hash_entry (pci_id, class_if, rimg_copy, sz);
-	}
-      info (u"\r\n");
+      off = (uint32_t) ((const char *) rimg - (const char *) srch->sxn);
+      fv_add_idx_ent (srch, off, sz, pci_id_0, class_if);
     }
+  fv_match_one_id (rimg, sz, pcir, pci_id_0, class_if);
+  dev_ids = rimg_pcir_find_dev_id_list (pcir, rimg_end);
+  if (dev_ids)
+    while ((dev = *dev_ids++) != 0)
+      {
+	pci_id = pci_make_id (vendor, dev);
+	if (pci_id == pci_id_0)
+	  continue;
+	if (srch)
+	  fv_add_idx_ent (srch, off, sz, pci_id, class_if);
+	fv_match_one_id (rimg, sz, pcir, pci_id, class_if);
+      }
+}
+
+/* Say whether a search through the firmware volumes should go on. */
+static bool
+fv_search_on (const fv_search_t * srch)
+{
+  return num_wanted != 0;
 }
 
 static void
-fv_gather_rimgs_for_one_sxn (const void *rom, UINTN rom_sz,
-			     const EFI_GUID * p_guid, UINTN instance)
+fv_find_rimgs_in_one_sxn (fv_search_t * srch, UINTN rom_sz)
 {
-  const void *rom_left = rom;
+  const void *rom_left = srch->sxn;
   uint64_t rom_left_sz = rom_sz, found_sz = 0;
   uint32_t this_sz;
   const rimg_pcir_t *found_pcir = NULL, *pcir;
   const void *found_rimg = NULL;
-  bool saw_a_pcir = false;
-  while ((pcir = rimg_find_pcir (rom_left, rom_left_sz)) != NULL)
+  while (fv_search_on (srch)
+	 && (pcir = rimg_find_pcir (rom_left, rom_left_sz)) != NULL)
     {
-      if (! saw_a_pcir)
-	{
-	  info (u"    ");
-	  print_guid (p_guid);
-	  infof (u" raw sec. %lx is option ROM\r\n", instance);
-	  saw_a_pcir = true;
-	}
       this_sz = (uint32_t) pcir->rimg_sz_hkib * HKIBYTE;
       if (pcir->type == PCIR_TYP_PCAT)
 	{
@@ -152,7 +290,7 @@ fv_gather_rimgs_for_one_sxn (const void *rom, UINTN rom_sz,
 	{
 	  if (found_rimg)
 	    {
-	      fv_cache_rimg (found_rimg, found_sz, found_pcir);
+	      fv_match_rimg (srch, found_rimg, found_sz, found_pcir);
 	      found_rimg = NULL;
 	    }
 	}
@@ -162,110 +300,417 @@ fv_gather_rimgs_for_one_sxn (const void *rom, UINTN rom_sz,
 }
 
 static void
-fv_gather_rimgs_for_one_file (EFI_FIRMWARE_VOLUME2_PROTOCOL * fv,
-			      EFI_GUID * p_guid)
+fv_find_rimgs_in_one_file (fv_search_t * srch,
+			   EFI_FIRMWARE_VOLUME2_PROTOCOL * fv)
 {
   UINTN instance = 0;
-  void *sxn = AllocatePool (MAX_OROM_SZ);
   do
     {
       UINTN sxn_sz = MAX_OROM_SZ;
       UINT32 auth;
-      EFI_STATUS status = fv->ReadSection (fv, p_guid,
-					   EFI_SECTION_RAW, instance, &sxn,
-					   &sxn_sz, &auth);
+      EFI_STATUS status = fv->ReadSection (fv, &srch->file,
+					   EFI_SECTION_RAW, instance,
+					   &srch->sxn, &sxn_sz, &auth);
       if (EFI_ERROR (status))
 	break;
       if (sxn_sz > MAX_OROM_SZ)
 	sxn_sz = MAX_OROM_SZ;
-      fv_gather_rimgs_for_one_sxn (sxn, sxn_sz, p_guid, instance);
+      srch->instance = (uint32_t) instance;
+      fv_find_rimgs_in_one_sxn (srch, sxn_sz);
     }
-  while (++instance != 0);
-  FreePool (sxn);
+  while (fv_search_on (srch) && ++instance != 0);
 }
 
 static void
-fv_gather_rimgs_for_one_fv (EFI_FIRMWARE_VOLUME2_PROTOCOL * fv)
+fv_find_rimgs_in_one_fv (fv_search_t * srch,
+			 EFI_FIRMWARE_VOLUME2_PROTOCOL * fv)
 {
   EFI_STATUS status;
   EFI_FV_FILETYPE type;
-  EFI_GUID guid;
   EFI_FV_FILE_ATTRIBUTES attrs;
   UINTN sz;
   void *key = AllocateZeroPool (fv->KeySize);
   if (! key)
     error (u"not enough mem. for FV key");
-  for (;;)
+  while (fv_search_on (srch))
     {
       type = EFI_FV_FILETYPE_ALL;
-      status = fv->GetNextFile (fv, key, &type, &guid, &attrs, &sz);
+      status = fv->GetNextFile (fv, key, &type, &srch->file, &attrs, &sz);
       if (EFI_ERROR (status))
 	break;
-      switch (type)
+      if (fv_file_may_have_rimg (type))
+	fv_find_rimgs_in_one_file (srch, fv);
+    }
+  FreePool (key);
+}
+
+static EFI_FIRMWARE_VOLUME2_PROTOCOL *
+fv_get (uint32_t fv_idx)
+{
+  EFI_FIRMWARE_VOLUME2_PROTOCOL *fv;
+  EFI_STATUS status;
+  if (fv_idx >= fv_num_handles)
+    return NULL;
+  status = BS->HandleProtocol (fv_handles[fv_idx],
+			       &gEfiFirmwareVolume2ProtocolGuid,
+			       (void **) &fv);
+  if (EFI_ERROR (status))
+    return NULL;
+  return fv;
+}
+
+/*
+ * Search through the firmware volumes, until all the wanted PCI devices
+ * have option ROM images.
+ */
+static void
+fv_search (fv_search_t * srch)
+{
+  uint32_t fv_idx;
+  for (fv_idx = 0; fv_search_on (srch) && fv_idx < fv_num_handles;
+       ++fv_idx)
+    {
+      EFI_FIRMWARE_VOLUME2_PROTOCOL *fv = fv_get (fv_idx);
+      if (! fv)
+	continue;
+      srch->fv_idx = fv_idx;
+      fv_find_rimgs_in_one_fv (srch, fv);
+    }
+}
+
+/*
+ * Compute a hash over the headers of all the firmware volumes, for
+ * telling whether the firmware has changed.  If a volume's header cannot
+ * be found, use the volume attributes instead.
+ */
+static uint64_t
+fv_compute_hash (void)
+{
+  uint64_t hash = HASH_INIT;
+  uint32_t fv_idx;
+  for (fv_idx = 0; fv_idx < fv_num_handles; ++fv_idx)
+    {
+      EFI_FIRMWARE_VOLUME_BLOCK2_PROTOCOL *fvb;
+      EFI_FIRMWARE_VOLUME2_PROTOCOL *fv;
+      EFI_PHYSICAL_ADDRESS addr;
+      EFI_FV_ATTRIBUTES fv_attrs;
+      EFI_STATUS status = BS->HandleProtocol (fv_handles[fv_idx],
+				      &gEfiFirmwareVolumeBlock2ProtocolGuid,
+				      (void **) &fvb);
+      if (! EFI_ERROR (status))
 	{
-	case EFI_FV_FILETYPE_FFS_PAD:
-	case EFI_FV_FILETYPE_FIRMWARE_VOLUME_IMAGE:
-	  continue;
-	default:
-	  ;
+	  status = fvb->GetPhysicalAddress (fvb, &addr);
+	  if (! EFI_ERROR (status))
+	    {
+	      const EFI_FIRMWARE_VOLUME_HEADER *fvh
+		= (const EFI_FIRMWARE_VOLUME_HEADER *) addr;
+	      if (fvh->Signature == EFI_FVH_SIGNATURE
+		  && fvh->HeaderLength >= sizeof (*fvh))
+		{
+		  hash = hash_bytes (fvh, fvh->HeaderLength, hash);
+		  continue;
+		}
+	    }
 	}
-      fv_gather_rimgs_for_one_file (fv, &guid);
+      fv = fv_get (fv_idx);
+      if (fv && ! EFI_ERROR (fv->GetVolumeAttributes (fv, &fv_attrs)))
+	hash = hash_bytes (&fv_attrs, sizeof fv_attrs, hash);
+      hash = hash_bytes (&fv_idx, sizeof fv_idx, hash);
     }
-  FreePool (key);
+  return hash;
+}
+
+/* Fill in the firmware identity fields of an option ROM index header. */
+static void
+fv_idx_key (romidx_hdr_t * hdr)
+{
+  CONST CHAR16 *vendor = ST->FirmwareVendor;
+  hdr->fw_rev = ST->FirmwareRevision;
+  hdr->fw_vendor_hash = vendor ? hash_bytes (vendor,
+					     StrLen (vendor) * sizeof (CHAR16),
+					     HASH_INIT) : 0;
+  hdr->fv_hash = fv_compute_hash ();
+}
+
+/*
+ * Read in the option ROM index file, & check it against the firmware
+ * identity in KEY.  Return the index if it is good, or NULL if not.
+ */
+static romidx_hdr_t *
+fv_read_idx (const romidx_hdr_t * key)
+{
+  EFI_FILE_PROTOCOL *vol = boot_vol_open (), *file;
+  EFI_FILE_INFO *finfo;
+  romidx_hdr_t *hdr = NULL;
+  UINTN sz = 0, read_sz;
+  EFI_STATUS status = vol->Open (vol, &file, ROMIDX_FILE,
+				 EFI_FILE_MODE_READ, 0);
+  if (EFI_ERROR (status))
+    {
+      vol->Close (vol);
+      return NULL;
+    }
+  finfo = LibFileInfo (file);
+  if (finfo)
+    {
+      sz = finfo->FileSize;
+      FreePool (finfo);
+    }
+  if (sz >= sizeof (romidx_hdr_t)
+      && sz <= sizeof (romidx_hdr_t) + ROMIDX_MAX_ENTS * sizeof (romidx_ent_t))
+    hdr = AllocatePool (sz);
+  if (hdr)
+    {
+      read_sz = sz;
+      status = file->Read (file, &read_sz, hdr);
+      if (EFI_ERROR (status) || read_sz != sz
+	  || hdr->magic != ROMIDX_MAGIC || hdr->ver != ROMIDX_VER
+	  || hdr->ent_sz != sizeof (romidx_ent_t)
+	  || hdr->num_ents > ROMIDX_MAX_ENTS
+	  || sz != sizeof (romidx_hdr_t)
+		   + hdr->num_ents * sizeof (romidx_ent_t)
+	  || hdr->ents_hash != hash_bytes (hdr + 1,
+					   sz - sizeof (romidx_hdr_t),
+					   HASH_INIT))
+	{
+	  info (u"  ROM index bad\r\n");
+	  FreePool (hdr);
+	  hdr = NULL;
+	}
+      else if (hdr->fw_rev != key->fw_rev
+	       || hdr->fw_vendor_hash != key->fw_vendor_hash
+	       || hdr->fv_hash != key->fv_hash)
+	{
+	  info (u"  ROM index is for other firmware\r\n");
+	  FreePool (hdr);
+	  hdr = NULL;
+	}
+    }
+  file->Close (file);
+  vol->Close (vol);
+  return hdr;
 }
 
+/*
+ * Write out a new option ROM index file.  PARTIAL says whether the index
+ * only covers part of the firmware volumes.
+ */
+static void
+fv_write_idx (romidx_hdr_t * key, const romidx_ent_t * ents,
+	      uint32_t num_ents, bool partial)
+{
+  EFI_FILE_PROTOCOL *vol = boot_vol_open (), *file;
+  UINTN ents_sz = num_ents * sizeof (romidx_ent_t), write_sz;
+  EFI_STATUS status;
+  key->magic = ROMIDX_MAGIC;
+  key->ver = ROMIDX_VER;
+  key->ent_sz = sizeof (romidx_ent_t);
+  key->num_ents = num_ents;
+  key->flags = partial ? ROMIDX_PARTIAL : 0;
+  key->ents_hash = hash_bytes (ents, ents_sz, HASH_INIT);
+  /* Delete any old index file first, so that no stale tail remains. */
+  status = vol->Open (vol, &file, ROMIDX_FILE,
+		      EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+  if (! EFI_ERROR (status))
+    file->Delete (file);
+  status = vol->Open (vol, &file, ROMIDX_FILE,
+		      EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE
+		      | EFI_FILE_MODE_CREATE, 0);
+  if (EFI_ERROR (status))
+    {
+      vol->Close (vol);
+      warn (u"cannot create ROM index");
+      return;
+    }
+  write_sz = sizeof (romidx_hdr_t);
+  status = file->Write (file, &write_sz, key);
+  if (! EFI_ERROR (status) && write_sz == sizeof (romidx_hdr_t) && ents_sz)
+    {
+      write_sz = ents_sz;
+      status = file->Write (file, &write_sz, (void *) ents);
+      if (! EFI_ERROR (status) && write_sz != ents_sz)
+	status = EFI_VOLUME_FULL;
+    }
+  if (EFI_ERROR (status))
+    {
+      file->Delete (file);
+      warn (u"cannot write ROM index");
+    }
+  else
+    {
+      file->Close (file);
+      infof (u"  wrote %sROM index: %u entries\r\n",
+	     partial ? u"partial " : u"", num_ents);
+    }
+  vol->Close (vol);
+}
+
+/*
+ * Use the option ROM index to find option ROM images for the wanted PCI
+ * devices.  Only read the sections which the index says hold images for
+ * the devices.  Return false if the index turns out to be wrong.
+ */
+static bool
+fv_use_idx (const romidx_hdr_t * hdr, void *sxn)
+{
+  const romidx_ent_t *ents = (const romidx_ent_t *) (hdr + 1);
+  uint32_t i;
+  for (i = 0; num_wanted && i < hdr->num_ents; ++i)
+    {
+      const romidx_ent_t *ent = &ents[i];
+      EFI_FIRMWARE_VOLUME2_PROTOCOL *fv;
+      const rimg_pcir_t *pcir;
+      const void *rimg;
+      EFI_GUID file = ent->file;
+      UINTN sxn_sz = MAX_OROM_SZ;
+      UINT32 auth;
+      EFI_STATUS status;
+      if (! fv_is_wanted (ent->pci_id, ent->class_if))
+	continue;
+      fv = fv_get (ent->fv_idx);
+      if (! fv)
+	return false;
+      status = fv->ReadSection (fv, &file, EFI_SECTION_RAW,
+				ent->instance, &sxn, &sxn_sz, &auth);
+      if (EFI_ERROR (status))
+	return false;
+      if (sxn_sz > MAX_OROM_SZ)
+	sxn_sz = MAX_OROM_SZ;
+      if (ent->off >= sxn_sz || ent->rimg_sz > sxn_sz - ent->off)
+	return false;
+      rimg = (const char *) sxn + ent->off;
+      pcir = rimg_find_pcir (rimg, ent->rimg_sz);
+      if (! pcir || pcir->type != PCIR_TYP_PCAT
+	  || (uint32_t) pcir->rimg_sz_hkib * HKIBYTE != ent->rimg_sz)
+	return false;
+      fv_match_rimg (NULL, rimg, ent->rimg_sz, pcir);
+      if (fv_is_wanted (ent->pci_id, ent->class_if))
+	return false;
+    }
+  return true;
+}
+
+/*
+ * Find out what firmware volumes there are.  The actual search for option
+ * ROM images is done later by fv_find_rimgs (), once we know which PCI
+ * devices want them.
+ */
 void
 fv_init (void)
 {
-  EFI_HANDLE *handles;
-  UINTN num_handles, hidx;
   unsigned bucket;
   EFI_STATUS status = LibLocateHandle (ByProtocol,
 				       &gEfiFirmwareVolume2ProtocolGuid, NULL,
-				       &num_handles, &handles);
-  if (EFI_ERROR (status) || ! num_handles)
-    {
-      info (u"no EFI firmware volumes avail.?\r\n");
-      return;
-    }
-  infof (u"EFI firmware volumes: %lu\r\n", num_handles);
+				       &fv_num_handles, &fv_handles);
   for (bucket = 0; bucket < HASH_BUCKETS; ++bucket)
     ht[bucket] = NULL;
-  for (hidx = 0; hidx < num_handles; ++hidx)
+  if (EFI_ERROR (status) || ! fv_num_handles)
     {
-      EFI_FIRMWARE_VOLUME2_PROTOCOL *fv;
-      EFI_HANDLE handle = handles[hidx];
-      EFI_STATUS status = BS->HandleProtocol (handle,
-					      &gEfiFirmwareVolume2ProtocolGuid,
-					      (void **) &fv);
-      if (EFI_ERROR (status))
-	continue;
-      infof (u"  FV %lu\r\n", hidx);
-      fv_gather_rimgs_for_one_fv (fv);
+      info (u"no EFI firmware volumes avail.?\r\n");
+      fv_handles = NULL;
+      fv_num_handles = 0;
+      return;
     }
-  FreePool (handles);
+  infof (u"EFI firmware volumes: %lu\r\n", fv_num_handles);
 }
 
-bool
-fv_find_rimg (uint32_t pci_id, uint32_t class_if,
-	      void **p_rimg_copy, uint32_t * p_sz)
+/*
+ * Say that we want an option ROM image from the firmware volumes for the
+ * given PCI device.
+ */
+void
+fv_want_rimg (bdat_pci_dev_t * bd)
 {
-  unsigned bucket = fv_hash_bucket (pci_id, class_if);
-  ht_node_t *node = ht[bucket];
-  while (node)
+  unsigned bucket = fv_hash_bucket (bd->pci_id, bd->class_if);
+  ht_node_t *node = AllocatePool (sizeof (ht_node_t));
+  if (! node)
+    error (u"no mem. for FV ROM img. lookup!");
+  node->next = ht[bucket];
+  node->pci_id = bd->pci_id;
+  node->class_if = bd->class_if;
+  node->bd = bd;
+  ht[bucket] = node;
+  ++num_wanted;
+}
+
+/*
+ * Find option ROM images in the firmware volumes for the PCI devices that
+ * want them, & copy each image found straight to base memory, via
+ * rimg_install (...).
+ *
+ * If there is a good option ROM index for this firmware, only look at the
+ * sections listed in the index.  Otherwise --- or if the index is partial,
+ * & some devices are still without images --- search through the firmware
+ * volumes, stopping once every wanted device has an image, & write out a
+ * new index.  The index is partial if the search stopped early.
+ */
+void
+fv_find_rimgs (void)
+{
+  fv_search_t srch;
+  romidx_hdr_t key, *hdr;
+  if (! num_wanted || ! fv_num_handles)
+    return;
+  infof (u"looking in FVs for ROM imgs. for %u dev(s).\r\n", num_wanted);
+  memset (&srch, 0, sizeof srch);
+  srch.sxn = AllocatePool (MAX_OROM_SZ);
+  if (! srch.sxn)
+    error (u"no mem. for FV section!");
+  fv_idx_key (&key);
+  hdr = fv_read_idx (&key);
+  if (hdr)
     {
-      if (node->pci_id == pci_id && node->class_if == class_if)
+      infof (u"  using ROM index: %u entries\r\n", hdr->num_ents);
+      if (! fv_use_idx (hdr, srch.sxn))
 	{
-	  *p_rimg_copy = node->rimg_copy;
-	  *p_sz = node->rimg_sz;
-	  return true;
+	  info (u"  ROM index out of date\r\n");
+	  FreePool (hdr);
+	  hdr = NULL;
+	}
+      else if (num_wanted && (hdr->flags & ROMIDX_PARTIAL) != 0)
+	{
+	  FreePool (hdr);
+	  hdr = NULL;
 	}
-      node = node->next;
     }
-  return false;
+  if (! hdr)
+    {
+      fv_search (&srch);
+      /*
+       * Do not save an index which is missing some ROM images.  If the
+       * search went through all the FVs, some devices may still be
+       * without images; if not, the index is partial.
+       */
+      if (! srch.incomplete)
+	fv_write_idx (&key, srch.ents, srch.num_ents, ! num_wanted);
+      if (srch.ents)
+	FreePool (srch.ents);
+    }
+  else
+    FreePool (hdr);
+  FreePool (srch.sxn);
+  if (num_wanted)
+    infof (u"  no FV ROM imgs. for %u dev(s).\r\n", num_wanted);
 }
 
 void
 fv_fini (void)
 {
+  unsigned bucket;
+  for (bucket = 0; bucket < HASH_BUCKETS; ++bucket)
+    {
+      ht_node_t *node = ht[bucket], *next;
+      while (node)
+	{
+	  next = node->next;
+	  FreePool (node);
+	  node = next;
+	}
+      ht[bucket] = NULL;
+    }
+  if (fv_handles)
+    FreePool (fv_handles);
+  fv_handles = NULL;
+  fv_num_handles = 0;
+  num_wanted = 0;
 }
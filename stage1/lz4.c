@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decoder for LZ4 block format data, as used in compressed stage 2
+ * containers (see s2pack.h).
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "stage1/stage1.h"
+#include "s2pack.h"
+
+/*
+ * Read an LZ4 length extension.  Return false if the input runs out.
+ */
+static bool
+lz4_get_len (const uint8_t ** p_ip, const uint8_t * ip_end, size_t * p_len)
+{
+  const uint8_t *ip = *p_ip;
+  uint8_t b;
+  do
+    {
+      if (ip >= ip_end)
+	return false;
+      b = *ip++;
+      *p_len += b;
+    }
+  while (b == 255);
+  *p_ip = ip;
+  return true;
+}
+
+/*
+ * Decompress the LZ4 block at SRC, of size SRC_SZ, to DST.  Return true
+ * if the block decompresses to exactly DST_SZ bytes, or false if the data
+ * are bad.
+ */
+bool
+lz4_decode (const void *src, size_t src_sz, void *dst, size_t dst_sz)
+{
+  const uint8_t *ip = src, *ip_end = ip + src_sz;
+  uint8_t *op = dst, *op_end = op + dst_sz;
+  for (;;)
+    {
+      size_t num_lits, match_len, off;
+      uint8_t tok;
+      const uint8_t *match;
+      if (ip >= ip_end)
+	return false;
+      tok = *ip++;
+      num_lits = tok >> 4;
+      if (num_lits == 15 && !lz4_get_len (&ip, ip_end, &num_lits))
+	return false;
+      if (num_lits > (size_t) (ip_end - ip)
+	  || num_lits > (size_t) (op_end - op))
+	return false;
+      memcpy (op, ip, num_lits);
+      ip += num_lits;
+      op += num_lits;
+      /* The last sequence has only literals. */
+      if (ip == ip_end)
+	return op == op_end;
+      if (ip_end - ip < 2)
+	return false;
+      off = (size_t) ip[0] | (size_t) ip[1] << 8;
+      ip += 2;
+      if (!off || off > (size_t) (op - (uint8_t *) dst))
+	return false;
+      match_len = tok & 15;
+      if (match_len == 15 && !lz4_get_len (&ip, ip_end, &match_len))
+	return false;
+      match_len += LZ4_MIN_MATCH;
+      if (match_len > (size_t) (op_end - op))
+	return false;
+      match = op - off;
+      if (off >= match_len)
+	{
+	  memcpy (op, match, match_len);
+	  op += match_len;
+	}
+      else
+	while (match_len-- != 0)
+	  *op++ = *match++;
+    }
+}
@@ -30,6 +30,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include "stage1/stage1.h"
+#include "s2pack.h"
 
 extern EFI_HANDLE LibImageHandle;
 extern EFI_GUID gEfiLoadedImageProtocolGuid, gEfiGlobalVariableGuid;
@@ -47,9 +48,15 @@ static uint16_t temp_ebda_seg = 0;
 static void
 init (void)
 {
+  tl_begin ("conf_init", 0);
   conf_init ();
+  tl_end ("conf_init", 0);
+  tl_begin ("bmem_init", 0);
   bmem_init ();
+  tl_end ("bmem_init", 0);
+  tl_begin ("fv_init", 0);
   fv_init ();
+  tl_end ("fv_init", 0);
 }
 
 static void
@@ -87,6 +94,24 @@ find_boot_media (void)
   boot_media_handle = li->DeviceHandle;
 }
 
+/* Open the root directory of the volume which we were loaded from. */
+EFI_FILE_PROTOCOL *
+boot_vol_open (void)
+{
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs;
+  EFI_FILE_PROTOCOL *vol;
+  EFI_STATUS status = BS->HandleProtocol (boot_media_handle,
+					  &gEfiSimpleFileSystemProtocolGuid,
+					  (void **) &fs);
+  if (EFI_ERROR (status))
+    error_with_status (u"cannot get "
+		       "EFI_SIMPLE_FILE_SYSTEM_PROTOCOL", status);
+  status = fs->OpenVolume (fs, &vol);
+  if (EFI_ERROR (status))
+    error_with_status (u"cannot get EFI_FILE_PROTOCOL", status);
+  return vol;
+}
+
 static void
 test_if_secure_boot (void)
 {
@@ -116,15 +141,18 @@ alloc_trampoline (void)
 #define STAGE2_ALT	u"biefist2.sys"
 #define STAGE2_ALT_ALT	u"kernel.sys"
 
-static void
+static UINT64
 dump_stage2_info (EFI_FILE_PROTOCOL * prog, CONST CHAR16 * name)
 {
   EFI_FILE_INFO *info = LibFileInfo (prog);
+  UINT64 size;
   if (!info)
     error (u"cannot get info on stage 2");
+  size = info->FileSize;
   infof (u"stage2: %s  size: 0x%lx  attrs.: 0x%lx\r\n",
-	 name, info->FileSize, info->Attribute);
+	 name, size, info->Attribute);
   FreePool (info);
+  return size;
 }
 
 static void
@@ -176,27 +204,121 @@ free_stage2_mem (const Elf32_Phdr * phdrs, UINT32 ph_cnt)
     }
 }
 
+static void
+free_packed_stage2_mem (const s2pk_seg_t * segs, UINT32 seg_cnt)
+{
+  const s2pk_seg_t *seg = segs;
+  while (seg_cnt-- != 0)
+    {
+      EFI_PHYSICAL_ADDRESS slack = seg->paddr % EFI_PAGE_SIZE,
+	paddr = seg->paddr - slack;
+      UINTN pages =
+	((UINT64) seg->memsz + slack + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE;
+      BS->FreePages (paddr, pages);
+      ++seg;
+    }
+}
+
+/*
+ * Load a compressed stage 2 container (see s2pack.h).  HEAD holds the
+ * first HEAD_SZ bytes of the file, which have already been read.  Read in
+ * the rest of the file in one go, then decompress each segment straight
+ * to its place in memory.
+ */
+static Elf32_Addr
+load_packed_stage2 (EFI_FILE_PROTOCOL * prog, EFI_FILE_PROTOCOL * vol,
+		    const void *head, UINTN head_sz, UINT64 file_sz)
+{
+  const s2pk_hdr_t *hdr;
+  const s2pk_seg_t *segs;
+  char *buf;
+  UINT32 seg_cnt, seg_idx, entry, unpacked_sz = 0;
+  uint64_t start, decode_us;
+  if (file_sz < head_sz || file_sz > 0xffffffffULL)
+    goto bad_pack;
+  buf = AllocatePool (file_sz);
+  if (!buf)
+    {
+      prog->Close (prog);
+      vol->Close (vol);
+      error (u"no mem. for packed stage 2");
+    }
+  memcpy (buf, head, head_sz);
+  read_stage2 (prog, vol, file_sz - head_sz, buf + head_sz);
+  prog->Close (prog);
+  vol->Close (vol);
+  hdr = (const s2pk_hdr_t *) buf;
+  seg_cnt = hdr->num_segs;
+  entry = hdr->entry;
+  infof (u"  packed ver.: %u  seg. cnt.: %u  entry: @0x%x\r\n",
+	 (UINT32) hdr->ver, seg_cnt, entry);
+  if (hdr->ver != S2PK_VER || seg_cnt > S2PK_MAX_SEGS
+      || file_sz < sizeof (*hdr) + seg_cnt * sizeof (*segs))
+    goto bad_pack;
+  segs = (const s2pk_seg_t *) (hdr + 1);
+  info (u"  seg# file off.  phy.addr.  packed sz. file sz.   mem. sz.\r\n");
+  start = rdtsc ();
+  for (seg_idx = 0; seg_idx < seg_cnt; ++seg_idx)
+    {
+      const s2pk_seg_t *seg = &segs[seg_idx];
+      UINT32 off = seg->comp_off, comp_sz = seg->comp_sz,
+	filesz = seg->filesz, memsz = seg->memsz;
+      EFI_PHYSICAL_ADDRESS slack = seg->paddr % EFI_PAGE_SIZE,
+	paddr = seg->paddr - slack;
+      EFI_STATUS status;
+      UINTN pages;
+      infof (u"  %4u 0x%08x 0x%08x 0x%08x 0x%08x 0x%08x\r\n",
+	     seg_idx, off, seg->paddr, comp_sz, filesz, memsz);
+      if (filesz > memsz || off > file_sz || comp_sz > file_sz - off)
+	{
+	  free_packed_stage2_mem (segs, seg_idx);
+	  goto bad_pack;
+	}
+      pages = ((UINT64) memsz + slack + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE;
+      status = BS->AllocatePages (AllocateAddress,
+				  EfiRuntimeServicesData, pages, &paddr);
+      if (EFI_ERROR (status))
+	{
+	  free_packed_stage2_mem (segs, seg_idx);
+	  error_with_status (u"cannot get mem. for packed seg.", status);
+	}
+      memset ((void *) paddr, 0, slack);
+      if (!lz4_decode (buf + off, comp_sz, (char *) paddr + slack, filesz))
+	{
+	  free_packed_stage2_mem (segs, seg_idx + 1);
+	  info (u"  bad packed data\r\n");
+	  goto bad_pack;
+	}
+      memset ((char *) paddr + slack + filesz, 0, memsz - filesz);
+      unpacked_sz += filesz;
+    }
+  decode_us = tsc_to_us (rdtsc () - start);
+  infof (u"  packed: 0x%lx  unpacked: 0x%x  decode time: %lu.%03lu ms\r\n",
+	 file_sz, unpacked_sz, decode_us / 1000, decode_us % 1000);
+  FreePool (buf);
+  return entry;
+bad_pack:
+  error (u"bad packed stage2");
+  return 0;
+}
+
 static Elf32_Addr
 load_stage2 (void)
 {
   enum
   { MAX_PHDRS = 16 };
-  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs;
   CHAR16 *name = STAGE2;
-  EFI_FILE_PROTOCOL *vol, *prog;
+  EFI_FILE_PROTOCOL *vol = boot_vol_open (), *prog;
   EFI_STATUS status;
+  union
+  {
+    Elf32_Ehdr ehdr;
+    s2pk_hdr_t pk;
+  } head;
   Elf32_Ehdr ehdr;
   Elf32_Phdr phdrs[MAX_PHDRS], *phdr;
   UINT32 x1, x2, ph_cnt, ph_idx, entry;
-  status = BS->HandleProtocol (boot_media_handle,
-			       &gEfiSimpleFileSystemProtocolGuid,
-			       (void **) &fs);
-  if (EFI_ERROR (status))
-    error_with_status (u"cannot get "
-		       "EFI_SIMPLE_FILE_SYSTEM_PROTOCOL", status);
-  status = fs->OpenVolume (fs, &vol);
-  if (EFI_ERROR (status))
-    error_with_status (u"cannot get EFI_FILE_PROTOCOL", status);
+  UINT64 file_sz;
   status = vol->Open (vol, &prog, name, EFI_FILE_MODE_READ, 0);
   if (EFI_ERROR (status))
     {
@@ -213,8 +335,16 @@ load_stage2 (void)
       vol->Close (vol);
       error_with_status (u"cannot open stage 2", status);
     }
-  dump_stage2_info (prog, name);
-  read_stage2 (prog, vol, sizeof ehdr, &ehdr);
+  file_sz = dump_stage2_info (prog, name);
+  if (file_sz < sizeof head)
+    {
+      info (u"  too short\r\n");
+      goto bad_elf;
+    }
+  read_stage2 (prog, vol, sizeof head, &head);
+  if (head.pk.magic == S2PK_MAGIC)
+    return load_packed_stage2 (prog, vol, &head, sizeof head, file_sz);
+  ehdr = head.ehdr;
   if (ehdr.e_ident[EI_MAG0] != ELFMAG0
       || ehdr.e_ident[EI_MAG1] != ELFMAG1
       || ehdr.e_ident[EI_MAG2] != ELFMAG2
@@ -323,6 +453,7 @@ prepare_to_hand_over (EFI_HANDLE image_handle)
   EFI_MEMORY_DESCRIPTOR *descs, *desc;
   UINTN num_ents = 0, map_key, desc_sz, ent_iter;
   EFI_STATUS status;
+  unsigned tag;
   /* Wrap up firmware volume handling. */
   fv_fini ();
   /* Say we are about to exit UEFI. */
@@ -366,23 +497,45 @@ prepare_to_hand_over (EFI_HANDLE image_handle)
   }
   /*
    * Wrap up base memory handling.  Add boot parameters to tell the
-   * bootloader about base memory availability at boot time & run
-   * time.
+   * bootloader about base memory below the 1 MiB mark, & about base
+   * memory availability at boot time & run time, & reserve room for
+   * the boot timeline.
    *
-   * We can only do this after adding the boot parameters for the map
-   * of extended memory, because these latter parameters will
-   * themselves be allocated in base memory (via bmem.c).
+   * Then pack all the boot parameters into base memory.  We can only
+   * say where the boot time base memory ends after this, so fill in the
+   * "BMEM", "TIML", & "MACC" records in the packed block afterwards.
    */
-  bd = bparm_add (BP_BMEM, sizeof (bdat_bmem_t));
-  bmem_fini (descs, num_ents, desc_sz, &boottime_bmem_bot, &runtime_bmem_top);
+  bmem_add_bparms (descs, num_ents, desc_sz);
+  bparm_add (BP_BMEM, sizeof (bdat_bmem_t), MTAG_MEM);
+  bparm_add (BP_TIML, sizeof (bdat_timeline_t), MTAG_TL);
+  for (tag = 0; tag < MTAG_MAX; ++tag)
+    bparm_add (BP_MACC, sizeof (bdat_mem_acct_t), MTAG_BPARM);
+  bparm_fini ();
+  bmem_fini (&boottime_bmem_bot, &runtime_bmem_top);
+  bd = bparm_find (BP_BMEM);
   bd->boottime_bmem_bot_seg = addr_to_rm_seg (boottime_bmem_bot);
   bd->runtime_bmem_top_seg = addr_to_rm_seg (runtime_bmem_top);
+  shadow_add_bparms (bd);
+  bmem_acct_fini (bparm_find (BP_MACC));
+  tl_fini ();
   /* Wrap up any other stuff. */
   conf_fini ();
   /* Wait for about 3 seconds. */
-  sleepx (3, NULL);
+  tl_begin ("delay", 0);
+  sleep_ms (3000, NULL, NULL);
+  tl_end ("delay", 0);
+  /*
+   * Freeing the staged boot parameters & such will have changed the UEFI
+   * memory map since we last looked at it, so get a fresh map key.  The
+   * changes only concern boot services pool memory, so the memory ranges
+   * in the boot parameters remain valid.
+   */
+  FreePool (descs);
+  descs = get_mem_map (&num_ents, &map_key, &desc_sz);
   /* Really exit boot services... */
+  tl_begin ("ExitBootServices", 0);
   status = BS->ExitBootServices (image_handle, map_key);
+  tl_end ("ExitBootServices", 0);
   if (EFI_ERROR (status))
     error_with_status (u"cannot exit UEFI", status);
   return runtime_bmem_top / KIBYTE;
@@ -393,16 +546,22 @@ efi_main (EFI_HANDLE image_handle, EFI_SYSTEM_TABLE * system_table)
 {
   Elf32_Addr trampoline, entry;
   unsigned base_kib;
+  tl_begin ("stage1", 0);
   InitializeLib (image_handle, system_table);
   info (u".:. biefircate " PACKAGE_VERSION " .:.\r\n");
   init ();
   process_efi_conf_tables ();
   find_boot_media ();
   test_if_secure_boot ();
+  tl_begin ("process_pci", 0);
   process_pci ();
+  tl_end ("process_pci", 0);
   trampoline = alloc_trampoline ();
+  tl_begin ("load_stage2", 0);
   entry = load_stage2 ();
+  tl_end ("load_stage2", 0);
   base_kib = prepare_to_hand_over (image_handle);
+  tl_end ("stage1", 0);
   run_stage2 (entry, trampoline, base_kib, temp_ebda_seg, bparm_get ());
   return 0;
 }
@@ -152,9 +152,226 @@ rimg_find (const void *rimg)
   return rimg_sz;
 }
 
+/*
+ * Store of boot-time option ROM image copies in base memory, keyed by
+ * content hash & size.  PCI 3.0+ images are only run from their boot-time
+ * copies during initialization, which then sets up a separate run-time
+ * image for each device; so identical images (e.g. for several cards of
+ * the same model) can share one boot-time copy.  Initialization code may
+ * still write to its boot-time image, so stage 2 saves a pristine copy of
+ * each shared image & restores it before running the next device's ROM.
+ */
+typedef struct rimg_store_node
+{
+  struct rimg_store_node *next;
+  uint64_t hash;
+  uint32_t sz;
+  void *copy;
+} rimg_store_node_t;
+
+static rimg_store_node_t *rimg_store = NULL;
+static uint32_t rimg_store_saved = 0, rimg_store_hits = 0;
+
+/*
+ * Return a boot-time copy in base memory of the given option ROM image,
+ * reusing an earlier copy if there is one with the same contents.
+ */
+static void *
+rimg_store_get (const void *rimg, uint32_t sz)
+{
+  uint64_t hash = hash_bytes (rimg, sz, HASH_INIT);
+  rimg_store_node_t *node = rimg_store;
+  while (node)
+    {
+      if (node->hash == hash && node->sz == sz
+	  && memcmp (node->copy, rimg, sz) == 0)
+	{
+	  rimg_store_saved += sz;
+	  ++rimg_store_hits;
+	  return node->copy;
+	}
+      node = node->next;
+    }
+  node = AllocatePool (sizeof (rimg_store_node_t));
+  if (!node)
+    error (u"no mem. for ROM img. store!");
+  node->copy = bmem_alloc_boottime (sz, HKIBYTE, MTAG_ROM);
+  memcpy (node->copy, rimg, sz);
+  node->hash = hash;
+  node->sz = sz;
+  node->next = rimg_store;
+  rimg_store = node;
+  return node->copy;
+}
+
+/* Say how much the option ROM image store saved, & free its nodes. */
+static void
+rimg_store_fini (void)
+{
+  rimg_store_node_t *node = rimg_store, *next;
+  if (rimg_store_hits)
+    infof (u"ROM img. store: %u dup(s)., 0x%x bytes saved\r\n",
+	   rimg_store_hits, rimg_store_saved);
+  while (node)
+    {
+      next = node->next;
+      FreePool (node);
+      node = next;
+    }
+  rimg_store = NULL;
+  rimg_store_saved = rimg_store_hits = 0;
+}
+
+/*
+ * Shadow RAM in the upper memory area, if the host bridge lets us turn it
+ * on.  Option ROM images placed here do not eat into conventional memory.
+ * Stage 2 makes the blocks read-only once the ROMs are initialized.
+ */
+static uint8_t shadow_pam1 = 0;
+static uint16_t shadow_blks = 0;
+static uint32_t shadow_next = PAM_SHADOW_START;
+
+/*
+ * Say whether the 16 KiB block at START is unsafe to turn into shadow RAM,
+ * because UEFI says it is anything but MMIO --- reserved memory may hold
+ * firmware data --- or because it seems to hold a ROM already.  A block
+ * missing from the memory map is fair game.
+ */
+static bool
+shadow_blk_busy (uint32_t start, EFI_MEMORY_DESCRIPTOR * descs,
+		 UINTN num_ents, UINTN desc_sz)
+{
+  EFI_MEMORY_DESCRIPTOR *desc;
+  UINTN ent_iter;
+  uint32_t p;
+  FOR_EACH_MEM_DESC (desc, descs, desc_sz, num_ents, ent_iter)
+  {
+    EFI_PHYSICAL_ADDRESS dstart = desc->PhysicalStart,
+			 dend = dstart + desc->NumberOfPages * EFI_PAGE_SIZE;
+    if (dend <= start || dstart >= start + PAM_BLK_SZ)
+      continue;
+    if (desc->Type != EfiMemoryMappedIO)
+      return true;
+  }
+  for (p = start; p < start + PAM_BLK_SZ; p += 2 * KIBYTE)
+    if (((const rimg_hdr_t *) (uintptr_t) p)->sig == 0xaa55U)
+      return true;
+  return false;
+}
+
+/* Check that a 16 KiB block of shadow RAM really holds what we write. */
+static bool
+shadow_blk_works (uint32_t start)
+{
+  volatile uint32_t *p = (volatile uint32_t *) (uintptr_t) start;
+  p[0] = 0x5aa5c33cU;
+  p[PAM_BLK_SZ / sizeof (uint32_t) - 1] = 0xa55a3cc3U;
+  if (p[0] != 0x5aa5c33cU
+      || p[PAM_BLK_SZ / sizeof (uint32_t) - 1] != 0xa55a3cc3U)
+    return false;
+  memset ((void *) p, 0, PAM_BLK_SZ);
+  return true;
+}
+
+/*
+ * If the PCI device with the EFI_PCI_IO_PROTOCOL interface IO is a host
+ * bridge we know, turn as much of the 0xc0000~0xeffff window as we can
+ * into read/write shadow RAM.
+ */
+static void
+shadow_init (EFI_PCI_IO_PROTOCOL * io)
+{
+  EFI_MEMORY_DESCRIPTOR *descs;
+  UINTN num_ents, map_key, desc_sz;
+  UINT32 pci_id;
+  unsigned blk, shift;
+  EFI_STATUS status = io->Pci.Read (io, EfiPciIoWidthUint32, 0, 1, &pci_id);
+  if (EFI_ERROR (status))
+    error_with_status (u"cannot read PCI conf. sp.", status);
+  if (pci_id == pci_make_id (PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_I440FX))
+    shadow_pam1 = I440FX_PAM1;
+  else if (pci_id == pci_make_id (PCI_VENDOR_ID_INTEL,
+				  PCI_DEVICE_ID_Q35_MCH))
+    shadow_pam1 = Q35_PAM1;
+  else
+    {
+      info (u"shadow RAM: no control for host bridge\r\n");
+      return;
+    }
+  descs = get_mem_map (&num_ents, &map_key, &desc_sz);
+  for (blk = 0; blk < PAM_NUM_BLKS; ++blk)
+    {
+      uint32_t start = PAM_SHADOW_START + blk * PAM_BLK_SZ;
+      uint8_t off = pam_reg (shadow_pam1, blk, &shift), old_v, v;
+      if (shadow_blk_busy (start, descs, num_ents, desc_sz))
+	continue;
+      status = io->Pci.Read (io, EfiPciIoWidthUint8, off, 1, &old_v);
+      if (EFI_ERROR (status))
+	error_with_status (u"cannot read PCI conf. sp.", status);
+      v = (old_v & ~(0xfU << shift)) | (PAM_RE | PAM_WE) << shift;
+      status = io->Pci.Write (io, EfiPciIoWidthUint8, off, 1, &v);
+      if (EFI_ERROR (status))
+	error_with_status (u"cannot write PCI conf. sp.", status);
+      /* Drop any cached lines from what was there before. */
+      wbinvd ();
+      if (shadow_blk_works (start))
+	shadow_blks |= 1U << blk;
+      else
+	io->Pci.Write (io, EfiPciIoWidthUint8, off, 1, &old_v);
+    }
+  FreePool (descs);
+  infof (u"shadow RAM: PAM @0x%x, blocks 0x%03x\r\n",
+	 (UINT32) shadow_pam1, (UINT32) shadow_blks);
+  if (!shadow_blks)
+    shadow_pam1 = 0;
+}
+
+/*
+ * Allocate shadow RAM for an option ROM image.  Return NULL if there is
+ * not enough, in which case the caller should fall back on base memory.
+ */
+static void *
+shadow_alloc (uint32_t sz, uint32_t align)
+{
+  uint32_t astart = (shadow_next + align - 1) & -align, blk, end_blk;
+  while (astart < PAM_SHADOW_END && sz <= PAM_SHADOW_END - astart)
+    {
+      blk = (astart - PAM_SHADOW_START) / PAM_BLK_SZ;
+      end_blk = (astart + sz - 1 - PAM_SHADOW_START) / PAM_BLK_SZ;
+      while (blk <= end_blk && (shadow_blks >> blk & 1) != 0)
+	++blk;
+      if (blk > end_blk)
+	{
+	  shadow_next = astart + sz;
+	  return (void *) (uintptr_t) astart;
+	}
+      /* Skip past the block which we cannot use. */
+      astart = PAM_SHADOW_START + (blk + 1) * PAM_BLK_SZ;
+      astart = (astart + align - 1) & -align;
+    }
+  return NULL;
+}
+
+/*
+ * Record in the "BMEM" boot parameter which blocks of shadow RAM we turned
+ * on, & which PAM register controls the first of them, for stage 2 to lock
+ * down later.
+ */
+void
+shadow_add_bparms (bdat_bmem_t * bd)
+{
+  bd->shadow_blks = shadow_blks;
+  bd->pam1_off = shadow_pam1;
+}
+
+/*
+ * Set up the option ROM image for a PCI device, copying it to base memory
+ * where needed.  If IN_PLACE_OK is true, & the ROM image is already in a
+ * suitable place in base memory, it may be used where it is.
+ */
 static void
 get_rimg (bdat_pci_dev_t * bd, const void *rimg, uint32_t sz,
-	  const rimg_pcir_t * pcir)
+	  const rimg_pcir_t * pcir, bool in_place_ok)
 {
   void *rimg_copy, *rimg_rt;
   bd->rimg_sz = sz;
@@ -169,7 +386,7 @@ get_rimg (bdat_pci_dev_t * bd, const void *rimg, uint32_t sz,
       uint32_t rt_sz = pcir->max_rt_sz_hkib * HKIBYTE;
       if (rt_sz != sz)
 	{
-	  if ((uintptr_t) rimg <= BMEM_MAX_ADDR - sz &&
+	  if (in_place_ok && (uintptr_t) rimg <= BMEM_MAX_ADDR - sz &&
 	      (uintptr_t) rimg % HKIBYTE == 0)
 	    {
 	      infof (u"    ROM img.: @0x%lx~@0x%lx\r\n",
@@ -179,28 +396,42 @@ get_rimg (bdat_pci_dev_t * bd, const void *rimg, uint32_t sz,
 	    }
 	  else
 	    {
-	      rimg_copy = bmem_alloc_boottime (sz, HKIBYTE);
-	      memcpy (rimg_copy, rimg, sz);
+	      rimg_copy = rimg_store_get (rimg, sz);
 	      infof (u"    ROM img.: @0x%lx~@0x%lx "
 		     "(copied from @0x%lx)",
 		     rimg_copy, (char *) rimg_copy + sz - 1, rimg);
 	      bd->rimg_seg = ptr_to_rm_seg (rimg_copy);
 	    }
 	  /* FIXME: should run time addr. be 2 KiB aligned? */
-	  rimg_rt = bmem_alloc (rt_sz, HKIBYTE);
+	  rimg_rt = shadow_alloc (rt_sz, 2 * KIBYTE);
+	  if (!rimg_rt)
+	    rimg_rt = bmem_alloc (rt_sz, HKIBYTE, MTAG_ROM_RT);
 	  infof (u"  run time: @0x%lx\r\n", rimg_rt);
 	  bd->rimg_rt_seg = ptr_to_rm_seg (rimg_rt);
 	  return;
 	}
       /* or else fall through */
     }
-  rimg_copy = bmem_alloc (sz, 2 * KIBYTE);
+  rimg_copy = shadow_alloc (sz, 2 * KIBYTE);
+  if (!rimg_copy)
+    rimg_copy = bmem_alloc (sz, 2 * KIBYTE, MTAG_ROM);
   memcpy (rimg_copy, rimg, sz);
   infof (u"    ROM img.: @0x%lx~@0x%lx (copied from @0x%lx)\r\n",
 	 rimg_copy, (char *) rimg_copy + sz - 1, rimg);
   bd->rimg_seg = bd->rimg_rt_seg = ptr_to_rm_seg (rimg_copy);
 }
 
+/*
+ * Copy an option ROM image for a PCI device to its place in base memory.
+ * The caller may reuse the buffer holding the original image afterwards.
+ */
+void
+rimg_install (bdat_pci_dev_t * bd, const void *rimg, uint32_t sz,
+	      const rimg_pcir_t * pcir)
+{
+  get_rimg (bd, rimg, sz, pcir, false);
+}
+
 static void
 get_rimg_from_file (bdat_pci_dev_t * bd)
 {
@@ -227,21 +458,7 @@ get_rimg_from_pci_io (bdat_pci_dev_t * bd, EFI_PCI_IO_PROTOCOL * io)
       return;
     }
   isz = (uint64_t) pcir->rimg_sz_hkib * HKIBYTE;
-  get_rimg (bd, rimg, isz, pcir);
-}
-
-static void
-get_rimg_from_fvs (bdat_pci_dev_t * bd)
-{
-  void *rimg;
-  uint32_t sz;
-  bd->rimg_seg = bd->rimg_rt_seg = bd->rimg_sz = 0;
-  if (fv_find_rimg (bd->pci_id, bd->class_if, &rimg, &sz))
-    {
-      const rimg_pcir_t *pcir = rimg_find_pcir (rimg, sz);
-      if (pcir)
-	get_rimg (bd, rimg, sz, pcir);
-    }
+  get_rimg (bd, rimg, isz, pcir, true);
 }
 
 static void
@@ -259,20 +476,33 @@ get_rimg_special_case (bdat_pci_dev_t * bd)
        * PCI id., but its option ROM has no "PCIR" structure. =_=
        */
       pcir = rimg_find_pcir (rimg, rimg_sz);
-      get_rimg (bd, rimg, rimg_sz, pcir);
+      get_rimg (bd, rimg, rimg_sz, pcir, true);
     }
 }
 
-static bdat_pci_dev_t *
-process_one_pci_io (EFI_PCI_IO_PROTOCOL * io, bool try_enable_vga)
+/* Information about a general PCI device, kept while we process it. */
+typedef struct
+{
+  EFI_PCI_IO_PROTOCOL *io;
+  UINT64 attrs, supports;
+  bdat_pci_dev_t *bd;
+} pci_dev_t;
+
+/*
+ * Gather information about a PCI device, & try to find an option ROM image
+ * for it from the quicker sources.  If it is a general device, add a boot
+ * parameter for it, fill in *PD, & return true; otherwise return false.
+ */
+static bool
+process_one_pci_io (EFI_PCI_IO_PROTOCOL * io, pci_dev_t * pd)
 {
   UINTN seg, bus, dev, fn;
-  UINT64 attrs, supports, enables;
+  UINT64 attrs, supports;
   UINT32 pci_conf[6];		/* buffer for PCI id. etc., & for BARs */
   UINT32 pci_id, class_if;
   bool got_bar = false;
   unsigned idx;
-  bdat_pci_dev_t *bd, *vga = NULL;
+  bdat_pci_dev_t *bd;
   EFI_STATUS status = io->GetLocation (io, &seg, &bus, &dev, &fn);
   if (EFI_ERROR (status))
     error_with_status (u"cannot get PCI ctrlr. locn.", status);
@@ -328,35 +558,25 @@ process_one_pci_io (EFI_PCI_IO_PROTOCOL * io, bool try_enable_vga)
   if ((pci_conf[3] >> 8 & 0xff) != 0)
     return false;
   /* Add a boot parameter for this PCI device. */
-  bd = bparm_add (BP_PCID, sizeof (bdat_pci_dev_t));
+  bd = bparm_add (BP_PCID, sizeof (bdat_pci_dev_t), MTAG_PCI);
   bd->pci_locn = seg << 16 | bus << 8 | dev << 3 | fn;
   bd->pci_id = pci_id;
   bd->class_if = class_if;
+  pd->io = io;
+  pd->attrs = attrs;
+  pd->supports = supports;
+  pd->bd = bd;
+  /*
+   * Look for an option ROM image in a file, or via the EFI PCI I/O
+   * protocol.  If there is none, we will later look in the firmware
+   * volumes.
+   */
   get_rimg_from_file (bd);
   if (!bd->rimg_seg)
     {
       get_rimg_from_pci_io (bd, io);
       if (!bd->rimg_seg)
-	{
-	  get_rimg_from_fvs (bd);
-	  if (!bd->rimg_seg)
-	    get_rimg_special_case (bd);
-	}
-    }
-  /*
-   * If this is a VGA or XGA display controller, & there is an option
-   * ROM for it, try to enable the legacy memory & I/O port locations
-   * for the controller.
-   */
-  if (bd->rimg_seg)
-    {
-      if (try_enable_vga &&
-	  enable_legacy_vga (io, class_if, attrs, supports, &enables))
-	{
-	  vga = bd;
-	  attrs |= enables;
-	  infof (u"    attrs. now 0x%lx\r\n", attrs);
-	}
+	fv_want_rimg (bd);
     }
   /* Enumerate all BAR values. */
   status = io->Pci.Read (io, EfiPciIoWidthUint32, 4 * sizeof (UINT32),
@@ -396,7 +616,7 @@ process_one_pci_io (EFI_PCI_IO_PROTOCOL * io, bool try_enable_vga)
     }
   if (got_bar)
     info (u"\r\n");
-  return vga;
+  return true;
 }
 
 /*
@@ -409,13 +629,36 @@ void
 process_pci (void)
 {
   EFI_HANDLE *handles;
-  UINTN num_handles, idx;
+  UINTN num_handles, num_devs = 0, idx;
+  pci_dev_t *pds;
   bdat_pci_dev_t *vga = NULL;
   EFI_STATUS status = LibLocateHandle (ByProtocol,
 				       &gEfiPciIoProtocolGuid, NULL,
 				       &num_handles, &handles);
   if (EFI_ERROR (status) || !num_handles)
     error_with_status (u"no PCI devices found", status);
+  pds = AllocatePool (num_handles * sizeof (pci_dev_t));
+  if (!pds)
+    error (u"no mem. for PCI dev. list!");
+  /*
+   * Look for the host bridge at 0000:00:00.0 first, so that we know
+   * whether we have shadow RAM before we place any ROM images.
+   */
+  for (idx = 0; idx < num_handles; ++idx)
+    {
+      EFI_PCI_IO_PROTOCOL *io;
+      UINTN seg, bus, dev, fn;
+      status = BS->HandleProtocol (handles[idx],
+				   &gEfiPciIoProtocolGuid, (void **) &io);
+      if (EFI_ERROR (status))
+	error_with_status (u"cannot get EFI_PCI_IO_PROTOCOL", status);
+      status = io->GetLocation (io, &seg, &bus, &dev, &fn);
+      if (!EFI_ERROR (status) && !seg && !bus && !dev && !fn)
+	{
+	  shadow_init (io);
+	  break;
+	}
+    }
   infof (u"PCI devices: %lu\r\n"
 	  "  locn.        PCI id.   class+IF ROM sz.   "
 	  "supports  attrs.\r\n", num_handles);
@@ -427,12 +670,44 @@ process_pci (void)
 				   &gEfiPciIoProtocolGuid, (void **) &io);
       if (EFI_ERROR (status))
 	error_with_status (u"cannot get EFI_PCI_IO_PROTOCOL", status);
-      if (!vga)
-	vga = process_one_pci_io (io, true);
-      else
-	process_one_pci_io (io, false);
+      if (process_one_pci_io (io, &pds[num_devs]))
+	++num_devs;
     }
   FreePool (handles);
+  /*
+   * Now that we know which devices are present, look in the firmware
+   * volumes for any option ROM images that are still missing.  Failing
+   * that, try any special-case ways of getting the images.
+   */
+  tl_begin ("fv_find_rimgs", 0);
+  fv_find_rimgs ();
+  tl_end ("fv_find_rimgs", 0);
+  for (idx = 0; idx < num_devs; ++idx)
+    if (!pds[idx].bd->rimg_seg)
+      get_rimg_special_case (pds[idx].bd);
+  /*
+   * For the first VGA or XGA display controller with an option ROM, try
+   * to enable the legacy memory & I/O port locations for the controller.
+   */
+  for (idx = 0; !vga && idx < num_devs; ++idx)
+    {
+      pci_dev_t *pd = &pds[idx];
+      bdat_pci_dev_t *bd = pd->bd;
+      UINT64 enables;
+      if (bd->rimg_seg
+	  && enable_legacy_vga (pd->io, bd->class_if, pd->attrs,
+				pd->supports, &enables))
+	{
+	  uint32_t pci_locn = bd->pci_locn;
+	  vga = bd;
+	  infof (u"VGA: %04x:%02x:%02x.%x  attrs. now 0x%lx\r\n",
+		 pci_locn >> 16, (pci_locn >> 8) & 0xffU,
+		 (pci_locn >> 3) & 0x1fU, pci_locn & 7U,
+		 pd->attrs | enables);
+	}
+    }
+  FreePool (pds);
+  rimg_store_fini ();
   if (!vga)
     error (u"no usable VGA/XGA controller?");
   if (!vga->rimg_seg)
@@ -48,16 +48,20 @@ extern void acpi_init (acpi_xsdp_t *);
 /* bmem.c functions. */
 
 extern void bmem_init (void);
-extern void *bmem_alloc (UINTN, UINTN);
-extern void *bmem_alloc_boottime (UINTN, UINTN);
-extern void bmem_fini (EFI_MEMORY_DESCRIPTOR *, UINTN, UINTN,
-		       uint32_t *, uint32_t *);
+extern void *bmem_alloc (UINTN, UINTN, unsigned);
+extern void *bmem_alloc_boottime (UINTN, UINTN, unsigned);
+extern void bmem_acct_bparm (unsigned, int32_t);
+extern void bmem_add_bparms (EFI_MEMORY_DESCRIPTOR *, UINTN, UINTN);
+extern void bmem_fini (uint32_t *, uint32_t *);
+extern void bmem_acct_fini (bdat_mem_acct_t *);
 
 /* bparm.c functions. */
 
-extern void *bparm_add (uint32_t, uint32_t);
+extern void *bparm_add (uint32_t, uint32_t, unsigned);
 extern bdat_mem_range_t *bparm_add_mem_range (uint64_t, uint64_t,
 					      uint32_t, uint32_t, uint64_t);
+extern void bparm_fini (void);
+extern void *bparm_find (uint32_t);
 extern bparm_t *bparm_get (void);
 
 /* conf.c functions. */
@@ -69,9 +73,24 @@ extern void conf_fini (void);
 /* fv.c functions. */
 
 extern void fv_init (void);
-extern bool fv_find_rimg (uint32_t, uint32_t, void **, uint32_t *);
+extern void fv_want_rimg (bdat_pci_dev_t *);
+extern void fv_find_rimgs (void);
 extern void fv_fini (void);
 
+/* lz4.c functions. */
+
+extern bool lz4_decode (const void *, size_t, void *, size_t);
+
+/* main.c functions. */
+
+extern EFI_FILE_PROTOCOL *boot_vol_open (void);
+
+/* timeline.c functions. */
+
+extern void tl_begin (const char *, uint32_t);
+extern void tl_end (const char *, uint32_t);
+extern void tl_fini (void);
+
 /* util.c functions. */
 
 extern __attribute__ ((noreturn)) void error_with_status (IN CONST CHAR16 *,
@@ -84,13 +103,18 @@ extern void print_guid (const EFI_GUID *);
 extern EFI_MEMORY_DESCRIPTOR *get_mem_map (UINTN *, UINTN *, UINTN *);
 extern uint8_t compute_cksum (const void *, size_t);
 extern void update_cksum (uint8_t *, size_t, uint8_t *);
-extern bool sleepx (unsigned, volatile bool *);
+extern uint64_t hash_bytes (const void *, size_t, uint64_t);
+extern bool sleep_ms (UINT32, EFI_EVENT, volatile bool *);
+extern uint64_t tsc_to_us (uint64_t);
 
 /* pci.c functions. */
 
 extern const rimg_pcir_t *rimg_find_pcir (const void *, uint64_t);
 const uint16_t *rimg_pcir_find_dev_id_list (const rimg_pcir_t *, const void *);
+extern void rimg_install (bdat_pci_dev_t *, const void *, uint32_t,
+			  const rimg_pcir_t *);
 extern void process_pci (void);
+extern void shadow_add_bparms (bdat_bmem_t *);
 
 /* run-stage2.asm functions. */
 
@@ -100,6 +124,9 @@ extern void run_stage2 (Elf32_Addr entry, Elf32_Addr trampoline,
 
 /* Macros, inline functions, & other definitions. */
 
+/* Initial value to pass to hash_bytes (...). */
+#define HASH_INIT	0xcbf29ce484222325ULL
+
 /* Define a bit vector type for storing the given number of bits. */
 #define BVEC_TYPE(num_ents) \
 	struct { UINT32 __bits[((num_ents) + 32ULL - 1) / 32]; }
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Routines for recording a timeline of stage 1's boot phases, to be passed
+ * on to the stage 2 bootloader.
+ */
+
+#include <string.h>
+#include "stage1/stage1.h"
+
+/*
+ * Timeline events are first recorded in a static buffer, since base memory
+ * might not be set up yet.  tl_fini () later moves the events into a boot
+ * parameter record, & any further events go directly into that record.
+ */
+static bdat_timeline_t tl_local;
+static bdat_timeline_t *tl = &tl_local;
+
+static void
+tl_add (char kind, const char *name, uint32_t arg)
+{
+  uint32_t idx = tl->num_evs;
+  bdat_tl_ev_t *ev;
+  unsigned i;
+  if (idx >= TL_MAX_EVS_1)
+    return;
+  ev = &tl->evs[idx];
+  ev->tsc = rdtsc ();
+  ev->arg = arg;
+  ev->kind = kind;
+  for (i = 0; i < TL_NAME_LEN && name[i]; ++i)
+    ev->name[i] = name[i];
+  while (i < TL_NAME_LEN)
+    ev->name[i++] = 0;
+  tl->num_evs = idx + 1;
+}
+
+/* Record the start of a boot phase. */
+void
+tl_begin (const char *name, uint32_t arg)
+{
+  tl_add (TL_BEGIN, name, arg);
+}
+
+/* Record the end of a boot phase. */
+void
+tl_end (const char *name, uint32_t arg)
+{
+  tl_add (TL_END, name, arg);
+}
+
+/*
+ * Move the timeline into its boot parameter record.  This must be called
+ * after the boot parameters are packed, via bparm_fini ().
+ */
+void
+tl_fini (void)
+{
+  bdat_timeline_t *bd = bparm_find (BP_TIML);
+  memcpy (bd, tl, sizeof (bdat_timeline_t));
+  if (tl->num_evs >= TL_MAX_EVS_1)
+    warn (u"boot timeline full");
+  tl = bd;
+}
@@ -35,49 +35,73 @@
 
 static unsigned pause_countdown = NL_BEFORE_PAUSE;
 
+/* Length of the time stamp counter calibration interval, in microseconds. */
+#define TSC_CAL_US	10000U
+
+/* No. of time stamp counter ticks per millisecond, or 0 if not yet known. */
+static uint64_t tsc_per_ms = 0;
+/* Timer event used for waits, or NULL if not yet created. */
+static EFI_EVENT sleep_timer = NULL;
+
 static void
-get_time (EFI_TIME * when)
+calibrate_tsc (void)
 {
-  EFI_STATUS status = RT->GetTime (when, NULL);
-  if (EFI_ERROR (status))
-    error_with_status (u"cannot get time", status);
+  uint64_t start = rdtsc ();
+  BS->Stall (TSC_CAL_US);
+  tsc_per_ms = (rdtsc () - start) * 1000 / TSC_CAL_US;
+  if (! tsc_per_ms)
+    tsc_per_ms = 1;
+  infof (u"TSC: %lu kHz\r\n", tsc_per_ms);
 }
 
-static bool
-wait_for_time_change (volatile bool *p_signalled)
+/*
+ * Wait on a UEFI timer event, & optionally a wake up event.  Return
+ * EFI_SUCCESS if the wait completed or was cut short, or an error code if
+ * the firmware would not let us wait.
+ *
+ * The timer event is created once & then kept around, so that waiting
+ * does not allocate any memory: this keeps the UEFI memory map key valid
+ * for a wait just before ExitBootServices (...).
+ */
+static EFI_STATUS
+sleep_on_timer (UINT32 ms, EFI_EVENT wake, volatile bool *p_signalled)
 {
-  EFI_TIME then, now;
-  get_time (&then);
+  EFI_EVENT evs[2];
+  UINTN num_evs = 1, idx;
+  EFI_STATUS status;
+  if (! sleep_timer)
+    {
+      status = BS->CreateEvent (EVT_TIMER, 0, NULL, NULL, &sleep_timer);
+      if (EFI_ERROR (status))
+	{
+	  sleep_timer = NULL;
+	  return status;
+	}
+    }
+  /* Timer periods are in units of 100 ns. */
+  status = BS->SetTimer (sleep_timer, TimerRelative, (UINT64) ms * 10000);
+  if (EFI_ERROR (status))
+    return status;
+  evs[0] = sleep_timer;
+  if (wake)
+    evs[num_evs++] = wake;
   do
     {
-      hlt ();
-      if (p_signalled && *p_signalled)
-	return true;
-      get_time (&now);
+      status = BS->WaitForEvent (num_evs, evs, &idx);
+      if (EFI_ERROR (status))
+	break;
     }
-  while (now.Second == then.Second && now.Nanosecond == then.Nanosecond);
-  return p_signalled && *p_signalled;
+  while (idx != 0 && ! (p_signalled && *p_signalled));
+  BS->SetTimer (sleep_timer, TimerCancel, 0);
+  return status;
 }
 
-static bool
-wait_for_one_second (volatile bool *p_signalled)
+/* Busy-wait until the time stamp counter reaches a deadline. */
+static void
+sleep_on_tsc (uint64_t deadline, volatile bool *p_signalled)
 {
-  EFI_TIME then, now;
-  UINT64 then_ns, now_ns;
-  get_time (&then);
-  then_ns = 1000000000ULL * then.Second + then.Nanosecond;
-  do
-    {
-      hlt ();
-      if (p_signalled && *p_signalled)
-	return true;
-      get_time (&now);
-      now_ns = 1000000000ULL * now.Second + now.Nanosecond;
-      if (now.Minute != then.Minute)
-	now_ns += 60000000000ULL;
-    }
-  while (now_ns < then_ns + 1000000000ULL);
-  return p_signalled && *p_signalled;
+  while (rdtsc () < deadline && ! (p_signalled && *p_signalled))
+    __builtin_ia32_pause ();
 }
 
 static void
@@ -202,13 +226,59 @@ update_cksum (uint8_t * buf, size_t n, uint8_t * p_cksum)
   *p_cksum = cksum;
 }
 
+/*
+ * Compute a 64-bit FNV-1a hash over a block of bytes, continuing from an
+ * earlier hash value, or from HASH_INIT.
+ */
+uint64_t
+hash_bytes (const void *buf, size_t n, uint64_t hash)
+{
+  const uint8_t *p = (const uint8_t *) buf;
+  while (n-- != 0)
+    {
+      hash ^= *p++;
+      hash *= 0x100000001b3ULL;
+    }
+  return hash;
+}
+
+/*
+ * Wait for the given no. of milliseconds, or until *P_SIGNALLED becomes
+ * true, whichever comes first.  If WAKE is not NULL, it should be an event
+ * which is signalled whenever *P_SIGNALLED may have become true; without
+ * it, a wait on a UEFI timer cannot be cut short.  Return true iff the wait
+ * was cut short.
+ *
+ * If the firmware cannot do timer waits, fall back on busy-waiting on the
+ * time stamp counter.
+ */
 bool
-sleepx (unsigned seconds, volatile bool *p_signalled)
-{
-  if (wait_for_time_change (p_signalled))
-    return true;
-  while (seconds-- != 0)
-    if (wait_for_one_second (p_signalled))
-      return true;
-  return false;
+sleep_ms (UINT32 ms, EFI_EVENT wake, volatile bool *p_signalled)
+{
+  uint64_t start, elapsed_us;
+  const CHAR16 *via = u"timer";
+  bool cut_short;
+  if (! tsc_per_ms)
+    calibrate_tsc ();
+  start = rdtsc ();
+  if (EFI_ERROR (sleep_on_timer (ms, wake, p_signalled)))
+    {
+      via = u"TSC";
+      sleep_on_tsc (start + ms * tsc_per_ms, p_signalled);
+    }
+  elapsed_us = tsc_to_us (rdtsc () - start);
+  cut_short = p_signalled && *p_signalled;
+  infof (u"waited %lu.%03lu ms of %u ms via %s%s\r\n",
+	 elapsed_us / 1000, elapsed_us % 1000, ms, via,
+	 cut_short ? u" (cut short)" : u"");
+  return cut_short;
+}
+
+/* Convert a count of time stamp counter ticks to microseconds. */
+uint64_t
+tsc_to_us (uint64_t ticks)
+{
+  if (! tsc_per_ms)
+    calibrate_tsc ();
+  return ticks * 1000 / tsc_per_ms;
 }
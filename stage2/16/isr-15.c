@@ -25,8 +25,24 @@
 #include "stage2/stage2.h"
 
 #define E15_WAIT_ACTIVE	0x83
+#define E15_MOVE_EXC	0x02
 #define E15_UNSUPP	0x86
 
+#define SMAP		0x534d4150UL	/* "SMAP" signature for ax = 0xe820 */
+
+/* System control port A, & its bit fields. */
+#define PORT_SYS_CTL_A	0x0092
+#define SCA_RESET	0x01		/* fast reset */
+#define SCA_A20		0x02		/* fast A20 gate */
+
+/*
+ * Memory map for int 0x15, ax = 0xe820, & memory sizes for ax = 0xe801 &
+ * ah = 0x88.  Stage 2 fills these in; see e820_init () in stage2/mem.c.
+ */
+DATA16 farptr16_t e820_tab16 = 0;
+DATA16 uint16_t e820_cnt16 = 0, ext_kib16 = 0, e801_kib16 = 0,
+		e801_blks16 = 0;
+
 /* Helper routine for int 0x15, ax = 0x8300, & int 0x15, ah = 0x86. */
 static void
 wait_us (isr16_regs_t * regs, uint16_t wait_flag_seg, uint16_t wait_flag_off)
@@ -73,6 +89,131 @@ cancel_wait (isr16_regs_t * regs)
   regs->flags &= ~EFL_C;
 }
 
+/*
+ * Helper routine for int 0x15, ax = 0xe820.  The continuation value in ebx
+ * is simply the index of the next table entry.
+ */
+static void
+get_e820 (isr16_regs_t * regs)
+{
+  uint16_t seg = e820_tab16 >> 16, off = (uint16_t) e820_tab16, i, sz;
+  uint32_t idx = regs->ebx;
+  if (regs->edx != SMAP || regs->ecx < 20 || idx >= e820_cnt16)
+    {
+      regs->ah = E15_UNSUPP;
+      regs->flags |= EFL_C;
+      return;
+    }
+  sz = regs->ecx < sizeof (e820_ent_t) ? 20 : sizeof (e820_ent_t);
+  off += idx * sizeof (e820_ent_t);
+  for (i = 0; i < sz; ++i)
+    pokeb (regs->es, (uint16_t) (regs->di + i), peekb (seg, off + i));
+  regs->eax = SMAP;
+  regs->ecx = sz;
+  regs->ebx = idx + 1 < e820_cnt16 ? idx + 1 : 0;
+  regs->flags &= ~EFL_C;
+}
+
+/* Say whether the A20 gate is enabled. */
+static uint8_t
+a20_get (void)
+{
+  return (inp (PORT_SYS_CTL_A) & SCA_A20) != 0;
+}
+
+/* Enable or disable the A20 gate, via the fast A20 gate. */
+static void
+a20_set (uint8_t on)
+{
+  uint8_t sca = inp (PORT_SYS_CTL_A) & ~SCA_RESET;
+  if (on)
+    sca |= SCA_A20;
+  else
+    sca &= ~SCA_A20;
+  outp (PORT_SYS_CTL_A, sca);
+}
+
+/* Helper routine for int 0x15, ax = 0x2400--0x2403. */
+static void
+a20_fn (isr16_regs_t * regs)
+{
+  switch (regs->al)
+    {
+    case 0x00:
+    case 0x01:
+      a20_set (regs->al);
+      break;
+    case 0x02:
+      regs->al = a20_get ();
+      break;
+    case 0x03:
+      regs->bx = 0x0002;		/* only port 0x92 is supported */
+      break;
+    default:
+      regs->ah = E15_UNSUPP;
+      regs->flags |= EFL_C;
+      return;
+    }
+  regs->ah = 0;
+  regs->flags &= ~EFL_C;
+}
+
+/*
+ * Return the base address of the segment descriptor at `seg':`off', in a
+ * descriptor table for int 0x15, ah = 0x87.
+ */
+static uint32_t
+desc_base (uint16_t seg, uint16_t off)
+{
+  return (uint32_t) peekb (seg, off + 2)
+	 | (uint32_t) peekb (seg, off + 3) << 8
+	 | (uint32_t) peekb (seg, off + 4) << 16
+	 | (uint32_t) peekb (seg, off + 7) << 24;
+}
+
+/* Return the limit of the segment descriptor at `seg':`off'. */
+static uint32_t
+desc_limit (uint16_t seg, uint16_t off)
+{
+  uint8_t flags = peekb (seg, off + 6);
+  uint32_t limit = (uint32_t) peekb (seg, off)
+		   | (uint32_t) peekb (seg, off + 1) << 8
+		   | (uint32_t) (flags & 0x0f) << 16;
+  if ((flags & 0x80) != 0)
+    limit = limit << 12 | 0xfff;
+  return limit;
+}
+
+/*
+ * Helper routine for int 0x15, ah = 0x87.  Take only the source &
+ * destination addresses from the caller's descriptor table, & let
+ * xmove16 (...) do the copy.
+ */
+static void
+block_move (isr16_regs_t * regs)
+{
+  uint16_t seg = regs->es, gdt = regs->si;
+  uint32_t nb = (uint32_t) regs->cx * 2;
+  uint8_t a20;
+  if (regs->cx > 0x8000
+      || (nb && (nb - 1 > desc_limit (seg, gdt + 0x10)
+		 || nb - 1 > desc_limit (seg, gdt + 0x18))))
+    {
+      regs->ah = E15_MOVE_EXC;
+      regs->flags |= EFL_C;
+      return;
+    }
+  a20 = a20_get ();
+  if (!a20)
+    a20_set (1);
+  xmove16 (desc_base (seg, gdt + 0x10), desc_base (seg, gdt + 0x18),
+	   regs->cx);
+  if (!a20)
+    a20_set (0);
+  regs->ah = 0;
+  regs->flags &= ~EFL_C;
+}
+
 void
 isr16_0x15_impl (isr16_regs_t * regs)
 {
@@ -92,12 +233,38 @@ isr16_0x15_impl (isr16_regs_t * regs)
 	  regs->flags |= EFL_C;
 	}
       break;
+    case 0x24:
+      a20_fn (regs);
+      break;
     case 0x86:
       wait_us (regs, BDA_SEG, offsetof (bda_t, wait_active));
       if ((regs->flags & EFL_C) == 0)
 	while (!(bda.wait_active & BDA_WAIT_FIN))
 	  yield_to_irq ();
       break;
+    case 0x87:
+      block_move (regs);
+      break;
+    case 0x88:
+      regs->ax = ext_kib16;
+      regs->flags &= ~EFL_C;
+      break;
+    case 0xe8:
+      switch (regs->al)
+	{
+	case 0x01:
+	  regs->ax = regs->cx = e801_kib16;
+	  regs->bx = regs->dx = e801_blks16;
+	  regs->flags &= ~EFL_C;
+	  break;
+	case 0x20:
+	  get_e820 (regs);
+	  break;
+	default:
+	  regs->ah = E15_UNSUPP;
+	  regs->flags |= EFL_C;
+	}
+      break;
     default:
       isr16_unimpl (regs->eax, regs->edx, 0x15);
     }
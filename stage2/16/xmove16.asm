@@ -0,0 +1,111 @@
+; Copyright (c) 2023 TK Chia
+;
+; Redistribution and use in source and binary forms, with or without
+; modification, are permitted provided that the following conditions are
+; met:
+;
+;   * Redistributions of source code must retain the above copyright
+;     notice, this list of conditions and the following disclaimer.
+;   * Redistributions in binary form must reproduce the above copyright
+;     notice, this list of conditions and the following disclaimer in the
+;     documentation and/or other materials provided with the distribution.
+;   * Neither the name of the developer(s) nor the names of its
+;     contributors may be used to endorse or promote products derived from
+;     this software without specific prior written permission.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+; IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+; TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+; PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+; HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+; SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+; TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+; PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+; LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+; NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+; SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+%include "stage2/stage2.inc"
+
+; Selector for the flat data segment in our little GDT below.
+SEL_FLAT equ	0x0008
+
+	section	.text
+
+	bits	16
+
+	extern	tb16
+
+; Copy ecx 16-bit words from linear address eax to linear address edx, for
+; int 0x15, ah = 0x87.  Rather than do the whole copy in protected mode,
+; just load ds & es with flat 4 GiB segments, go back to real mode, & copy
+; with 32-bit addressing ("unreal mode").  Interrupts should be disabled,
+; & A20 enabled.
+;
+; This is a near routine, called from 16-bit C code.
+	global	xmove16
+xmove16:
+	push	ds
+	push	es
+	push	esi
+	push	edi
+	push	ebx
+	xchg	esi, eax
+	mov	edi, edx
+	mov	bx, cs			; set up a GDTR for our GDT, after
+	movzx	eax, bx			; space to save the caller's GDTR
+	shl	eax, 4
+	add	eax, gdt
+	push	eax
+	push	word gdt.end-gdt-1
+	sub	sp, 6
+	mov	bx, sp
+	o32 sgdt [ss:bx]
+	o32 lgdt [ss:bx+6]
+	mov	eax, cr0		; load the flat segments in protected
+	or	al, CR0_PE		; mode
+	mov	cr0, eax
+	jmp	short .pm
+.pm:
+	mov	dx, SEL_FLAT
+	mov	ds, dx
+	mov	es, dx
+	and	al, ~CR0_PE		; go back to real mode; ds & es keep
+	mov	cr0, eax		; their 4 GiB limits
+	jmp	short .rm
+.rm:
+	xor	dx, dx
+	mov	ds, dx
+	mov	es, dx
+	o32 lgdt [ss:bx]		; restore the caller's GDTR
+	add	sp, 12
+	cld				; copy dwords, then any odd word;
+	shr	ecx, 1			; movs leaves CF alone
+	a32 rep movsd
+	adc	cx, cx
+	a32 rep movsw
+	pop	ebx
+	pop	edi
+	pop	esi
+	pop	es
+	pop	ds
+	o32 ret
+
+; Issue int 0x15, ah = 0x87, on the descriptor table in tb16, to move ecx
+; words.  Return the status in eax.  This is called via rm16_call (...),
+; for benchmarking.
+	global	xmove16f
+xmove16f:
+	mov	si, tb16
+	mov	ah, 0x87
+	int	0x15
+	movzx	eax, ah
+	retf
+
+	align	8
+gdt:	dq	0
+%if SEL_FLAT != $-gdt
+%   error "SEL_FLAT does not match actual GDT"
+%endif
+	dq	0x008f92000000ffff	; 16-bit data seg. with 4 GiB limit
+.end:
@@ -41,10 +41,29 @@
 #define NANOPRINTF_USE_BINARY_FORMAT_SPECIFIERS 0
 #define NANOPRINTF_USE_WRITEBACK_FORMAT_SPECIFIERS 0
 #define NANOPRINTF_IMPLEMENTATION 1
+#include <stdbool.h>
 #include <string.h>
 #include "stage2/stage2.h"
 #include "nanoprintf/nanoprintf.h"
 
+/* Serial port (COM1) I/O port numbers. */
+#define PORT_COM1_DATA	0x03f8		/* data (or divisor low byte) */
+#define PORT_COM1_IER	0x03f9		/* interrupt enable (or divisor high
+					   byte) */
+#define PORT_COM1_FCR	0x03fa		/* FIFO control */
+#define PORT_COM1_LCR	0x03fb		/* line control */
+#define PORT_COM1_MCR	0x03fc		/* modem control */
+#define PORT_COM1_LSR	0x03fd		/* line status */
+#define PORT_COM1_SCR	0x03ff		/* scratch */
+
+/* Serial port register bit fields & values. */
+#define LCR_8N1		0x03		/* 8 data bits, no parity, 1 stop */
+#define LCR_DLAB	0x80		/* divisor latch access */
+#define FCR_ENA_CLR	0x07		/* enable & clear FIFOs */
+#define MCR_DTR_RTS	0x03		/* assert DTR & RTS */
+#define LSR_THRE	0x20		/* transmit holding register empty */
+#define COM_DIV_115200	1		/* divisor for 115 200 bps */
+
 struct our_pf_ctx
 {
   size_t pos;
@@ -119,3 +138,64 @@ wherex (void)
   extern int wherex16f (/* ... */);
   return rm16_cs_call (0, 0, 0, 0, wherex16f);
 }
+
+static bool com1_probed = false, com1_present = false;
+
+static void
+com1_init (void)
+{
+  com1_probed = true;
+  outp (PORT_COM1_SCR, 0x5a);
+  if (inp (PORT_COM1_SCR) != 0x5a)
+    return;
+  outp (PORT_COM1_IER, 0);
+  outp (PORT_COM1_LCR, LCR_DLAB);
+  outp (PORT_COM1_DATA, COM_DIV_115200);
+  outp (PORT_COM1_IER, 0);
+  outp (PORT_COM1_LCR, LCR_8N1);
+  outp (PORT_COM1_FCR, FCR_ENA_CLR);
+  outp (PORT_COM1_MCR, MCR_DTR_RTS);
+  com1_present = true;
+}
+
+static void
+com1_putc_1 (int c, void *pv)
+{
+  uint32_t retries = 0x100000;
+  while ((inp (PORT_COM1_LSR) & LSR_THRE) == 0 && retries-- != 0);
+  outp (PORT_COM1_DATA, (uint8_t) c);
+}
+
+static void
+com1_putc (int c, void *pv)
+{
+  if ((char) c == '\n')
+    com1_putc_1 ('\r', pv);
+  com1_putc_1 (c, pv);
+}
+
+/*
+ * Write formatted output to the first serial port, if there is one.  This
+ * is meant for output that the user might want to capture & process
+ * elsewhere.
+ */
+int
+vcomprintf (const char *fmt, va_list ap)
+{
+  if (!com1_probed)
+    com1_init ();
+  if (!com1_present)
+    return 0;
+  return npf_vpprintf (com1_putc, NULL, fmt, ap);
+}
+
+int
+comprintf (const char *fmt, ...)
+{
+  va_list ap;
+  int res;
+  va_start (ap, fmt);
+  res = vcomprintf (fmt, ap);
+  va_end (ap);
+  return res;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Pools of buffers for bus-master DMA --- descriptor rings, command lists,
+ * & the like.  Each pool hands out buffers of one size, which all meet the
+ * pool's alignment, boundary, & address limits.  Buffers come from chunks
+ * of memory obtained from mem_alloc (...), & freed buffers go onto the
+ * pool's free list for reuse, so that drivers can allocate & free
+ * descriptors without churning the physical allocator.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include "stage2/stage2.h"
+
+/* A free buffer. */
+typedef struct dma_free_buf
+{
+  struct dma_free_buf *next;
+} dma_free_buf_t;
+
+static bool
+is_pow2 (uint32_t x)
+{
+  return x != 0 && (x & (x - 1)) == 0;
+}
+
+/*
+ * Set up a DMA buffer pool.  Each buffer is `buf_sz' bytes, aligned to
+ * `align' bytes, & must not cross a multiple of `boundary' bytes (if
+ * `boundary' != 0).  If `max_addr' != 0, each buffer must end at or below
+ * `max_addr'.
+ */
+void
+dma_pool_init (dma_pool_t * pool, const char *name, uint32_t buf_sz,
+	       uint32_t align, uint32_t boundary, uintptr_t max_addr)
+{
+  uint32_t chunk_sz;
+  if (align < sizeof (dma_free_buf_t))
+    align = sizeof (dma_free_buf_t);
+  if (!buf_sz || !is_pow2 (align) || (boundary && !is_pow2 (boundary)))
+    hlt ();
+  buf_sz = (buf_sz + align - 1) & -align;
+  if (boundary && buf_sz > boundary)
+    hlt ();
+  /*
+   * Get memory a page at a time, or in the smallest power of 2 that
+   * holds a buffer.  A chunk aligned to its own size then never crosses
+   * a boundary bigger than itself.
+   */
+  chunk_sz = PAGE_SIZE;
+  while (chunk_sz < buf_sz || chunk_sz < align)
+    chunk_sz *= 2;
+  pool->name = name;
+  pool->buf_sz = buf_sz;
+  pool->align = align;
+  pool->boundary = boundary;
+  pool->max_addr = max_addr;
+  pool->chunk_sz = chunk_sz;
+  pool->free_list = NULL;
+  pool->num_bufs = pool->num_free = 0;
+}
+
+/* Carve a new chunk of memory into buffers, & put them on the free list. */
+static void
+dma_pool_grow (dma_pool_t * pool)
+{
+  uint32_t buf_sz = pool->buf_sz, boundary = pool->boundary,
+	   chunk_sz = pool->chunk_sz, off = 0;
+  char *chunk = mem_alloc (chunk_sz, chunk_sz, pool->max_addr, MTAG_DMA);
+  dma_free_buf_t *head = pool->free_list;
+  while (off + buf_sz <= chunk_sz)
+    {
+      uint32_t pa = (uint32_t) dma_pa (chunk + off);
+      if (boundary && pa / boundary != (pa + buf_sz - 1) / boundary)
+	{
+	  off = (off + boundary) & -boundary;
+	  continue;
+	}
+      ((dma_free_buf_t *) (chunk + off))->next = head;
+      head = (dma_free_buf_t *) (chunk + off);
+      ++pool->num_bufs;
+      ++pool->num_free;
+      off += buf_sz;
+    }
+  pool->free_list = head;
+}
+
+/* Allocate a zeroed buffer from a DMA pool. */
+void *
+dma_alloc (dma_pool_t * pool)
+{
+  dma_free_buf_t *buf = pool->free_list;
+  if (!buf)
+    {
+      dma_pool_grow (pool);
+      buf = pool->free_list;
+    }
+  pool->free_list = buf->next;
+  --pool->num_free;
+  memset (buf, 0, pool->buf_sz);
+  return buf;
+}
+
+/* Return a buffer to the DMA pool it came from. */
+void
+dma_free (dma_pool_t * pool, void *p)
+{
+  dma_free_buf_t *buf = p;
+  if (!p)
+    return;
+  buf->next = pool->free_list;
+  pool->free_list = buf;
+  ++pool->num_free;
+}
@@ -47,21 +47,26 @@
 #define ICW4_X86	0x01		/* 8086 (vs. 8080/8085) mode */
 #define ICW4_EOI	0x02		/* auto EOI */
 
+/* Local APIC ids. of the usable processors listed in the MADT. */
+static uint8_t cpu_apic_ids[MAX_CPUS];
+static unsigned num_cpus = 0;
+
 /*
  * Map an entire ACPI system description table from physical memory into
- * virtual memory.
+ * virtual memory.  The header mapping usually already covers the whole
+ * table, in which case the second mmio_map (...) is just a cache hit.
  */
 static acpi_table_union_t *
 acpi_map_tab (ptr64_t tab64)
 {
   size_t sz;
   acpi_table_union_t *tab;
-  tab = mem_va_map (tab64, sizeof (acpi_table_union_t), 0);
+  tab = mmio_map (tab64, sizeof (acpi_table_union_t), MT_WB);
   sz = tab->header.length;
   if (sz > sizeof (acpi_table_union_t))
     {
-      mem_va_unmap (tab, sizeof (acpi_table_union_t));
-      tab = mem_va_map (tab64, sz, 0);
+      mmio_unmap (tab);
+      tab = mmio_map (tab64, sz, MT_WB);
     }
   return tab;
 }
@@ -73,10 +78,7 @@ acpi_map_tab (ptr64_t tab64)
 static void
 acpi_unmap_tab (acpi_table_union_t * tab)
 {
-  size_t sz = tab->header.length;
-  if (sz < sizeof (acpi_table_union_t))
-    sz = sizeof (acpi_table_union_t);
-  mem_va_unmap (tab, sz);
+  mmio_unmap (tab);
 }
 
 static void
@@ -103,15 +105,20 @@ acpi_process_madt (acpi_madt_t * madt)
       acpi_madt_ic_union_t *u = (acpi_madt_ic_union_t *) ic;
       switch (u->header.type)
 	{
+	case MADT_IC_LAPIC:
+	  if ((u->lapic.flags & MADT_LAPIC_ENABLED) != 0
+	      && num_cpus < MAX_CPUS)
+	    cpu_apic_ids[num_cpus++] = u->lapic.apic_id;
+	  break;
 	case MADT_IC_IOAPIC:
 	  ioapic_phy = u->ioapic.ioapic_phy_addr;
-	  ioapic = mem_va_map (ioapic_phy, sizeof (ioapic_t), PTE_CD);
+	  ioapic = mmio_map (ioapic_phy, sizeof (ioapic_t), MT_UC);
 	  for (io_intr = 0; io_intr < 24; ++io_intr)
 	    {
 	      ioapic->IOREGSEL = IOREDTBLLO (io_intr);
 	      ioapic->IOREGWIN |= IOAPIC_RTLO_MASKED;
 	    }
-	  mem_va_unmap (ioapic, sizeof (ioapic_t));
+	  mmio_unmap (ioapic);
 	  break;
 	default:
 	  ;
@@ -148,22 +155,33 @@ acpi_process_rsdp (acpi_xsdp_t * rsdp)
   acpi_unmap_tab (xsdt);
 }
 
+/*
+ * Return the local APIC ids. of the processors which the ACPI MADT says
+ * are usable, & the number of such processors.  Processors with only
+ * x2APIC ids. are not listed.
+ */
+unsigned
+irq_cpu_apic_ids (const uint8_t ** p_ids)
+{
+  *p_ids = cpu_apic_ids;
+  return num_cpus;
+}
+
 void
 irq_init (bparm_t * bparms)
 {
   /* Find the ACPI RSDP from the boot parameters. */
   bdat_rsdp_t *bd_rsdp;
   acpi_xsdp_t *rsdp;
-  uint32_t rsdp_sz;
-  bparm_t *bp = bparms;
-  while (bp->type != BP_RSDP)
-    bp = bp->next;
-  bd_rsdp = &bp->u->rsdp;
+  uint32_t rsdp_sz, count;
+  bd_rsdp = bparm_recs (bparms, BPI_RSDP, sizeof (bdat_rsdp_t), &count);
+  if (!bd_rsdp)
+    hlt ();
   rsdp_sz = bd_rsdp->rsdp_sz;
-  rsdp = mem_va_map (bd_rsdp->rsdp_phy_addr, rsdp_sz, 0);
+  rsdp = mmio_map (bd_rsdp->rsdp_phy_addr, rsdp_sz, MT_WB);
   /* Process the RSDP to disable APIC interrupts. */
   acpi_process_rsdp (rsdp);
-  mem_va_unmap (rsdp, rsdp_sz);
+  mmio_unmap (rsdp);
   /*
    * Bring up the legacy 8259 interrupt controllers.
    *
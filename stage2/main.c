@@ -33,53 +33,124 @@
 #include <string.h>
 #include "pci-common.h"
 #include "stage2/stage2.h"
+#include "stage2/pci.h"
+
+/*
+ * Devices with identical PCI 3.0+ option ROM images share one boot-time
+ * copy (see stage1/pci.c).  A ROM's initialization code may write to its
+ * own image, so keep a pristine copy of each shared image from before it
+ * first runs, & put it back before each later run.
+ */
+typedef struct rimg_saved
+{
+  struct rimg_saved *next;
+  uint16_t seg;
+  uint32_t sz;
+  char img[];
+} rimg_saved_t;
+
+static rimg_saved_t *rimg_saved = NULL;
 
 static void
-rimg_init (bparm_t * bparms, bool init_vga)
+rimg_restore (bparm_t * bparms, const bdat_pci_dev_t * pd)
+{
+  void *img = (void *) ((uint32_t) pd->rimg_seg * PARA_SIZE);
+  const bdat_pci_dev_t *other;
+  rimg_saved_t *sv;
+  unsigned users = 0;
+  uint32_t iter;
+  if (pd->rimg_seg == pd->rimg_rt_seg)
+    return;
+  for (sv = rimg_saved; sv; sv = sv->next)
+    if (sv->seg == pd->rimg_seg)
+      {
+	memcpy (img, sv->img, sv->sz);
+	return;
+      }
+  FOR_EACH_BPARM (other, bparms, BPI_PCID, iter)
+    if (other->rimg_seg == pd->rimg_seg)
+      ++users;
+  if (users < 2)
+    return;
+  sv = mem_alloc (sizeof (rimg_saved_t) + pd->rimg_sz, 0, 0, MTAG_ROM);
+  sv->seg = pd->rimg_seg;
+  sv->sz = pd->rimg_sz;
+  memcpy (sv->img, img, sv->sz);
+  sv->next = rimg_saved;
+  rimg_saved = sv;
+}
+
+static void
+rimg_saved_fini (void)
 {
-  bparm_t *bp;
-  for (bp = bparms; bp; bp = bp->next)
+  rimg_saved_t *sv = rimg_saved, *next;
+  while (sv)
     {
-      uint16_t rimg_seg;
-      uint32_t pci_locn;
-      bdat_pci_dev_t *pd;
-      bool do_init;
-      if (bp->type != BP_PCID)
-	continue;
-      pd = &bp->u->pci_dev;
-      switch (pd->class_if)
-	{
-	case PCI_CIF_VID_VGA:
-	case PCI_CIF_VID_8514:
-	case PCI_CIF_VID_XGA:
-	  do_init = init_vga;
-	  break;
-	default:
-	  do_init = !init_vga;
-	}
-      if (!do_init)
-	continue;
-      rimg_seg = pd->rimg_seg;
-      if (!rimg_seg)
-	continue;
-      pci_locn = pd->pci_locn;
-      if (!init_vga)
-	{
-	  uint32_t pci_id = pd->pci_id;
-	  cprintf ("starting option ROM @ 0x%" PRIx16 "0 for "
-		   "PCI %04x:%02x:%02x.%x "
-		   "%04" PRIx16 ":%04" PRIx16 "\n",
-		   rimg_seg,
-		   (unsigned) (pci_locn >> 16),
-		   (unsigned) (pci_locn >> 8 & 0xff),
-		   (unsigned) (pci_locn >> 3 & 0x1f),
-		   (unsigned) (pci_locn & 7),
-		   pci_id_vendor (pci_id), pci_id_dev (pci_id));
-	}
-      rm16_call (pci_locn, 0, 0, pd->rimg_rt_seg, MK_FP16 (rimg_seg, 0x0003));
-      if (wherex () > 1)
-	putch ('\n');
+      next = sv->next;
+      mem_free (sv, sizeof (rimg_saved_t) + sv->sz, MTAG_ROM);
+      sv = next;
     }
+  rimg_saved = NULL;
+}
+
+static void
+rimg_init (bparm_t * bparms, bool init_vga)
+{
+  bdat_pci_dev_t *pd;
+  uint32_t iter;
+  FOR_EACH_BPARM (pd, bparms, BPI_PCID, iter)
+  {
+    uint16_t rimg_seg;
+    uint32_t pci_locn;
+    bool do_init;
+    switch (pd->class_if)
+      {
+      case PCI_CIF_VID_VGA:
+      case PCI_CIF_VID_8514:
+      case PCI_CIF_VID_XGA:
+	do_init = init_vga;
+	break;
+      default:
+	do_init = !init_vga;
+      }
+    if (!do_init)
+      continue;
+    rimg_seg = pd->rimg_seg;
+    if (!rimg_seg)
+      continue;
+    pci_locn = pd->pci_locn;
+    if (!init_vga)
+      {
+	uint32_t pci_id = pd->pci_id;
+	cprintf ("starting option ROM @ 0x%" PRIx16 "0 for "
+		 "PCI %04x:%02x:%02x.%x "
+		 "%04" PRIx16 ":%04" PRIx16 "\n",
+		 rimg_seg,
+		 (unsigned) (pci_locn >> 16),
+		 (unsigned) (pci_locn >> 8 & 0xff),
+		 (unsigned) (pci_locn >> 3 & 0x1f),
+		 (unsigned) (pci_locn & 7),
+		 pci_id_vendor (pci_id), pci_id_dev (pci_id));
+      }
+    rimg_restore (bparms, pd);
+    tl_begin ("option_rom", pci_locn);
+    rm16_call (pci_locn, 0, 0, pd->rimg_rt_seg, MK_FP16 (rimg_seg, 0x0003));
+    tl_end ("option_rom", pci_locn);
+    if (wherex () > 1)
+      putch ('\n');
+  }
+}
+
+/*
+ * Copy the boot parameter block out to extended memory, so that the base
+ * memory it sits in can be reclaimed later.
+ */
+static bparm_t *
+save_bparms (bparm_t * bparms)
+{
+  bparm_t *copy = mem_alloc (bparms->size, PAGE_SIZE, 0, MTAG_BPARM);
+  memcpy (copy, bparms, bparms->size);
+  return copy;
 }
 
 static void
@@ -93,14 +164,50 @@ hello (void)
 void
 stage2_main (bparm_t * bparms, void *rm16_load, size_t rm16_sz)
 {
+  if (bparms->magic != BP_BLK_MAGIC || bparms->ver != BP_BLK_VER)
+    hlt ();
+  tl_init (bparms);
+  tl_begin ("stage2", 0);
+  tl_begin ("mem_init", 0);
   mem_init (bparms);
-  rm16_init ();
+  bparms = save_bparms (bparms);
+  tl_end ("mem_init", 0);
+  tl_begin ("rm16_init", 0);
+  rm16_init (pci_shadow_fseg_open (bparms));
+  mem_bmem_mark ();
+  tl_end ("rm16_init", 0);
+  tl_begin ("irq_init", 0);
   irq_init (bparms);
+  tl_end ("irq_init", 0);
+  tl_begin ("time_init", 0);
   time_init (bparms);
+  tl_end ("time_init", 0);
   rimg_init (bparms, true);
   hello ();
+  tl_begin ("mtrr_init", 0);
+  mtrr_init (bparms);
+  tl_end ("mtrr_init", 0);
+#ifdef SELFTEST
+  selftest ();
+#endif
+  tl_begin ("usb_init", 0);
   usb_init (bparms);
+  tl_end ("usb_init", 0);
   rimg_init (bparms, false);
+  rimg_saved_fini ();
+  pci_shadow_lock (bparms);
+#ifdef MEMSCRUB
+  tl_begin ("mem_scrub", 0);
+  mem_scrub ();
+  tl_end ("mem_scrub", 0);
+#endif
+  tl_begin ("bmem_fini", 0);
+  mem_bmem_fini ();
+  tl_end ("bmem_fini", 0);
+  tl_end ("stage2", 0);
+  tl_dump ();
+  slab_dump ();
+  mem_acct_dump (bparms);
   cputs ("system halted\n");
   hlt ();
 }
@@ -33,20 +33,109 @@
 #include <string.h>
 #include "stage2/stage2.h"
 
+#define EFI_MEMORY_UC	(1ULL <<  0)
+#define EFI_MEMORY_WC	(1ULL <<  1)
 #define EFI_MEMORY_WT	(1ULL <<  2)
 #define EFI_MEMORY_WB	(1ULL <<  3)
 
+/*
+ * Our setting for the page attribute table (PAT).  Entries 0--3 are left
+ * at their power-on defaults, so that the PTE_WT & PTE_CD bits keep their
+ * usual meanings.  Entry 5 --- PTE_PAT | PTE_WT --- is changed from WT to
+ * WC.
+ */
+#define PAT_UC		0x00U
+#define PAT_WC		0x01U
+#define PAT_WT		0x04U
+#define PAT_WB		0x06U
+#define PAT_UCM		0x07U
+#define PAT_ENT(i, t)	((uint64_t) (t) << 8 * (i))
+#define PAT_VALUE	(PAT_ENT (0, PAT_WB) | PAT_ENT (1, PAT_WT) | \
+			 PAT_ENT (2, PAT_UCM) | PAT_ENT (3, PAT_UC) | \
+			 PAT_ENT (4, PAT_WB) | PAT_ENT (5, PAT_WC) | \
+			 PAT_ENT (6, PAT_UCM) | PAT_ENT (7, PAT_UC))
+
 /* Structure for a range of (unused) 32-bit virtual addresses. */
 typedef struct
 {
   uint32_t start, len;
 } va_range_t;
 
-static unsigned num_mem_ranges = 0, max_mem_ranges = 0,
-		num_unused_va_ranges = 0, max_unused_va_ranges = 0;
+/*
+ * Unused virtual address ranges are kept in two treaps which share their
+ * nodes: one ordered by start address, for finding neighbours to coalesce
+ * with, & one ordered by (length, start address), for best-fit searches.
+ * Nodes come from slab_alloc (.).
+ */
+#define VA_T_ADDR	0		/* treap ordered by start address */
+#define VA_T_SIZE	1		/* treap ordered by length */
+
+typedef struct va_node
+{
+  uint32_t start, len, prio;
+  struct va_node *kid[2][2];		/* [treap][left/right] */
+} va_node_t;
+
+/*
+ * Physical memory in extended memory below 4 GiB is managed by a buddy
+ * allocator.  Each free block of 2^order pages is aligned to its own size,
+ * & has a free_blk_t node at its start, linking it into the free list for
+ * its order.  The pg_info[] array has one byte per physical page, saying
+ * whether the page starts a free block & if so, of what order.
+ */
+#define MAX_ORDER	20		/* block orders go up to MAX_ORDER - 1 */
+#define PG_FREE		0x80U		/* page starts a free block */
+#define PG_ORDER_MASK	0x1fU		/* order of free block */
+
+typedef struct free_blk
+{
+  struct free_blk *next, *prev;
+} free_blk_t;
+
+static unsigned num_mem_ranges = 0, max_mem_ranges = 0;
 static mem_range_t *mem_ranges;
-static va_range_t *unused_va_ranges;
+/* Whether mem_ranges[] has been moved to memory from mem_alloc (...). */
+static bool mem_ranges_moved = false;
+/*
+ * End of the boot-time base memory area, which holds the boot parameters
+ * & other ephemera from stage 1.  This is kept reserved until
+ * mem_bmem_fini (...) hands it back, or 0 if it has been handed back.
+ */
+static uint32_t boottime_bmem_bot = 0;
+/*
+ * Conventional memory size (0x40:0x13) & EBDA segment (0x40:0x0e) from
+ * before any option ROMs ran.  See mem_bmem_mark ().
+ */
+static uint16_t marked_base_kib = 0, marked_ebda_seg = 0;
+static va_node_t *va_root[2] = { NULL, NULL };
+static uint32_t va_prio_seed = UINT32_C (2463534242), num_va_ranges = 0,
+		va_free_bytes = 0;
 static uint64_t *pdpt = NULL;
+/*
+ * TLB invalidations which are pending until the end of a batch of mapping
+ * changes.  If there are too many, just flush all non-global TLB entries.
+ */
+#define MAX_INVALS	32
+
+static uint8_t *pg_info = NULL;
+static uint32_t num_pgs = 0, num_free_pgs = 0;
+static free_blk_t *free_lists[MAX_ORDER];
+static unsigned pte_global = 0, batch_depth = 0, num_invals = 0;
+static bool inval_all = false, have_pat = false;
+static uint32_t invals[MAX_INVALS];
+/*
+ * Per-subsystem accounting of the memory handed out by mem_alloc (...) &
+ * such, indexed by memory accounting tag.  Each allocation is charged the
+ * bytes it actually takes out of the memory map or the buddy free lists,
+ * & each free is credited the bytes it puts back.
+ */
+typedef struct
+{
+  uint32_t in_use, peak, num_allocs;
+} mem_acct_t;
+
+static mem_acct_t mem_acct[MTAG_MAX];
+static const char *const mtag_names[MTAG_MAX] = { MTAG_NAMES };
 
 static void
 shellsort (mem_range_t * mrs, unsigned nmr)
@@ -136,8 +225,9 @@ mem_map_init (bparm_t * bparms)
 {
   unsigned nmr, mmr;
   size_t e820_need_space;
-  bparm_t *bp;
-  bdat_mem_range_t *bdmr, *bdmr_chosen = NULL;
+  uint32_t num_bdmrs, bdmr_idx, num_bmems;
+  bdat_mem_range_t *bdmrs, *bdmr, *bdmr_chosen = NULL;
+  bdat_bmem_t *bmem;
   mem_range_t *mrs, *mr;
   /*
    * Copy the memory map passed in the stage 1 boot parameters to
@@ -149,10 +239,9 @@ mem_map_init (bparm_t * bparms)
    * current number of entries, to allow for some memory blocks to be
    * split into two later.
    */
-  mmr = 1;
-  for (bp = bparms; bp; bp = bp->next)
-    if (bp->type == BP_MRNG && bp->u->mem_range.len != 0)
-      ++mmr;
+  bdmrs = bparm_recs (bparms, BPI_MRNG, sizeof (bdat_mem_range_t),
+		      &num_bdmrs);
+  mmr = 1 + num_bdmrs;
   mmr = (3 * mmr + 1) / 2;
   if (mmr < 16)
     mmr = 16;
@@ -162,12 +251,10 @@ mem_map_init (bparm_t * bparms)
    * below the 4 GiB mark.  Try to store the memory map as high in
    * extended memory as possible.
    */
-  for (bp = bparms; bp; bp = bp->next)
+  for (bdmr_idx = 0; bdmr_idx < num_bdmrs; ++bdmr_idx)
     {
       uint64_t start, len;
-      if (bp->type != BP_MRNG)
-	continue;
-      bdmr = &bp->u->mem_range;
+      bdmr = &bdmrs[bdmr_idx];
       start = bdmr->start;
       len = bdmr->len;
       if (bdmr->e820_type != E820_RAM ||
@@ -185,11 +272,9 @@ mem_map_init (bparm_t * bparms)
   /* Copy out the memory map.  Discard memory ranges of length zero. */
   mr = mrs;
   nmr = 0;
-  for (bp = bparms; bp; bp = bp->next)
+  for (bdmr_idx = 0; bdmr_idx < num_bdmrs; ++bdmr_idx)
     {
-      if (bp->type != BP_MRNG)
-	continue;
-      bdmr = &bp->u->mem_range;
+      bdmr = &bdmrs[bdmr_idx];
       if (!bdmr->len)
 	continue;
       mr->start = bdmr->start;
@@ -220,6 +305,151 @@ mem_map_init (bparm_t * bparms)
   mem_ranges = mrs;
   num_mem_ranges = nmr;
   max_mem_ranges = mmr;
+  /*
+   * Stage 1 reports the boot-time area at the bottom of base memory as
+   * free, but we still need what is there.  Fence it off for now.
+   */
+  bmem = bparm_recs (bparms, BPI_BMEM, sizeof (bdat_bmem_t), &num_bmems);
+  if (bmem)
+    {
+      uint32_t bot = (uint32_t) bmem->boottime_bmem_bot_seg * PARA_SIZE;
+      mr = &mrs[0];
+      if (!mr->start && mr->e820_type == E820_RAM && mr->len > bot)
+	{
+	  split_range (mr, bot, E820_RESERVED, E820_RAM);
+	  boottime_bmem_bot = bot;
+	}
+    }
+}
+
+/*
+ * Merge runs of adjacent memory address ranges which have the same type &
+ * attributes.
+ */
+static void
+coalesce_ranges (void)
+{
+  unsigned i, j = 0;
+  for (i = 0; i < num_mem_ranges; ++i)
+    {
+      mem_range_t *mr = &mem_ranges[i], *prev = &mem_ranges[j ? j - 1 : 0];
+      if (j && prev->start + prev->len == mr->start
+	  && prev->e820_type == mr->e820_type
+	  && prev->e820_ext_attr == mr->e820_ext_attr
+	  && prev->uefi_attr == mr->uefi_attr)
+	prev->len += mr->len;
+      else
+	mem_ranges[j++] = *mr;
+    }
+  num_mem_ranges = j;
+}
+
+/*
+ * Change the type of the parts of [start, start + len) which the memory
+ * map gives as type `from', to type `to'.
+ */
+static void
+retype_range (uint64_t start, uint64_t len, uint32_t from, uint32_t to)
+{
+  uint64_t end = start + len;
+  unsigned i;
+  for (i = 0; i < num_mem_ranges; ++i)
+    {
+      mem_range_t *mr = &mem_ranges[i];
+      uint64_t mr_end = mr->start + mr->len;
+      if (mr->start >= end)
+	break;
+      if (mr_end <= start || mr->e820_type != from)
+	continue;
+      /* Split off any part below `start'; the rest is the next range. */
+      if (mr->start < start)
+	split_range (mr, start, from, from);
+      else if (mr_end > end)
+	split_range (mr, end, to, from);
+      else
+	mr->e820_type = to;
+    }
+  coalesce_ranges ();
+}
+
+/*
+ * Invalidate any TLB entry for the page at virtual address `va', or, if we
+ * are in a batch of mapping changes, remember to do so at the end.
+ */
+static void
+va_inval (uint32_t va)
+{
+  if (!batch_depth)
+    {
+      invlpg ((void *) va);
+      return;
+    }
+  if (inval_all)
+    return;
+  if (num_invals == MAX_INVALS)
+    inval_all = true;
+  else
+    invals[num_invals++] = va;
+}
+
+/*
+ * Make sure there is no stale TLB entry for a page about to be mapped.  A
+ * page unmapped earlier in the current batch may still have one.  If
+ * `large' is true, the new mapping is a large page, & any stale entry for
+ * a small page anywhere within it must go too.
+ */
+static void
+va_inval_stale (uint32_t va, bool large)
+{
+  unsigned i;
+  bool found = false;
+  if (inval_all)
+    {
+      if (large)
+	flush_cr3 ();
+      else
+	invlpg ((void *) va);
+      return;
+    }
+  for (i = 0; i < num_invals; ++i)
+    if ((invals[i] & -LARGE_PAGE_SIZE) == (va & -LARGE_PAGE_SIZE))
+      {
+	if (!large)
+	  {
+	    invlpg ((void *) va);
+	    return;
+	  }
+	invlpg ((void *) invals[i]);
+	found = true;
+      }
+  if (found)
+    invlpg ((void *) va);
+}
+
+/*
+ * Start a batch of changes to virtual memory mappings.  TLB invalidations
+ * are deferred until the matching mem_va_batch_end ().  Batches may nest.
+ */
+void
+mem_va_batch_begin (void)
+{
+  ++batch_depth;
+}
+
+/* End a batch of changes to virtual memory mappings. */
+void
+mem_va_batch_end (void)
+{
+  unsigned i;
+  if (!batch_depth || --batch_depth != 0)
+    return;
+  if (inval_all)
+    flush_cr3 ();
+  else
+    for (i = 0; i < num_invals; ++i)
+      invlpg ((void *) invals[i]);
+  num_invals = 0;
+  inval_all = false;
 }
 
 /*
@@ -241,8 +471,10 @@ ensure_pt (uint64_t * p_pde)
 	  pt = (uint64_t *) ((uint32_t) pde & -PAGE_SIZE);
 	  return pt;
 	}
-      pt = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0);
-      pte = pde & ~(uint64_t) PDE_PS;
+      pt = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0, MTAG_PGTBL);
+      pte = pde & ~(uint64_t) (PDE_PS | PDE_PAT);
+      if ((pde & PDE_PAT) != 0)
+	pte |= PTE_PAT;
       for (i = 0; i <= 0x1ff; ++i)
 	{
 	  pt[i] = pte;
@@ -251,7 +483,7 @@ ensure_pt (uint64_t * p_pde)
     }
   else
     {
-      pt = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0);
+      pt = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0, MTAG_PGTBL);
       memset (pt, 0, PAGE_SIZE);
     }
   pde = (uint32_t) pt | PTE_P | PTE_RW | PTE_US;
@@ -259,6 +491,21 @@ ensure_pt (uint64_t * p_pde)
   return pt;
 }
 
+/* Say whether a PDE points to a PT with no pages mapped. */
+static bool
+pt_unused (uint64_t pde)
+{
+  const uint64_t *pt;
+  unsigned i;
+  if ((pde & (PTE_P | PDE_PS)) != PTE_P)
+    return false;
+  pt = (const uint64_t *) ((uint32_t) pde & -PAGE_SIZE);
+  for (i = 0; i <= 0x1ff; ++i)
+    if ((pt[i] & PTE_P) != 0)
+      return false;
+  return true;
+}
+
 static void
 do_va_map (uint32_t vstart, uint64_t pstart, uint32_t len, unsigned pte_flags)
 {
@@ -270,10 +517,36 @@ do_va_map (uint32_t vstart, uint64_t pstart, uint32_t len, unsigned pte_flags)
       pd = (uint64_t *) ((uint32_t) pdpte & -PDPT_ALIGN);
       if (vstart % LARGE_PAGE_SIZE == 0 &&
 	  pstart % LARGE_PAGE_SIZE == 0 &&
-	  len >= LARGE_PAGE_SIZE && (pd[pdi] == 0 || (pd[pdi] & PDE_PS) != 0))
+	  len >= LARGE_PAGE_SIZE && (pd[pdi] == 0 || (pd[pdi] & PDE_PS) != 0
+				     || pt_unused (pd[pdi])))
 	{
-	  pde = pstart | PTE_P | PTE_RW | PTE_US | PDE_PS | pte_flags;
-	  pd[pdi] = pde;
+	  /* The PAT index bit is in a different place in a PDE. */
+	  pde = pstart | PTE_P | PTE_RW | PTE_US | PDE_PS
+		| (pte_flags & ~PTE_PAT);
+	  if ((pte_flags & PTE_PAT) != 0)
+	    pde |= PDE_PAT;
+	  if ((pd[pdi] & PTE_P) != 0 && (pd[pdi] & PDE_PS) == 0)
+	    {
+	      /*
+	       * Replacing an empty PT left over from earlier small
+	       * mappings.  Flush any cached pointer to the PT now,
+	       * before the PT's page can be reused, along with any
+	       * stale TLB entries for the PT's old small pages.
+	       */
+	      pt = (uint64_t *) ((uint32_t) pd[pdi] & -PAGE_SIZE);
+	      pd[pdi] = pde;
+	      invlpg ((void *) vstart);
+	      va_inval_stale (vstart, true);
+	      mem_free (pt, PAGE_SIZE, MTAG_PGTBL);
+	    }
+	  else
+	    {
+	      if ((pd[pdi] & PTE_P) != 0)
+		va_inval (vstart);
+	      else
+		va_inval_stale (vstart, true);
+	      pd[pdi] = pde;
+	    }
 	  vstart += LARGE_PAGE_SIZE;
 	  pstart += LARGE_PAGE_SIZE;
 	  len -= LARGE_PAGE_SIZE;
@@ -282,6 +555,10 @@ do_va_map (uint32_t vstart, uint64_t pstart, uint32_t len, unsigned pte_flags)
 	{
 	  unsigned pti = (vstart >> 12) & 0x1ff;
 	  pt = ensure_pt (&pd[pdi]);
+	  if ((pt[pti] & PTE_P) != 0)
+	    va_inval (vstart);
+	  else
+	    va_inval_stale (vstart, false);
 	  pt[pti] = pstart | PTE_P | PTE_RW | PTE_US | pte_flags;
 	  vstart += PAGE_SIZE;
 	  pstart += PAGE_SIZE;
@@ -293,7 +570,7 @@ do_va_map (uint32_t vstart, uint64_t pstart, uint32_t len, unsigned pte_flags)
 static void
 do_va_id_map (uint32_t start, uint32_t len, unsigned pte_flags)
 {
-  do_va_map (start, (uint64_t) start, len, pte_flags);
+  do_va_map (start, (uint64_t) start, len, pte_flags | pte_global);
 }
 
 static void
@@ -311,6 +588,7 @@ do_va_unmap (uint32_t vstart, uint32_t len)
 	  if (vstart % LARGE_PAGE_SIZE == 0 && len >= LARGE_PAGE_SIZE)
 	    {
 	      pd[pdi] = 0;
+	      va_inval (vstart);
 	      vstart += LARGE_PAGE_SIZE;
 	      len -= LARGE_PAGE_SIZE;
 	    }
@@ -330,7 +608,11 @@ do_va_unmap (uint32_t vstart, uint32_t len)
 	    {
 	      unsigned pti = (vstart >> 12) & 0x1ff;
 	      pt = (uint64_t *) ((uint32_t) pde & -PAGE_SIZE);
-	      pt[pti] = 0;
+	      if ((pt[pti] & PTE_P) != 0)
+		{
+		  pt[pti] = 0;
+		  va_inval (vstart);
+		}
 	    }
 	  vstart += PAGE_SIZE;
 	  len -= PAGE_SIZE;
@@ -338,28 +620,292 @@ do_va_unmap (uint32_t vstart, uint32_t len)
     }
 }
 
+/* Work out the PTE flags to use for a given memory type. */
+static unsigned
+mt_to_pte_flags (unsigned mt)
+{
+  switch (mt)
+    {
+    case MT_WB:
+      return 0;
+    case MT_WT:
+      return PTE_WT;
+    case MT_UCM:
+      return PTE_CD;
+    case MT_UC:
+      return PTE_CD | PTE_WT;
+    case MT_WC:
+      /* Without a PAT, UC- is the nearest we can get to WC. */
+      return have_pat ? PTE_PAT | PTE_WT : PTE_CD;
+    default:
+      hlt ();
+      __builtin_unreachable ();
+    }
+}
+
+/*
+ * Pick a memory type for a range in the UEFI memory map, out of those it
+ * supports.  Prefer write-combining to write-through, since the memory is
+ * likely a frame buffer.
+ */
 static unsigned
 uefi_attr_to_pte_flags (uint64_t uefi_attr)
 {
   if ((uefi_attr & EFI_MEMORY_WB) != 0)
-    return 0;
+    return mt_to_pte_flags (MT_WB);
+  else if ((uefi_attr & EFI_MEMORY_WC) != 0)
+    return mt_to_pte_flags (MT_WC);
   else if ((uefi_attr & EFI_MEMORY_WT) != 0)
-    return PTE_WT;
+    return mt_to_pte_flags (MT_WT);
+  else if ((uefi_attr & EFI_MEMORY_UC) != 0)
+    return mt_to_pte_flags (MT_UC);
   else
-    return PTE_CD;
+    return mt_to_pte_flags (MT_UCM);
+}
+
+/* Say whether node `a' comes before node `b' in the given treap. */
+static bool
+va_before (const va_node_t * a, const va_node_t * b, unsigned t)
+{
+  if (t == VA_T_SIZE && a->len != b->len)
+    return a->len < b->len;
+  return a->start < b->start;
+}
+
+static va_node_t *
+va_treap_insert (va_node_t * root, va_node_t * n, unsigned t)
+{
+  va_node_t *kid;
+  unsigned d;
+  if (!root)
+    {
+      n->kid[t][0] = n->kid[t][1] = NULL;
+      return n;
+    }
+  d = va_before (root, n, t);
+  kid = va_treap_insert (root->kid[t][d], n, t);
+  root->kid[t][d] = kid;
+  if (kid->prio <= root->prio)
+    return root;
+  root->kid[t][d] = kid->kid[t][!d];
+  kid->kid[t][!d] = root;
+  return kid;
+}
+
+/* Merge two treaps, where all of `a' comes before all of `b'. */
+static va_node_t *
+va_treap_merge (va_node_t * a, va_node_t * b, unsigned t)
+{
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (a->prio > b->prio)
+    {
+      a->kid[t][1] = va_treap_merge (a->kid[t][1], b, t);
+      return a;
+    }
+  b->kid[t][0] = va_treap_merge (a, b->kid[t][0], t);
+  return b;
+}
+
+static va_node_t *
+va_treap_remove (va_node_t * root, va_node_t * n, unsigned t)
+{
+  unsigned d;
+  if (root == n)
+    return va_treap_merge (n->kid[t][0], n->kid[t][1], t);
+  d = va_before (root, n, t);
+  root->kid[t][d] = va_treap_remove (root->kid[t][d], n, t);
+  return root;
+}
+
+static va_node_t *
+va_node_new (uint32_t start, uint32_t len)
+{
+  va_node_t *n = slab_alloc (sizeof (va_node_t));
+  uint32_t x;
+  /* Pick a pseudo-random priority (xorshift32). */
+  x = va_prio_seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  va_prio_seed = x;
+  n->start = start;
+  n->len = len;
+  n->prio = x;
+  return n;
+}
+
+static void
+va_node_delete (va_node_t * n)
+{
+  slab_free (n);
+}
+
+static void
+va_range_add (va_node_t * n)
+{
+  va_root[VA_T_ADDR] = va_treap_insert (va_root[VA_T_ADDR], n, VA_T_ADDR);
+  va_root[VA_T_SIZE] = va_treap_insert (va_root[VA_T_SIZE], n, VA_T_SIZE);
+  ++num_va_ranges;
+  va_free_bytes += n->len;
+}
+
+static void
+va_range_remove (va_node_t * n)
+{
+  va_root[VA_T_ADDR] = va_treap_remove (va_root[VA_T_ADDR], n, VA_T_ADDR);
+  va_root[VA_T_SIZE] = va_treap_remove (va_root[VA_T_SIZE], n, VA_T_SIZE);
+  --num_va_ranges;
+  va_free_bytes -= n->len;
+}
+
+/* Find the smallest unused virtual address range of at least `len' bytes. */
+static va_node_t *
+va_best_fit (uint32_t len)
+{
+  va_node_t *n = va_root[VA_T_SIZE], *best = NULL;
+  while (n)
+    {
+      if (n->len >= len)
+	{
+	  best = n;
+	  n = n->kid[VA_T_SIZE][0];
+	}
+      else
+	n = n->kid[VA_T_SIZE][1];
+    }
+  return best;
+}
+
+/*
+ * Allocate `len' bytes of virtual address space.  If `large' is true, try
+ * to make the start address congruent to `phase' modulo the large page
+ * size, so that the mapping can use large pages.  Return 0 if there is no
+ * unused range big enough.
+ */
+static uint32_t
+va_alloc (uint32_t len, bool large, uint32_t phase)
+{
+  va_node_t *n = NULL;
+  uint32_t start, end, vstart, vend;
+  if (large && len <= (uint32_t) -LARGE_PAGE_SIZE)
+    n = va_best_fit (len + LARGE_PAGE_SIZE - PAGE_SIZE);
+  if (!n)
+    n = va_best_fit (len);
+  if (!n)
+    return 0;
+  /* Take the addresses from the top of the range. */
+  start = n->start;
+  end = start + n->len;
+  vstart = end - len;
+  if (large && (vstart - phase) % LARGE_PAGE_SIZE <= vstart - start)
+    vstart -= (vstart - phase) % LARGE_PAGE_SIZE;
+  vend = vstart + len;
+  /* Put back what remains below & above the allocated addresses. */
+  va_range_remove (n);
+  if (start != vstart)
+    {
+      n->len = vstart - start;
+      va_range_add (n);
+      n = NULL;
+    }
+  if (vend != end)
+    {
+      if (!n)
+	n = va_node_new (vend, end - vend);
+      else
+	{
+	  n->start = vend;
+	  n->len = end - vend;
+	}
+      va_range_add (n);
+      n = NULL;
+    }
+  if (n)
+    va_node_delete (n);
+  return vstart;
+}
+
+/*
+ * Return `len' bytes of virtual address space at `start', coalescing them
+ * with any adjacent unused ranges.
+ */
+static void
+va_release (uint32_t start, uint32_t len)
+{
+  va_node_t *n = va_root[VA_T_ADDR], *pred = NULL, *succ = NULL;
+  uint32_t end = start + len;
+  while (n)
+    {
+      if (n->start < start)
+	{
+	  pred = n;
+	  n = n->kid[VA_T_ADDR][1];
+	}
+      else
+	{
+	  succ = n;
+	  n = n->kid[VA_T_ADDR][0];
+	}
+    }
+  /* Catch attempts to free addresses which are already unused. */
+  if ((pred && pred->start + pred->len > start)
+      || (succ && succ->start < end))
+    hlt ();
+  if (pred && pred->start + pred->len == start)
+    {
+      va_range_remove (pred);
+      start = pred->start;
+      n = pred;
+    }
+  if (succ && succ->start == end)
+    {
+      va_range_remove (succ);
+      end += succ->len;
+      if (n)
+	va_node_delete (succ);
+      else
+	n = succ;
+    }
+  if (!n)
+    n = va_node_new (start, end - start);
+  n->start = start;
+  n->len = end - start;
+  va_range_add (n);
 }
 
 static void
 va_init (void)
 {
   unsigned nvr, mvr, i;
+  uint32_t feats;
+  va_range_t *vrs;
+  /*
+   * Mark the identity mappings as global pages, if the CPU supports
+   * these.
+   */
+  cpuid (1, NULL, NULL, NULL, &feats);
+  if ((feats & ID1D_PGE) != 0)
+    pte_global = PTE_G;
+  /*
+   * Set up the PAT so that we can ask for write-combining.  Paging is
+   * not yet on, & nothing has used PAT entry 5 yet, so there are no
+   * TLB entries or cache lines to worry about.
+   */
+  if ((feats & ID1D_PAT) != 0)
+    {
+      wrmsr (MSR_PAT, PAT_VALUE);
+      have_pat = true;
+    }
   /*
-   * First allocate some memory to keep track of unused virtual
-   * memory address ranges, & initialize these.
+   * First work out the unused virtual memory address ranges, in a
+   * temporary array.
    */
   mvr = max_mem_ranges;
-  unused_va_ranges = mem_alloc (mvr * sizeof (va_range_t),
-				_Alignof (va_range_t), 0);
+  vrs = mem_alloc (mvr * sizeof (va_range_t), _Alignof (va_range_t), 0,
+		   MTAG_MEM);
   nvr = 0;
   for (i = 1; i <= num_mem_ranges; ++i)
     {
@@ -386,20 +932,18 @@ va_init (void)
 	}
       if (prev_end >= start)
 	continue;
-      unused_va_ranges[nvr].start = (uint32_t) prev_end;
-      unused_va_ranges[nvr].len = (uint32_t) start - (uint32_t) prev_end;
+      vrs[nvr].start = (uint32_t) prev_end;
+      vrs[nvr].len = (uint32_t) start - (uint32_t) prev_end;
       ++nvr;
     }
-  num_unused_va_ranges = nvr;
-  max_unused_va_ranges = mvr;
   /*
    * Set up the page-directory-pointer table (PDPT) & the 4 page
    * directories (PDs) for PAE paging.
    */
-  pdpt = mem_alloc (4 * sizeof (uint64_t), PDPT_ALIGN, 0);
+  pdpt = mem_alloc (4 * sizeof (uint64_t), PDPT_ALIGN, 0, MTAG_PGTBL);
   for (i = 0; i < 4; ++i)
     {
-      uint64_t *pd = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0);
+      uint64_t *pd = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0, MTAG_PGTBL);
       memset (pd, 0, PAGE_SIZE);
       pdpt[i] = (uint64_t) (uint32_t) pd | PTE_P;
     }
@@ -408,15 +952,18 @@ va_init (void)
    * mappings for all physical memory addresses below 4 GiB that may
    * be backed by physical hardware.
    */
-  do_va_id_map (0, unused_va_ranges[0].start,
+  do_va_id_map (0, vrs[0].start,
 		uefi_attr_to_pte_flags (mem_ranges[0].uefi_attr));
   for (i = 1; i < nvr; ++i)
     {
-      uint32_t prev_end = unused_va_ranges[i - 1].start +
-	unused_va_ranges[i - 1].len;
-      uint32_t start = unused_va_ranges[i].start;
+      uint32_t prev_end = vrs[i - 1].start + vrs[i - 1].len;
+      uint32_t start = vrs[i].start;
       do_va_id_map (prev_end, start - prev_end, 0);
     }
+  /* Move the unused ranges into the treaps. */
+  for (i = 0; i < nvr; ++i)
+    va_range_add (va_node_new (vrs[i].start, vrs[i].len));
+  mem_free (vrs, mvr * sizeof (va_range_t), MTAG_MEM);
   /*
    * If there are any memory ranges that are non-cacheable or only
    * write-through cacheable, then modify the PTs to properly handle
@@ -463,26 +1010,50 @@ va_init (void)
       while (i < num_mem_ranges && mem_ranges[i].start <= start64)
 	++i;
     }
-  /* Bring up our page tables. */
+  /*
+   * Bring up our page tables.  If the permanent identity mappings are
+   * marked as global, enable global pages too, so that flushing the
+   * other TLB entries leaves them alone.
+   */
   wr_cr4 (rd_cr4 () | CR4_PAE);
   wr_cr3 ((uint32_t) pdpt);
   wr_cr0 (rd_cr0 () | CR0_PG);
+  if (pte_global)
+    wr_cr4 (rd_cr4 () | CR4_PGE);
 }
 
-/* Initialize memory allocation & virtual memory addressing. */
-void
-mem_init (bparm_t * bparms)
+/* Account for `sz' bytes of memory being given to the subsystem `tag'. */
+static void
+acct_alloc (unsigned tag, uint32_t sz)
 {
-  mem_map_init (bparms);
-  va_init ();
+  mem_acct_t *ac;
+  if (tag >= MTAG_MAX)
+    hlt ();
+  ac = &mem_acct[tag];
+  ac->in_use += sz;
+  if (ac->peak < ac->in_use)
+    ac->peak = ac->in_use;
+  ++ac->num_allocs;
+}
+
+/* Account for `sz' bytes of memory being given back by `tag'. */
+static void
+acct_free (unsigned tag, uint32_t sz)
+{
+  if (tag >= MTAG_MAX || mem_acct[tag].in_use < sz)
+    hlt ();
+  mem_acct[tag].in_use -= sz;
 }
 
 /*
- * Reserve some physical memory for internal use.  If `max_addr' != 0, the
- * end of the memory block will be below `max_addr'.
+ * Carve out some physical memory from the memory map, for use before the
+ * buddy allocator is set up, for the subsystem `tag'.  Exactly `sz' bytes
+ * are marked as reserved in the memory map; any slack left by the
+ * alignment stays free.  If `max_addr' != 0, the end of the memory block
+ * will be below `max_addr'.
  */
-void *
-mem_alloc (size_t sz, size_t align, uintptr_t max_addr)
+static void *
+mem_alloc_early (size_t sz, size_t align, uintptr_t max_addr, unsigned tag)
 {
   uint64_t max_addr64;
   uintptr_t astart, aend;
@@ -505,91 +1076,893 @@ mem_alloc (size_t sz, size_t align, uintptr_t max_addr)
       if (!mr->start)
 	hlt ();
     }
-  split_range (mr, astart, E820_RAM, E820_RESERVED);
+  retype_range (astart, sz, E820_RAM, E820_RESERVED);
+  acct_alloc (tag, sz);
   return (void *) astart;
 }
 
+static void
+buddy_push (uint32_t pg, unsigned order)
+{
+  free_blk_t *blk = (free_blk_t *) (pg * PAGE_SIZE), *head;
+  head = free_lists[order];
+  blk->next = head;
+  blk->prev = NULL;
+  if (head)
+    head->prev = blk;
+  free_lists[order] = blk;
+  pg_info[pg] = PG_FREE | order;
+}
+
+static void
+buddy_unlink (uint32_t pg, unsigned order)
+{
+  free_blk_t *blk = (free_blk_t *) (pg * PAGE_SIZE);
+  if (blk->prev)
+    blk->prev->next = blk->next;
+  else
+    free_lists[order] = blk->next;
+  if (blk->next)
+    blk->next->prev = blk->prev;
+  pg_info[pg] = 0;
+}
+
+/* Free a block of 2^`order' pages, merging it with its buddies. */
+static void
+buddy_free_blk (uint32_t pg, unsigned order)
+{
+  while (order < MAX_ORDER - 1)
+    {
+      uint32_t buddy = pg ^ (UINT32_C (1) << order);
+      if (buddy >= num_pgs || pg_info[buddy] != (PG_FREE | order))
+	break;
+      buddy_unlink (buddy, order);
+      pg &= ~(UINT32_C (1) << order);
+      ++order;
+    }
+  buddy_push (pg, order);
+}
+
+/* Free a run of `n' pages, which need not form a single buddy block. */
+static void
+buddy_free_run (uint32_t pg, uint32_t n)
+{
+  while (n)
+    {
+      unsigned order = 31 - __builtin_clz (n);
+      unsigned align_order = __builtin_ctz (pg);
+      if (order > align_order)
+	order = align_order;
+      if (order > MAX_ORDER - 1)
+	order = MAX_ORDER - 1;
+      buddy_free_blk (pg, order);
+      pg += UINT32_C (1) << order;
+      n -= UINT32_C (1) << order;
+    }
+}
+
 /*
- * Map some physical memory --- possibly beyond the 32-bit physical space
- * --- into our 32-bit virtual address space.
+ * Hand all the RAM in extended memory below 4 GiB over to the buddy
+ * allocator.
  */
-void *
-mem_va_map (uint64_t pa, size_t sz, unsigned pte_flags)
+static void
+buddy_init (void)
 {
-  uint64_t pstart, pend, sz_to_map;
-  uint32_t vstart;
   unsigned i;
-  if (!sz)
-    return NULL;
-  pstart = pa & -(uint64_t) PAGE_SIZE;
-  pend = (pa + sz + PAGE_SIZE - 1) & -(uint64_t) PAGE_SIZE;
-  sz_to_map = pend - pstart;
-  if (sz_to_map >= XM32_MAX_ADDR)
-    hlt ();
-  i = num_unused_va_ranges;
-  while (i-- != 0)
+  uint32_t pg, end_pg;
+  for (i = 0; i < num_mem_ranges; ++i)
     {
-      uint32_t vrsz = unused_va_ranges[i].len;
-      if (vrsz >= sz_to_map)
-	{
-	  vrsz -= sz_to_map;
-	  unused_va_ranges[i].len = vrsz;
-	  vstart = unused_va_ranges[i].start + vrsz;
-	  do_va_map (vstart, pstart, sz_to_map, pte_flags);
-	  flush_cr3 ();
-	  return (char *) vstart + (size_t) (pa % PAGE_SIZE);
-	}
+      mem_range_t *mr = &mem_ranges[i];
+      uint64_t end = mr->start + mr->len;
+      if (mr->e820_type != E820_RAM || mr->start >= XM32_MAX_ADDR)
+	continue;
+      if (end > XM32_MAX_ADDR)
+	end = XM32_MAX_ADDR;
+      if (end / PAGE_SIZE > num_pgs)
+	num_pgs = end / PAGE_SIZE;
+    }
+  pg_info = mem_alloc_early (num_pgs, 1, 0, MTAG_MEM);
+  memset (pg_info, 0, num_pgs);
+  /*
+   * Free the RAM ranges in order of increasing address, so that the
+   * free lists start off with the highest addresses.
+   */
+  for (i = 0; i < num_mem_ranges; ++i)
+    {
+      mem_range_t *mr = &mem_ranges[i];
+      uint64_t start = mr->start, end = mr->start + mr->len;
+      if (mr->e820_type != E820_RAM || start >= XM32_MAX_ADDR)
+	continue;
+      if (start < BMEM_MAX_ADDR)
+	start = BMEM_MAX_ADDR;
+      if (end > XM32_MAX_ADDR)
+	end = XM32_MAX_ADDR;
+      pg = (start + PAGE_SIZE - 1) / PAGE_SIZE;
+      end_pg = end / PAGE_SIZE;
+      if (pg >= end_pg)
+	continue;
+      buddy_free_run (pg, end_pg - pg);
+      num_free_pgs += end_pg - pg;
     }
-  hlt ();
-  __builtin_unreachable ();
 }
 
-/*
- * Unmap some virtual memory previously mapped.  The address & size must
- * correspond exactly to a virtual memory block previously obtained by
- * mem_va_map(...).
- */
+/* Initialize memory allocation & virtual memory addressing. */
 void
-mem_va_unmap (volatile void *va, size_t sz)
+mem_init (bparm_t * bparms)
 {
-  uint32_t vstart, vend, sz_to_unmap;
-  unsigned i, j;
+  mem_map_init (bparms);
+  buddy_init ();
+  va_init ();
+}
+
+/*
+ * Allocate some physical memory for internal use.  The memory is page
+ * aligned, & also aligned to `align' if it is bigger.  If `max_addr' != 0,
+ * the end of the memory block will be below `max_addr'.  `tag' says which
+ * subsystem the memory is for.  The memory can later be returned via
+ * mem_free (...).
+ *
+ * Unconstrained allocations take the first block off the smallest free
+ * list that fits; allocations with `max_addr' != 0 may need to look further
+ * down each list.
+ */
+void *
+mem_alloc (size_t sz, size_t align, uintptr_t max_addr, unsigned tag)
+{
+  uint32_t n, max_pg, pg = 0;
+  unsigned order, k;
+  free_blk_t *blk = NULL;
   if (!sz)
+    return NULL;
+  /*
+   * Base memory is not managed by the buddy allocator, so any request
+   * for memory there must still be carved out of the memory map.
+   */
+  if (!pg_info || (max_addr && max_addr <= BMEM_MAX_ADDR))
+    return mem_alloc_early (sz, align, max_addr, tag);
+  n = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
+  order = n > 1 ? 32 - __builtin_clz (n - 1) : 0;
+  if (align > PAGE_SIZE)
+    {
+      k = __builtin_ctz (align) - __builtin_ctz (PAGE_SIZE);
+      if (order < k)
+	order = k;
+    }
+  max_pg = max_addr ? max_addr / PAGE_SIZE : num_pgs;
+  for (k = order; k < MAX_ORDER; ++k)
+    {
+      for (blk = free_lists[k]; blk; blk = blk->next)
+	{
+	  pg = (uint32_t) blk / PAGE_SIZE;
+	  if (pg + n <= max_pg)
+	    break;
+	}
+      if (blk)
+	break;
+    }
+  if (!blk)
+    hlt ();
+  buddy_unlink (pg, k);
+  /* Split the block down to the needed order. */
+  while (k > order)
+    {
+      --k;
+      buddy_push (pg + (UINT32_C (1) << k), k);
+    }
+  /* Give back any pages beyond the `n' we need. */
+  buddy_free_run (pg + n, (UINT32_C (1) << order) - n);
+  num_free_pgs -= n;
+  acct_alloc (tag, n * PAGE_SIZE);
+  return (void *) (pg * PAGE_SIZE);
+}
+
+/*
+ * Free physical memory previously obtained via mem_alloc (...).  The size
+ * & tag should be the same as those passed to mem_alloc (...).
+ */
+void
+mem_free (void *p, size_t sz, unsigned tag)
+{
+  uint32_t pg = (uint32_t) p / PAGE_SIZE,
+	   n = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
+  if (!p || !sz)
     return;
-  vstart = (uint32_t) va & -(uint64_t) PAGE_SIZE;
-  vend = ((uint32_t) va + sz + PAGE_SIZE - 1) & -(uint64_t) PAGE_SIZE;
-  sz_to_unmap = vend - vstart;
-  do_va_unmap (vstart, sz_to_unmap);
-  flush_cr3 ();
-  i = num_unused_va_ranges;
+  if ((uint32_t) p % PAGE_SIZE != 0 || pg + n < pg)
+    hlt ();
+  /*
+   * Base memory goes back into the memory map.  mem_alloc_early (...)
+   * took exactly `sz' bytes, so give back exactly that.
+   */
+  if (pg < BMEM_MAX_ADDR / PAGE_SIZE)
+    {
+      if (pg + n > BMEM_MAX_ADDR / PAGE_SIZE)
+	hlt ();
+      acct_free (tag, sz);
+      retype_range ((uint32_t) p, sz, E820_RESERVED, E820_RAM);
+      return;
+    }
+  acct_free (tag, n * PAGE_SIZE);
+  if (pg + n > num_pgs)
+    hlt ();
+  buddy_free_run (pg, n);
+  num_free_pgs += n;
+}
+
+/*
+ * Take all the free blocks off the buddy allocator's free lists, & list
+ * them in `blks', so that the caller can work on the memory directly.  If
+ * there are more than `max' blocks, leave the free lists alone.  Return
+ * the number of free blocks.
+ *
+ * The caller should later give back the memory via mem_free (...), with
+ * the same `tag'.
+ */
+uint32_t
+mem_take_free (mem_blk_t * blks, uint32_t max, unsigned tag)
+{
+  uint32_t n = 0;
+  unsigned k;
+  free_blk_t *blk;
+  for (k = 0; k < MAX_ORDER; ++k)
+    for (blk = free_lists[k]; blk; blk = blk->next)
+      ++n;
+  if (n > max)
+    return n;
+  n = 0;
+  for (k = 0; k < MAX_ORDER; ++k)
+    {
+      for (blk = free_lists[k]; blk; blk = blk->next)
+	{
+	  uint32_t pg = (uint32_t) blk / PAGE_SIZE;
+	  blks[n].start = (uint64_t) pg * PAGE_SIZE;
+	  blks[n].len = (uint64_t) PAGE_SIZE << k;
+	  pg_info[pg] = 0;
+	  ++n;
+	}
+      free_lists[k] = NULL;
+    }
+  acct_alloc (tag, num_free_pgs * PAGE_SIZE);
+  num_free_pgs = 0;
+  return n;
+}
+
+/*
+ * List in `blks' up to `max' of the RAM ranges --- or parts of ranges ---
+ * at or above the 4 GiB mark.  Return the total number of such ranges.
+ */
+uint32_t
+mem_high_ram (mem_blk_t * blks, uint32_t max)
+{
+  uint32_t n = 0;
+  unsigned i;
+  for (i = 0; i < num_mem_ranges; ++i)
+    {
+      const mem_range_t *mr = &mem_ranges[i];
+      uint64_t start = mr->start, end = mr->start + mr->len;
+      if (mr->e820_type != E820_RAM || end <= XM32_MAX_ADDR)
+	continue;
+      if (start < XM32_MAX_ADDR)
+	start = XM32_MAX_ADDR;
+      if (n < max)
+	{
+	  blks[n].start = start;
+	  blks[n].len = end - start;
+	}
+      ++n;
+    }
+  return n;
+}
+
+/*
+ * Make sure that the memory map has room for `n' more ranges, moving it to
+ * a bigger array if need be.  The array set up by mem_map_init (...) stays
+ * reserved; a later one goes back to mem_free (...).
+ */
+static void
+mem_map_make_room (unsigned n)
+{
+  unsigned mmr;
+  mem_range_t *mrs;
+  if (max_mem_ranges - num_mem_ranges >= n)
+    return;
+  mmr = (3 * (num_mem_ranges + n) + 1) / 2;
+  mrs = mem_alloc (mmr * sizeof (mem_range_t), 0, 0, MTAG_MEM);
+  memcpy (mrs, mem_ranges, num_mem_ranges * sizeof (mem_range_t));
+  if (mem_ranges_moved)
+    mem_free (mem_ranges, max_mem_ranges * sizeof (mem_range_t), MTAG_MEM);
+  mem_ranges = mrs;
+  max_mem_ranges = mmr;
+  mem_ranges_moved = true;
+}
+
+/*
+ * Mark the physical memory [start, start + len) as unusable, wherever the
+ * memory map says it is RAM.  The memory should not be in use, or on the
+ * free lists.  This may need to allocate memory, to make room in the
+ * memory map.
+ */
+void
+mem_mark_unusable (uint64_t start, uint64_t len)
+{
+  mem_map_make_room (2);
+  retype_range (start, len, E820_RAM, E820_UNUSABLE);
+}
+
+/* Return the number of bytes of free RAM in the memory map below `top'. */
+static uint32_t
+bmem_free_below (uint32_t top)
+{
+  uint32_t sum = 0;
+  unsigned i;
+  for (i = 0; i < num_mem_ranges; ++i)
+    {
+      const mem_range_t *mr = &mem_ranges[i];
+      uint64_t end = mr->start + mr->len;
+      if (mr->start >= top)
+	break;
+      if (mr->e820_type != E820_RAM)
+	continue;
+      if (end > top)
+	end = top;
+      sum += (uint32_t) (end - mr->start);
+    }
+  return sum;
+}
+
+/*
+ * Return the end of the free base memory block at address 0, i.e. the
+ * memory which 0x40:0x13 can describe.
+ */
+static uint32_t
+bmem_low_end (void)
+{
+  const mem_range_t *mr = &mem_ranges[0];
+  if (mr->start || mr->e820_type != E820_RAM)
+    return 0;
+  return (uint32_t) (mr->len & -KIBYTE);
+}
+
+/*
+ * Carve out `sz' bytes of base memory, 1 KiB aligned, from a free block
+ * which lies above the block at address 0, so that it does not eat into
+ * the conventional memory, for the subsystem `tag'.  Return 0 if there is
+ * no such block.
+ */
+static uint32_t
+bmem_alloc_hole (uint32_t sz, unsigned tag)
+{
+  unsigned i = num_mem_ranges;
   while (i-- != 0)
     {
-      va_range_t *vr = &unused_va_ranges[i];
-      if (vr->start == vend)
+      mem_range_t *mr = &mem_ranges[i];
+      uint32_t astart;
+      if (!mr->start || mr->start >= BMEM_MAX_ADDR
+	  || mr->e820_type != E820_RAM || mr->len < sz)
+	continue;
+      astart = (uint32_t) (mr->start + mr->len - sz) & -KIBYTE;
+      if (astart < mr->start)
+	continue;
+      retype_range (astart, sz, E820_RAM, E820_RESERVED);
+      acct_alloc (tag, sz);
+      return astart;
+    }
+  return 0;
+}
+
+/*
+ * Ranks of the memory types, for resolving overlaps when building the
+ * E820 table.  Where ranges overlap, the highest rank wins.  Besides the
+ * firmware's own types, RAM which the buddy allocator manages is overlaid
+ * with RANK_ALLOC, & its free blocks with RANK_FREE, so that memory which
+ * stage 2 has handed out shows up as reserved.
+ */
+#define NUM_RANKS	32U
+#define RANK_RAM	0U
+#define RANK_ALLOC	1U
+#define RANK_FREE	2U
+#define RANK_OF(t)	((t) == E820_RAM ? RANK_RAM \
+			 : (t) > E820_RAM && (t) < NUM_RANKS - 2 ? (t) + 2 \
+			 : E820_RESERVED + 2)
+
+/* Start or end of a memory range, for building the E820 table. */
+typedef struct
+{
+  uint64_t addr;
+  uint32_t rank;
+  int32_t delta;
+} e820_ev_t;
+
+static void
+ev_sort (e820_ev_t * evs, unsigned nev)
+{
+  /* As in shellsort (...) above. */
+  unsigned h = 1, i, j;
+  if (nev < 2)
+    return;
+  while (h < nev)
+    h *= 2;
+  --h;
+  do
+    {
+      for (i = h; i < nev; ++i)
+	{
+	  e820_ev_t v = evs[i];
+	  j = i;
+	  while (j >= h && evs[j - h].addr > v.addr)
+	    {
+	      evs[j] = evs[j - h];
+	      j -= h;
+	    }
+	  evs[j] = v;
+	}
+      h >>= 1;
+    }
+  while (h);
+}
+
+static unsigned
+ev_add (e820_ev_t * evs, unsigned nev, uint64_t start, uint64_t end,
+	uint32_t rank)
+{
+  if (start >= end)
+    return nev;
+  evs[nev].addr = start;
+  evs[nev].rank = rank;
+  evs[nev].delta = 1;
+  evs[nev + 1].addr = end;
+  evs[nev + 1].rank = rank;
+  evs[nev + 1].delta = -1;
+  return nev + 2;
+}
+
+/*
+ * Add the range [start, end) of type `type' to the end of the E820 table
+ * `tab', which has room for `max' entries & currently has `n' entries.  Trim
+ * RAM ranges to page boundaries, & merge with the last entry if possible.
+ * Return the new no. of entries, which may be more than `max'.
+ */
+static unsigned
+e820_add (e820_ent_t * tab, unsigned max, unsigned n, uint64_t start,
+	  uint64_t end, uint32_t type)
+{
+  e820_ent_t *ent;
+  if (type == E820_RAM)
+    {
+      start = (start + PAGE_SIZE - 1) & -(uint64_t) PAGE_SIZE;
+      end &= -(uint64_t) PAGE_SIZE;
+    }
+  if (start >= end)
+    return n;
+  if (n && n <= max)
+    {
+      ent = &tab[n - 1];
+      if (ent->e820_type == type && ent->start + ent->len == start)
+	{
+	  ent->len = end - ent->start;
+	  return n;
+	}
+    }
+  if (n < max)
+    {
+      ent = &tab[n];
+      ent->start = start;
+      ent->len = end - start;
+      ent->e820_type = type;
+      ent->e820_ext_attr = E820_ATTR_ENABLED;
+    }
+  return n + 1;
+}
+
+/*
+ * Build a sorted, non-overlapping E820 table from the memory map & the
+ * buddy allocator's state, using the scratch space `evs', which has room
+ * for `max_evs' events & is itself treated as free.  If `tab' != NULL, fill
+ * in up to `max' entries.  Return the no. of entries needed.
+ */
+static unsigned
+e820_build (e820_ent_t * tab, unsigned max, e820_ev_t * evs,
+	    unsigned max_evs)
+{
+  unsigned nev = 0, i, k, n = 0, cnt[NUM_RANKS], cur = NUM_RANKS;
+  uint64_t cur_start = 0;
+  free_blk_t *blk;
+  for (i = 0; i < num_mem_ranges; ++i)
+    {
+      const mem_range_t *mr = &mem_ranges[i];
+      uint64_t start = mr->start, end = mr->start + mr->len;
+      if (nev + 4 > max_evs)
+	hlt ();
+      nev = ev_add (evs, nev, start, end, RANK_OF (mr->e820_type));
+      if (mr->e820_type != E820_RAM)
+	continue;
+      if (start < BMEM_MAX_ADDR)
+	start = BMEM_MAX_ADDR;
+      if (end > (uint64_t) num_pgs * PAGE_SIZE)
+	end = (uint64_t) num_pgs * PAGE_SIZE;
+      nev = ev_add (evs, nev, start, end, RANK_ALLOC);
+    }
+  for (k = 0; k < MAX_ORDER; ++k)
+    for (blk = free_lists[k]; blk; blk = blk->next)
+      {
+	if (nev + 2 > max_evs)
+	  hlt ();
+	nev = ev_add (evs, nev, (uint32_t) blk,
+		      (uint32_t) blk + (PAGE_SIZE << k), RANK_FREE);
+      }
+  if (nev + 2 > max_evs)
+    hlt ();
+  nev = ev_add (evs, nev, (uint32_t) evs,
+		((uint32_t) (evs + max_evs) + PAGE_SIZE - 1) & -PAGE_SIZE,
+		RANK_FREE);
+  ev_sort (evs, nev);
+  /* Sweep through the events, tracking the highest ranked type. */
+  memset (cnt, 0, sizeof (cnt));
+  i = 0;
+  while (i < nev)
+    {
+      uint64_t addr = evs[i].addr;
+      unsigned top = NUM_RANKS;
+      do
+	{
+	  cnt[evs[i].rank] += evs[i].delta;
+	  ++i;
+	}
+      while (i < nev && evs[i].addr == addr);
+      for (k = NUM_RANKS; k-- != 0;)
+	if (cnt[k])
+	  {
+	    top = k;
+	    break;
+	  }
+      if (top == cur)
+	continue;
+      if (cur != NUM_RANKS)
+	n = e820_add (tab, max, n, cur_start, addr,
+		      cur == RANK_RAM || cur == RANK_FREE ? E820_RAM
+		      : cur == RANK_ALLOC ? E820_RESERVED : cur - 2);
+      cur = top;
+      cur_start = addr;
+    }
+  return n;
+}
+
+/*
+ * Set up the E820 table for the int 0x15 services in our 16-bit code, in
+ * base memory, together with the figures for int 0x15, ax = 0xe801 &
+ * ah = 0x88.
+ */
+static void
+e820_init (void)
+{
+  unsigned max_evs, n, k, i;
+  e820_ev_t *evs;
+  e820_ent_t *tab;
+  uint32_t tab_sz, nfree = 0;
+  free_blk_t *blk;
+  for (k = 0; k < MAX_ORDER; ++k)
+    for (blk = free_lists[k]; blk; blk = blk->next)
+      ++nfree;
+  /*
+   * Allow for the free blocks split off by allocating the events array,
+   * & for a range or two split off by allocating the table itself.
+   */
+  max_evs = 2 * (2 * (num_mem_ranges + 2) + nfree + MAX_ORDER + 1);
+  evs = mem_alloc (max_evs * sizeof (e820_ev_t), 0, 0, MTAG_MEM);
+  n = e820_build (NULL, 0, evs, max_evs) + 2;
+  tab_sz = n * sizeof (e820_ent_t);
+  tab = (e820_ent_t *) bmem_alloc_hole (tab_sz, MTAG_RT16);
+  if (!tab)
+    tab = mem_alloc (tab_sz, PARA_SIZE, BMEM_MAX_ADDR, MTAG_RT16);
+  n = e820_build (tab, n, evs, max_evs);
+  mem_free (evs, max_evs * sizeof (e820_ev_t), MTAG_MEM);
+  e820_tab16 = MK_FP16 ((uint32_t) tab / PARA_SIZE,
+			(uint32_t) tab % PARA_SIZE);
+  e820_cnt16 = n;
+  /*
+   * For int 0x15, ah = 0x88 & ax = 0xe801, report the RAM running on from
+   * the 1 MiB mark, & from the 16 MiB mark.
+   */
+  ext_kib16 = e801_kib16 = e801_blks16 = 0;
+  for (i = 0; i < n; ++i)
+    {
+      const e820_ent_t *ent = &tab[i];
+      uint64_t end = ent->start + ent->len;
+      if (ent->e820_type != E820_RAM)
+	continue;
+      if (ent->start <= BMEM_MAX_ADDR && end > BMEM_MAX_ADDR)
+	{
+	  uint64_t kib = (end - BMEM_MAX_ADDR) / KIBYTE;
+	  ext_kib16 = kib > 0xffffU ? 0xffffU : kib;
+	  e801_kib16 = kib > 15 * KIBYTE ? 15 * KIBYTE : kib;
+	}
+      if (ent->start <= 16 * MIBYTE && end > 16 * MIBYTE)
 	{
-	  vr->start = vstart;
-	  vr->len += sz_to_unmap;
-	  return;
+	  uint64_t blks;
+	  if (end > XM32_MAX_ADDR)
+	    end = XM32_MAX_ADDR;
+	  blks = (end - 16 * MIBYTE) / (64 * KIBYTE);
+	  e801_blks16 = blks > 0xffffU ? 0xffffU : blks;
 	}
-      if (vr->start + vr->len == vstart)
+    }
+  cprintf ("E820 table: %u entries @0x%" PRIx32 "\n", n, (uint32_t) tab);
+  for (i = 0; i < n; ++i)
+    {
+      const e820_ent_t *ent = &tab[i];
+      uint64_t last = ent->start + ent->len - 1;
+      cprintf ("  0x%" PRIx32 "%08" PRIx32 "-0x%" PRIx32 "%08" PRIx32
+	       " type %" PRIu32 "\n", (uint32_t) (ent->start >> 32),
+	       (uint32_t) ent->start, (uint32_t) (last >> 32),
+	       (uint32_t) last, ent->e820_type);
+    }
+}
+
+/*
+ * Note the conventional memory size & EBDA segment, just before the option
+ * ROMs are run, so that mem_bmem_fini () can tell whether any ROM took
+ * memory by lowering 0x40:0x13 or moving the EBDA.
+ *
+ * Stage 1's 0x40:0x13 may also take in the resident real mode code & EBDA
+ * which rm16_init (.) carved out since, so first trim it to the free block
+ * at address 0 --- counting the boot-time area, which is ours, as free ---
+ * lest a ROM take memory from the top of our EBDA.
+ */
+void
+mem_bmem_mark (void)
+{
+  uint32_t end = 0;
+  unsigned i;
+  for (i = 0; i < num_mem_ranges; ++i)
+    {
+      const mem_range_t *mr = &mem_ranges[i];
+      if (mr->start != end
+	  || (mr->e820_type != E820_RAM
+	      && mr->start + mr->len > boottime_bmem_bot))
+	break;
+      end = (uint32_t) (mr->start + mr->len);
+    }
+  if (end && bda.base_kib > end / KIBYTE)
+    bda.base_kib = end / KIBYTE;
+  marked_base_kib = bda.base_kib;
+  marked_ebda_seg = bda.ebda;
+}
+
+/*
+ * Final pass over base memory, once nothing needs the boot parameters or
+ * the boot-time option ROM copies.  Return the boot-time area to the free
+ * pool, move the EBDA out to a free hole above the conventional memory if
+ * that frees up anything, set up the E820 table, & make 0x40:0x13 cover
+ * exactly the free block at address 0.
+ *
+ * The resident real mode code & the option ROM run time images stay put,
+ * since interrupt vectors may now point into them.
+ *
+ * If an option ROM has lowered 0x40:0x13 or moved the EBDA since
+ * mem_bmem_mark (), the memory it took must stay taken: leave the EBDA
+ * alone, keep the smaller memory size, & reserve the memory above it.
+ * Otherwise, only raise 0x40:0x13 by as much as moving the EBDA freed up.
+ */
+void
+mem_bmem_fini (void)
+{
+  uint32_t old_kib = bda.base_kib, new_kib, limit_kib = old_kib, old_free,
+	   ebda, ebda_sz, new_ebda, low_end;
+  bool roms_took = old_kib != marked_base_kib || bda.ebda != marked_ebda_seg;
+  unsigned i;
+  old_free = bmem_free_below (old_kib * KIBYTE);
+  if (boottime_bmem_bot)
+    {
+      retype_range (0, boottime_bmem_bot, E820_RESERVED, E820_RAM);
+      boottime_bmem_bot = 0;
+    }
+  ebda = (uint32_t) bda.ebda * PARA_SIZE;
+  ebda_sz = (uint32_t) * (uint8_t *) ebda * KIBYTE;
+  if (roms_took)
+    {
+      low_end = bmem_low_end ();
+      if (old_kib * KIBYTE < low_end)
+	retype_range (old_kib * KIBYTE, low_end - old_kib * KIBYTE,
+		      E820_RAM, E820_RESERVED);
+      cprintf ("option ROM(s) took conv. mem.; not moving EBDA\n");
+    }
+  else if (ebda_sz && ebda == bmem_low_end ()
+	   && (new_ebda = bmem_alloc_hole (ebda_sz, MTAG_RT16)) != 0)
+    {
+      memcpy ((void *) new_ebda, (void *) ebda, ebda_sz);
+      bda.ebda = new_ebda / PARA_SIZE;
+      rm16_reload_ds16 ();
+      /*
+       * The old EBDA is at the start of a reserved range, which may also
+       * take in the real mode code above it.
+       */
+      for (i = 0; i < num_mem_ranges; ++i)
 	{
-	  vr->len += sz_to_unmap;
-	  return;
+	  mem_range_t *mr = &mem_ranges[i];
+	  if (mr->start == ebda)
+	    {
+	      split_range (mr, ebda + ebda_sz, E820_RAM, mr->e820_type);
+	      break;
+	    }
 	}
-      if (vr->start < vstart)
+      coalesce_ranges ();
+      limit_kib += ebda_sz / KIBYTE;
+      cprintf ("moved EBDA @0x%" PRIx32 " -> @0x%" PRIx32 "\n",
+	       ebda, new_ebda);
+    }
+  e820_init ();
+  new_kib = bmem_low_end () / KIBYTE;
+  if (new_kib > limit_kib)
+    new_kib = limit_kib;
+  bda.base_kib = new_kib;
+  cprintf ("conv. mem.: %" PRIu32 " KiB free of %" PRIu32 " KiB -> "
+	   "%" PRIu32 " KiB free of %" PRIu32 " KiB\n",
+	   (uint32_t) (old_free / KIBYTE), old_kib,
+	   (uint32_t) (bmem_free_below (bda.base_kib * KIBYTE) / KIBYTE),
+	   (uint32_t) bda.base_kib);
+}
+
+/*
+ * Print each subsystem's memory usage: the base memory & boot parameter
+ * space which stage 1 used for it, & the memory which stage 2 has given it,
+ * now & at its peak.
+ */
+void
+mem_acct_dump (bparm_t * bparms)
+{
+  const bdat_mem_acct_t *s1;
+  uint32_t num_s1;
+  unsigned tag;
+  s1 = bparm_recs (bparms, BPI_MACC, sizeof (bdat_mem_acct_t), &num_s1);
+  cprintf ("%-12s %7s %7s %6s %10s %10s %6s\n", "mem. tag", "s1 bmem",
+	   "s1 b.t.", "bparms", "in use", "peak", "allocs");
+  for (tag = 0; tag < MTAG_MAX; ++tag)
+    {
+      const mem_acct_t *ac = &mem_acct[tag];
+      uint32_t bmem = 0, bmem_bt = 0, bparm = 0,
+	       num_allocs = ac->num_allocs;
+      if (tag < num_s1)
 	{
-	  if (num_unused_va_ranges == max_unused_va_ranges)
-	    hlt ();
-	  ++num_unused_va_ranges;
-	  j = num_unused_va_ranges;
-	  while (j-- != i + 1)
-	    unused_va_ranges[j] = unused_va_ranges[j - 1];
-	  ++vr;
-	  vr->start = vstart;
-	  vr->len = sz_to_unmap;
-	  return;
+	  bmem = s1[tag].bmem_sz;
+	  bmem_bt = s1[tag].bmem_bt_sz;
+	  bparm = s1[tag].bparm_sz;
+	  num_allocs += s1[tag].num_allocs;
 	}
+      if (!num_allocs && !bparm)
+	continue;
+      cprintf ("%-12s %7" PRIu32 " %7" PRIu32 " %6" PRIu32 " %10" PRIu32
+	       " %10" PRIu32 " %6" PRIu32 "\n", mtag_names[tag], bmem,
+	       bmem_bt, bparm, ac->in_use, ac->peak, num_allocs);
+    }
+}
+
+/* Return the amount of free physical memory managed by mem_alloc (...). */
+uint64_t
+mem_free_bytes (void)
+{
+  return (uint64_t) num_free_pgs * PAGE_SIZE;
+}
+
+/*
+ * Map some physical memory --- possibly beyond the 32-bit physical space
+ * --- into our 32-bit virtual address space, with the memory type `mt'
+ * (MT_WB, etc.).  If the mapping is at least a large page in size, place
+ * it so that it can use large pages.  Return NULL if there is not enough
+ * unused virtual address space.
+ */
+void *
+mem_va_try_map (uint64_t pa, size_t sz, unsigned mt)
+{
+  uint64_t pstart, pend, sz_to_map;
+  uint32_t vstart;
+  if (!sz)
+    return NULL;
+  pstart = pa & -(uint64_t) PAGE_SIZE;
+  pend = (pa + sz + PAGE_SIZE - 1) & -(uint64_t) PAGE_SIZE;
+  sz_to_map = pend - pstart;
+  if (sz_to_map >= XM32_MAX_ADDR)
+    hlt ();
+  vstart = va_alloc ((uint32_t) sz_to_map, sz_to_map >= LARGE_PAGE_SIZE,
+		     (uint32_t) pstart % LARGE_PAGE_SIZE);
+  if (!vstart)
+    return NULL;
+  mem_va_batch_begin ();
+  do_va_map (vstart, pstart, sz_to_map, mt_to_pte_flags (mt));
+  mem_va_batch_end ();
+  return (char *) vstart + (size_t) (pa % PAGE_SIZE);
+}
+
+/* Like mem_va_try_map (...), but halt if there is no virtual memory left. */
+void *
+mem_va_map (uint64_t pa, size_t sz, unsigned mt)
+{
+  void *va;
+  if (!sz)
+    return NULL;
+  va = mem_va_try_map (pa, sz, mt);
+  if (!va)
+    hlt ();
+  return va;
+}
+
+/*
+ * Unmap some virtual memory previously mapped.  The address & size must
+ * correspond exactly to a virtual memory block previously obtained by
+ * mem_va_map(...).
+ */
+void
+mem_va_unmap (volatile void *va, size_t sz)
+{
+  uint32_t vstart, vend, sz_to_unmap;
+  if (!sz)
+    return;
+  vstart = (uint32_t) va & -(uint64_t) PAGE_SIZE;
+  vend = ((uint32_t) va + sz + PAGE_SIZE - 1) & -(uint64_t) PAGE_SIZE;
+  sz_to_unmap = vend - vstart;
+  mem_va_batch_begin ();
+  do_va_unmap (vstart, sz_to_unmap);
+  mem_va_batch_end ();
+  va_release (vstart, sz_to_unmap);
+}
+
+/*
+ * Point a large page window at the physical large page at `pa'.  `win'
+ * must be a large page sized & aligned block obtained from mem_va_map (...)
+ * for some address at or above the 4 GiB mark.  Only the calling
+ * processor's TLB is invalidated, so each processor should use its own
+ * window.
+ */
+void
+mem_va_window_map (void *win, uint64_t pa)
+{
+  uint32_t va = (uint32_t) win;
+  uint64_t *pd = (uint64_t *) ((uint32_t) pdpt[va >> 30] & -PDPT_ALIGN),
+	   *p_pde = &pd[(va >> 21) & 0x1ff];
+  if (va % LARGE_PAGE_SIZE != 0 || pa % LARGE_PAGE_SIZE != 0
+      || (*p_pde & (PTE_P | PDE_PS)) != (PTE_P | PDE_PS))
+    hlt ();
+  *p_pde = (*p_pde & (LARGE_PAGE_SIZE - 1)) | pa;
+  invlpg (win);
+}
+
+/* Give a newly started application processor the same PAT as ours. */
+void
+mem_ap_init (void)
+{
+  if (have_pat)
+    wrmsr (MSR_PAT, PAT_VALUE);
+}
+
+/*
+ * Report the total size of the unused virtual address space, & the number
+ * of separate ranges it is in.
+ */
+void
+mem_va_stats (uint32_t * p_free, uint32_t * p_num_ranges)
+{
+  if (p_free)
+    *p_free = va_free_bytes;
+  if (p_num_ranges)
+    *p_num_ranges = num_va_ranges;
+}
+
+/*
+ * Say whether the physical range [start, start + len) is wholly covered by
+ * the memory map, with ranges which the firmware says can be write-back
+ * cacheable.
+ */
+bool
+mem_wb_capable (uint64_t start, uint64_t len)
+{
+  uint64_t end = start + len;
+  unsigned i;
+  for (i = 0; i < num_mem_ranges && start < end; ++i)
+    {
+      const mem_range_t *mr = &mem_ranges[i];
+      uint64_t mr_end = mr->start + mr->len;
+      if (mr_end <= start)
+	continue;
+      if (mr->start > start || (mr->uefi_attr & EFI_MEMORY_WB) == 0)
+	return false;
+      start = mr_end;
     }
-  hlt ();
-  __builtin_unreachable ();
+  return start >= end;
 }
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A cache of virtual memory mappings for device registers & firmware
+ * tables.  A request to map a physical range with given memory type is
+ * served from an existing mapping if one covers it, & mappings stay in
+ * place after their last user lets go of them.  Idle mappings are only
+ * unmapped --- least recently used first --- when we run out of virtual
+ * address space.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "stage2/stage2.h"
+
+typedef struct mmio_ent
+{
+  struct mmio_ent *next, *prev;		/* LRU list, most recent first */
+  uint64_t pstart, pend;
+  char *va;
+  unsigned mt, refs;
+} mmio_ent_t;
+
+static mmio_ent_t *mru = NULL, *lru = NULL;
+
+static void
+ent_unlink (mmio_ent_t * e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    mru = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    lru = e->prev;
+}
+
+static void
+ent_push (mmio_ent_t * e)
+{
+  e->prev = NULL;
+  e->next = mru;
+  if (mru)
+    mru->prev = e;
+  else
+    lru = e;
+  mru = e;
+}
+
+/* Unmap an idle mapping & forget about it. */
+static void
+ent_evict (mmio_ent_t * e)
+{
+  ent_unlink (e);
+  mem_va_unmap (e->va, (size_t) (e->pend - e->pstart));
+  slab_free (e);
+}
+
+/* Evict the least recently used idle mapping, if there is one. */
+static bool
+evict_lru (void)
+{
+  mmio_ent_t *e;
+  for (e = lru; e; e = e->prev)
+    if (!e->refs)
+      {
+	ent_evict (e);
+	return true;
+      }
+  return false;
+}
+
+/*
+ * Map some physical memory into virtual memory, reusing an existing
+ * mapping if possible.  Each call should be paired with a call to
+ * mmio_unmap (.).
+ */
+void *
+mmio_map (uint64_t pa, size_t sz, unsigned mt)
+{
+  uint64_t pstart, pend;
+  mmio_ent_t *e, *next;
+  char *va;
+  if (!sz)
+    return NULL;
+  pstart = pa & -(uint64_t) PAGE_SIZE;
+  pend = (pa + sz + PAGE_SIZE - 1) & -(uint64_t) PAGE_SIZE;
+  for (e = mru; e; e = e->next)
+    if (e->mt == mt && e->pstart <= pstart && pend <= e->pend)
+      {
+	++e->refs;
+	ent_unlink (e);
+	ent_push (e);
+	return e->va + (size_t) (pa - e->pstart);
+      }
+  /*
+   * Idle mappings which lie wholly inside the new one are now
+   * redundant, so drop them.
+   */
+  for (e = mru; e; e = next)
+    {
+      next = e->next;
+      if (!e->refs && e->mt == mt
+	  && pstart <= e->pstart && e->pend <= pend)
+	ent_evict (e);
+    }
+  while (!(va = mem_va_try_map (pstart, (size_t) (pend - pstart), mt)))
+    if (!evict_lru ())
+      hlt ();
+  e = slab_alloc (sizeof (mmio_ent_t));
+  e->pstart = pstart;
+  e->pend = pend;
+  e->va = va;
+  e->mt = mt;
+  e->refs = 1;
+  ent_push (e);
+  return va + (size_t) (pa - pstart);
+}
+
+/*
+ * Let go of a mapping obtained from mmio_map (...).  The mapping stays in
+ * the cache for reuse.
+ */
+void
+mmio_unmap (volatile void *va)
+{
+  mmio_ent_t *e;
+  char *p = (char *) va;
+  if (!va)
+    return;
+  for (e = mru; e; e = e->next)
+    if (e->refs && e->va <= p && p < e->va + (size_t) (e->pend - e->pstart))
+      {
+	--e->refs;
+	return;
+      }
+  hlt ();
+}
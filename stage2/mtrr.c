@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Memory type range register (MTRR) set-up.  Real mode code --- DOS, the
+ * VGA BIOS, & other option ROMs --- runs without paging, so only the MTRRs
+ * decide how the legacy VGA window & the shadowed ROM areas are cached.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include "stage2/stage2.h"
+#include "stage2/pci.h"
+
+#define NUM_FIXED	11		/* no. of fixed-range MTRRs */
+#define NUM_FIXED_ENTS	(NUM_FIXED * 8)	/* no. of fixed ranges */
+#define MAX_VAR		32		/* max. variable-range MTRRs we
+					   handle */
+
+#define VGA_START	0xa0000U
+#define VGA_END		0xc0000U
+
+typedef struct
+{
+  uint64_t def_type, fixed[NUM_FIXED], base[MAX_VAR], mask[MAX_VAR];
+} mtrr_state_t;
+
+static const uint32_t fixed_msrs[NUM_FIXED] =
+  {
+    MSR_MTRR_FIX64K_00000, MSR_MTRR_FIX16K_80000, MSR_MTRR_FIX16K_A0000,
+    MSR_MTRR_FIX4K_C0000 + 0, MSR_MTRR_FIX4K_C0000 + 1,
+    MSR_MTRR_FIX4K_C0000 + 2, MSR_MTRR_FIX4K_C0000 + 3,
+    MSR_MTRR_FIX4K_C0000 + 4, MSR_MTRR_FIX4K_C0000 + 5,
+    MSR_MTRR_FIX4K_C0000 + 6, MSR_MTRR_FIX4K_C0000 + 7
+  };
+
+static bool have_mtrrs = false, have_fixed = false, have_wc = false;
+static unsigned num_var = 0;
+static uint64_t phys_max;
+/* Static, so as not to use up our small stack. */
+static mtrr_state_t old_st, new_st;
+
+/* Give the start address & size of fixed range number `k'. */
+static uint32_t
+fixed_start (unsigned k, uint32_t * p_sz)
+{
+  if (k < 8)
+    {
+      *p_sz = 0x10000U;
+      return k * 0x10000U;
+    }
+  if (k < 24)
+    {
+      *p_sz = 0x4000U;
+      return 0x80000U + (k - 8) * 0x4000U;
+    }
+  *p_sz = 0x1000U;
+  return 0xc0000U + (k - 24) * 0x1000U;
+}
+
+static unsigned
+fixed_get (const mtrr_state_t * st, unsigned k)
+{
+  return (uint8_t) (st->fixed[k / 8] >> (k % 8 * 8));
+}
+
+static void
+fixed_set (mtrr_state_t * st, unsigned k, unsigned type)
+{
+  unsigned sh = k % 8 * 8;
+  st->fixed[k / 8] = (st->fixed[k / 8] & ~((uint64_t) 0xff << sh))
+		     | (uint64_t) type << sh;
+}
+
+static const char *
+type_name (unsigned type)
+{
+  switch (type)
+    {
+    case MTRR_UC:
+      return "UC";
+    case MTRR_WC:
+      return "WC";
+    case MTRR_WT:
+      return "WT";
+    case MTRR_WP:
+      return "WP";
+    case MTRR_WB:
+      return "WB";
+    default:
+      return "??";
+    }
+}
+
+static void
+read_state (mtrr_state_t * st)
+{
+  unsigned i;
+  memset (st, 0, sizeof (*st));
+  st->def_type = rdmsr (MSR_MTRR_DEF_TYPE);
+  if (have_fixed)
+    for (i = 0; i < NUM_FIXED; ++i)
+      st->fixed[i] = rdmsr (fixed_msrs[i]);
+  for (i = 0; i < num_var; ++i)
+    {
+      st->base[i] = rdmsr (MSR_MTRR_PHYSBASE (i));
+      st->mask[i] = rdmsr (MSR_MTRR_PHYSMASK (i));
+    }
+}
+
+/*
+ * Load new MTRR settings, following the sequence in the Intel SDM (vol. 3,
+ * section 11.11.7.2).  Interrupts are already disabled in stage 2.
+ */
+static void
+write_state (const mtrr_state_t * st)
+{
+  uint32_t cr0 = rd_cr0 (), cr4 = rd_cr4 ();
+  unsigned i;
+  wr_cr0 ((cr0 | CR0_CD) & ~CR0_NW);
+  wbinvd ();
+  if ((cr4 & CR4_PGE) != 0)
+    wr_cr4 (cr4 & ~CR4_PGE);
+  else
+    flush_cr3 ();
+  wrmsr (MSR_MTRR_DEF_TYPE, st->def_type & ~(uint64_t) DEF_TYPE_E);
+  if (have_fixed)
+    for (i = 0; i < NUM_FIXED; ++i)
+      wrmsr (fixed_msrs[i], st->fixed[i]);
+  for (i = 0; i < num_var; ++i)
+    {
+      wrmsr (MSR_MTRR_PHYSBASE (i), st->base[i]);
+      wrmsr (MSR_MTRR_PHYSMASK (i), st->mask[i]);
+    }
+  wrmsr (MSR_MTRR_DEF_TYPE, st->def_type);
+  wbinvd ();
+  flush_cr3 ();
+  wr_cr0 (cr0);
+  wr_cr4 (cr4);
+}
+
+static void
+print_state (const char *what, const mtrr_state_t * st)
+{
+  unsigned k, i;
+  cprintf ("MTRRs %s: default %s%s%s\n", what,
+	   type_name ((uint8_t) st->def_type),
+	   (st->def_type & DEF_TYPE_E) != 0 ? "" : "  (disabled)",
+	   (st->def_type & DEF_TYPE_FE) != 0 ? "" : "  (fixed disabled)");
+  if (have_fixed)
+    {
+      k = 0;
+      while (k < NUM_FIXED_ENTS)
+	{
+	  uint32_t start, end, sz;
+	  unsigned type = fixed_get (st, k);
+	  start = fixed_start (k, &sz);
+	  do
+	    end = fixed_start (k++, &sz) + sz;
+	  while (k < NUM_FIXED_ENTS && fixed_get (st, k) == type);
+	  cprintf ("  0x%05" PRIx32 "-0x%05" PRIx32 " %s\n",
+		   start, end - 1, type_name (type));
+	}
+    }
+  for (i = 0; i < num_var; ++i)
+    {
+      uint64_t base = st->base[i], mask = st->mask[i];
+      if ((mask & PHYSMASK_V) == 0)
+	continue;
+      base &= ~(uint64_t) 0xfff;
+      mask &= ~(uint64_t) 0xfff;
+      cprintf ("  #%u 0x%" PRIx32 "%08" PRIx32 " mask 0x%" PRIx32 "%08"
+	       PRIx32 " %s\n", i, (uint32_t) (base >> 32), (uint32_t) base,
+	       (uint32_t) (mask >> 32), (uint32_t) mask,
+	       type_name ((uint8_t) st->base[i]));
+    }
+}
+
+/*
+ * Say whether the block [start, start + sz) is wholly inside the memory
+ * used by a shadowed option ROM image, or inside the shadow RAM which stage
+ * 1 turned on for option ROMs, or which we turned on at 0xf0000 for our
+ * real mode code.
+ */
+static bool
+is_shadowed_rom (bparm_t * bparms, uint32_t start, uint32_t sz)
+{
+  bdat_pci_dev_t *pd;
+  bdat_bmem_t *bmem;
+  uint32_t iter;
+  bmem = bparm_recs (bparms, BPI_BMEM, sizeof (bdat_bmem_t), &iter);
+  if (bmem && start >= PAM_SHADOW_START && start < PAM_SHADOW_END
+      && sz <= PAM_BLK_SZ - (start - PAM_SHADOW_START) % PAM_BLK_SZ
+      && (bmem->shadow_blks >> (start - PAM_SHADOW_START) / PAM_BLK_SZ
+	  & 1) != 0)
+    return true;
+  if (bmem && start >= PAM_SHADOW_END && sz <= BMEM_MAX_ADDR - start
+      && (bmem->shadow_blks >> PAM_FSEG_BLK & 1) != 0)
+    return true;
+  FOR_EACH_BPARM (pd, bparms, BPI_PCID, iter)
+  {
+    uint32_t rstart = (uint32_t) pd->rimg_seg * PARA_SIZE;
+    if (pd->rimg_seg < VGA_END / PARA_SIZE)
+      continue;
+    if (rstart <= start && start + sz <= rstart + pd->rimg_sz)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Work out the new fixed-range settings: WC for the VGA window, WP for
+ * shadowed ROM areas, & WB for conventional memory.  Shadowed ROM areas
+ * end up read-only, so a write must not linger in the cache where it can
+ * be lost on eviction; they get WP even if the firmware says they can be
+ * WB.  Leave other ranges alone --- unless fixed-range MTRRs were
+ * disabled, in which case their old contents mean nothing, & they get the
+ * default type.
+ */
+static void
+plan_fixed (bparm_t * bparms, mtrr_state_t * st)
+{
+  bool was_on = (st->def_type & DEF_TYPE_FE) != 0;
+  unsigned k;
+  for (k = 0; k < NUM_FIXED_ENTS; ++k)
+    {
+      uint32_t sz, start = fixed_start (k, &sz);
+      if (start >= VGA_START && start < VGA_END)
+	fixed_set (st, k, have_wc ? MTRR_WC : MTRR_UC);
+      else if (is_shadowed_rom (bparms, start, sz))
+	fixed_set (st, k, MTRR_WP);
+      else if (mem_wb_capable (start, sz))
+	fixed_set (st, k, MTRR_WB);
+      else if (!was_on)
+	fixed_set (st, k, (uint8_t) st->def_type);
+    }
+  st->def_type |= DEF_TYPE_FE;
+}
+
+/*
+ * Try to make a variable-range MTRR say that [base, base + sz) is WC.
+ * The block must be naturally aligned, which PCI BARs always are.
+ */
+static void
+plan_var_wc (mtrr_state_t * st, uint64_t base, uint64_t sz)
+{
+  uint64_t mask;
+  unsigned i, free_i = num_var;
+  if (sz < PAGE_SIZE || (sz & (sz - 1)) != 0 || (base & (sz - 1)) != 0)
+    return;
+  mask = ~(sz - 1) & phys_max;
+  for (i = 0; i < num_var; ++i)
+    {
+      uint64_t vbase = st->base[i] & ~(uint64_t) 0xfff,
+	       vmask = st->mask[i] & ~(uint64_t) 0xfff & phys_max, vsz;
+      if ((st->mask[i] & PHYSMASK_V) == 0)
+	{
+	  if (free_i == num_var)
+	    free_i = i;
+	  continue;
+	}
+      vsz = (~vmask & phys_max) + 1;
+      if (vbase + vsz <= base || base + sz <= vbase)
+	continue;
+      if ((uint8_t) st->base[i] == MTRR_WC && vbase <= base
+	  && base + sz <= vbase + vsz)
+	return;
+      /*
+       * A WC range overlapping a UC range stays UC, & one overlapping a
+       * WB range gives an undefined memory type.  Leave it.
+       */
+      cprintf ("  0x%" PRIx32 "%08" PRIx32 ": overlaps MTRR #%u, "
+	       "not made WC\n", (uint32_t) (base >> 32), (uint32_t) base, i);
+      return;
+    }
+  if (free_i == num_var)
+    {
+      cprintf ("  0x%" PRIx32 "%08" PRIx32 ": no free MTRR\n",
+	       (uint32_t) (base >> 32), (uint32_t) base);
+      return;
+    }
+  st->base[free_i] = base | MTRR_WC;
+  st->mask[free_i] = mask | PHYSMASK_V;
+}
+
+/* Make the prefetchable memory BARs of display controllers WC. */
+static void
+plan_var (bparm_t * bparms, mtrr_state_t * st)
+{
+  bdat_pci_dev_t *pd;
+  uint32_t iter;
+  if (!have_wc)
+    return;
+  FOR_EACH_BPARM (pd, bparms, BPI_PCID, iter)
+  {
+    uint32_t locn = pd->pci_locn;
+    uint8_t which;
+    if (pd->class_if >> 24 != PCI_CIF_VID_VGA >> 24)
+      continue;
+    for (which = 0; which < 6; ++which)
+      {
+	uint32_t lo_bar = in_pci_d_aligned (locn, 0x10 + 4 * which);
+	uint64_t base;
+	if (pci_bar_is_io (lo_bar))
+	  continue;
+	base = pci_bar_addr (lo_bar);
+	if (pci_bar_is_mem64 (lo_bar))
+	  base |= (uint64_t) in_pci_d_aligned (locn, 0x14 + 4 * which) << 32;
+	if (pci_bar_is_mempf (lo_bar) && base)
+	  plan_var_wc (st, base, pci_bar_size (locn, which));
+	if (pci_bar_is_mem64 (lo_bar))
+	  ++which;
+      }
+  }
+}
+
+/*
+ * Report the MTRRs as the firmware left them, then set up a more useful
+ * layout, & report that.
+ */
+void
+mtrr_init (bparm_t * bparms)
+{
+  uint32_t feats, cap, max_leaf, addr_sz = 36;
+  cpuid (1, NULL, NULL, NULL, &feats);
+  if ((feats & ID1D_MTRR) == 0)
+    {
+      cputs ("no MTRRs\n");
+      return;
+    }
+  cap = (uint32_t) rdmsr (MSR_MTRRCAP);
+  have_fixed = (cap & MTRRCAP_FIX) != 0;
+  have_wc = (cap & MTRRCAP_WC) != 0;
+  num_var = cap & MTRRCAP_VCNT;
+  if (num_var > MAX_VAR)
+    num_var = MAX_VAR;
+  cpuid (0x80000000U, &max_leaf, NULL, NULL, NULL);
+  if (max_leaf >= 0x80000008U)
+    {
+      cpuid (0x80000008U, &addr_sz, NULL, NULL, NULL);
+      addr_sz &= 0xff;
+    }
+  phys_max = ((uint64_t) 1 << addr_sz) - 1;
+  have_mtrrs = true;
+  read_state (&old_st);
+  print_state ("before", &old_st);
+  new_st = old_st;
+  if (have_fixed)
+    plan_fixed (bparms, &new_st);
+  plan_var (bparms, &new_st);
+  new_st.def_type |= DEF_TYPE_E;
+  if (memcmp (&old_st, &new_st, sizeof (mtrr_state_t)) == 0)
+    {
+      cputs ("MTRRs unchanged\n");
+      return;
+    }
+  write_state (&new_st);
+  read_state (&new_st);
+  print_state ("after", &new_st);
+}
+
+/*
+ * Give a newly started application processor the same MTRR layout as the
+ * bootstrap processor.
+ */
+void
+mtrr_ap_init (void)
+{
+  if (have_mtrrs)
+    write_state (&new_st);
+}
+
+/*
+ * Return the memory type which the fixed-range MTRRs give to the physical
+ * address `pa' < 1 MiB, or ~0U if they do not apply.
+ */
+unsigned
+mtrr_fixed_type (uint32_t pa)
+{
+  uint64_t def_type;
+  unsigned k;
+  if (!have_mtrrs || !have_fixed || pa >= BMEM_MAX_ADDR)
+    return ~0U;
+  def_type = rdmsr (MSR_MTRR_DEF_TYPE);
+  if ((def_type & (DEF_TYPE_E | DEF_TYPE_FE)) != (DEF_TYPE_E | DEF_TYPE_FE))
+    return ~0U;
+  if (pa < 0x80000U)
+    k = pa >> 16;
+  else if (pa < 0xc0000U)
+    k = 8 + ((pa - 0x80000U) >> 14);
+  else
+    k = 24 + ((pa - 0xc0000U) >> 12);
+  return (uint8_t) (rdmsr (fixed_msrs[k / 8]) >> (k % 8 * 8));
+}
@@ -88,25 +88,219 @@ out_pci_d_maybe_unaligned (uint32_t locn, uint8_t off, uint32_t v)
     }
 }
 
+/*
+ * Find the size of the memory block decoded by a memory BAR --- or BAR
+ * pair, for a 64-bit address --- by writing all ones to it & reading it
+ * back.  Memory decoding is turned off while this is done.  Return 0 for
+ * an I/O BAR or an unused BAR.
+ */
+uint64_t
+pci_bar_size (uint32_t locn, uint8_t which)
+{
+  uint8_t off = 0x10 + 4 * which;
+  uint32_t cmd = in_pci_d_aligned (locn, 0x04) & 0xffffU,
+	   lo_bar = in_pci_d_aligned (locn, off), hi_bar, lo_sz, hi_sz;
+  uint64_t mask;
+  if (pci_bar_is_io (lo_bar))
+    return 0;
+  /* Writing 0s to the status register leaves its bits alone. */
+  out_pci_d_aligned (locn, 0x04, cmd & ~PCI_CMD_MEM);
+  out_pci_d_aligned (locn, off, 0xffffffffU);
+  lo_sz = in_pci_d_aligned (locn, off);
+  out_pci_d_aligned (locn, off, lo_bar);
+  hi_sz = 0xffffffffU;
+  if (pci_bar_is_mem64 (lo_bar))
+    {
+      hi_bar = in_pci_d_aligned (locn, off + 4);
+      out_pci_d_aligned (locn, off + 4, 0xffffffffU);
+      hi_sz = in_pci_d_aligned (locn, off + 4);
+      out_pci_d_aligned (locn, off + 4, hi_bar);
+    }
+  out_pci_d_aligned (locn, 0x04, cmd);
+  if (!pci_bar_addr (lo_sz) && (!hi_sz || !pci_bar_is_mem64 (lo_bar)))
+    return 0;
+  mask = (uint64_t) hi_sz << 32 | pci_bar_addr (lo_sz);
+  return -mask;
+}
+
 /*
  * Map an area of memory given by a PCI Base Address Register (BAR) --- or 2
  * BARs, for a 64-bit memory address --- into our 32-bit virtual address
- * space.  If `p_pa' is non-null, set *`p_pa' to the physical address of the
- * memory block.
+ * space, with memory type `mt'.  Device registers should use MT_UC.  Frame
+ * buffers & other bulk memory behind a prefetchable BAR may use MT_WC; for
+ * a BAR that is not prefetchable, MT_WC falls back to MT_UC.
+ *
+ * If `p_pa' is non-null, set *`p_pa' to the physical address of the memory
+ * block.  The mapping should be released with mmio_unmap (.).
  */
 void *
-pci_va_map (uint32_t locn, uint8_t which, size_t sz, uint64_t * p_pa)
+pci_va_map (uint32_t locn, uint8_t which, size_t sz, unsigned mt,
+	    uint64_t * p_pa)
 {
   uint8_t off = 0x10 + 4 * which;
   uint32_t lo_bar = in_pci_d_aligned (locn, off), hi_bar = 0;
   uint64_t pa;
-  unsigned pte_flags = 0;
   if (pci_bar_is_mem64 (lo_bar))
     hi_bar = in_pci_d_aligned (locn, off + 4);
   pa = (uint64_t) hi_bar << 32 | pci_bar_addr (lo_bar);
   if (p_pa)
     *p_pa = pa;
-  if (!pci_bar_is_mempf (lo_bar))
-    pte_flags = PTE_CD;
-  return mem_va_map (pa, sz, pte_flags);
+  if (mt == MT_WC && !pci_bar_is_mempf (lo_bar))
+    mt = MT_UC;
+  return mmio_map (pa, sz, mt);
+}
+
+/*
+ * Set the PAM attributes for shadow RAM block `blk' to `attr', & return
+ * the old attributes.
+ */
+static unsigned
+pam_set (uint8_t pam1, unsigned blk, unsigned attr)
+{
+  unsigned shift;
+  uint8_t off = pam_reg (pam1, blk, &shift);
+  uint32_t v;
+  shift += 8 * (off & 3);
+  off &= ~(uint8_t) 3;
+  v = in_pci_d_aligned (0, off);
+  out_pci_d_aligned (0, off, (v & ~(0xfU << shift)) | attr << shift);
+  return v >> shift & 0xfU;
+}
+
+/*
+ * Return true if the memory range [`start', `start' + `sz') overlaps the
+ * part of the F segment which the resident real mode code would take up.
+ */
+static bool
+fseg_text_clash (uint32_t start, uint32_t sz)
+{
+  uint32_t text_end = PAM_SHADOW_END + (uint32_t) (uintptr_t) _etext16;
+  return start < text_end && (uint64_t) start + sz > PAM_SHADOW_END;
+}
+
+/*
+ * Return true if any SMBIOS, MP, or PCI IRQ routing table which the
+ * firmware left in the F segment --- or any table which one of them points
+ * to --- lies where the real mode code would go.
+ */
+static bool
+fseg_tabs_clash (void)
+{
+  const uint8_t *p;
+  const uint8_t *mpc;
+  uint32_t addr;
+  for (p = (const uint8_t *) PAM_SHADOW_END;
+       p < (const uint8_t *) BMEM_MAX_ADDR; p += PARA_SIZE)
+    {
+      if (memcmp (p, "_SM_", 4) == 0)
+	{
+	  if (fseg_text_clash ((uintptr_t) p, p[5])
+	      || fseg_text_clash (*(const uint32_t *) (p + 0x18),
+				  *(const uint16_t *) (p + 0x16)))
+	    return true;
+	}
+      else if (memcmp (p, "_SM3_", 5) == 0)
+	{
+	  if (fseg_text_clash ((uintptr_t) p, p[6])
+	      || (*(const uint32_t *) (p + 0x14) == 0
+		  && fseg_text_clash (*(const uint32_t *) (p + 0x10),
+				      *(const uint32_t *) (p + 0x0c))))
+	    return true;
+	}
+      else if (memcmp (p, "_MP_", 4) == 0)
+	{
+	  if (fseg_text_clash ((uintptr_t) p, p[8] * PARA_SIZE))
+	    return true;
+	  addr = *(const uint32_t *) (p + 4);
+	  if (addr != 0 && addr < BMEM_MAX_ADDR)
+	    {
+	      mpc = (const uint8_t *) (uintptr_t) addr;
+	      if (fseg_text_clash (addr, *(const uint16_t *) (mpc + 4)
+					 + *(const uint16_t *) (mpc + 0x28)))
+		return true;
+	    }
+	}
+      else if (memcmp (p, "$PIR", 4) == 0)
+	{
+	  if (fseg_text_clash ((uintptr_t) p, *(const uint16_t *) (p + 6)))
+	    return true;
+	}
+    }
+  return false;
+}
+
+/*
+ * Try to turn 0xf0000~0xfffff into read/write shadow RAM for the resident
+ * real mode code, as on a real BIOS.  This only works if stage 1 found a
+ * host bridge it knows, & if the ACPI RSDP & any SMBIOS, MP, or $PIR
+ * tables are not where the code would go.  The firmware's F segment is
+ * copied into the shadow RAM first, so that any such tables elsewhere in
+ * the segment stay put.  Return true if successful.
+ */
+bool
+pci_shadow_fseg_open (bparm_t * bparms)
+{
+  bdat_bmem_t *bmem;
+  bdat_rsdp_t *rsdp;
+  uint32_t n, v, w;
+  unsigned old_attr;
+  volatile uint32_t *p = (volatile uint32_t *) PAM_SHADOW_END,
+		    *q = (volatile uint32_t *) BMEM_MAX_ADDR - 1, *r;
+  bmem = bparm_recs (bparms, BPI_BMEM, sizeof (bdat_bmem_t), &n);
+  if (!bmem || !bmem->pam1_off)
+    return false;
+  rsdp = bparm_recs (bparms, BPI_RSDP, sizeof (bdat_rsdp_t), &n);
+  if (rsdp && rsdp->rsdp_phy_addr < BMEM_MAX_ADDR
+      && fseg_text_clash (rsdp->rsdp_phy_addr, rsdp->rsdp_sz))
+    return false;
+  if (fseg_tabs_clash ())
+    return false;
+  /*
+   * With only writes going to DRAM, reads still come from the firmware's
+   * copy, so `*r = *r' copies the segment into shadow RAM.
+   */
+  wbinvd ();
+  old_attr = pam_set (bmem->pam1_off, PAM_FSEG_BLK, PAM_WE);
+  for (r = p; r <= q; ++r)
+    *r = *r;
+  wbinvd ();
+  pam_set (bmem->pam1_off, PAM_FSEG_BLK, PAM_RE | PAM_WE);
+  wbinvd ();
+  v = *p;
+  w = *q;
+  *p = 0x5aa5c33cU;
+  *q = 0xa55a3cc3U;
+  if (*p != 0x5aa5c33cU || *q != 0xa55a3cc3U)
+    {
+      pam_set (bmem->pam1_off, PAM_FSEG_BLK, old_attr);
+      wbinvd ();
+      return false;
+    }
+  *p = v;
+  *q = w;
+  bmem->shadow_blks |= 1U << PAM_FSEG_BLK;
+  return true;
+}
+
+/*
+ * Make the shadow RAM blocks which stage 1 set aside for option ROM images
+ * --- & the 0xf0000 block, if we use it --- read-only, now that the ROMs
+ * are initialized.  Any dirty cache lines must reach DRAM first, or they
+ * would be lost on their way out.
+ */
+void
+pci_shadow_lock (bparm_t * bparms)
+{
+  bdat_bmem_t *bmem;
+  uint32_t num_bmems;
+  unsigned blk;
+  bmem = bparm_recs (bparms, BPI_BMEM, sizeof (bdat_bmem_t), &num_bmems);
+  if (!bmem || !bmem->pam1_off || !bmem->shadow_blks)
+    return;
+  wbinvd ();
+  for (blk = 0; blk <= PAM_FSEG_BLK; ++blk)
+    if ((bmem->shadow_blks >> blk & 1) != 0)
+      pam_set (bmem->pam1_off, blk, PAM_RE);
+  cprintf ("shadow RAM blocks 0x%04" PRIx16 " now read-only\n",
+	   bmem->shadow_blks);
 }
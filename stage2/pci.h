@@ -36,11 +36,17 @@
 #define PCI_ADDR	0x0cf8
 #define PCI_DATA	0x0cfc
 
+/* Bits in the PCI command register. */
+#define PCI_CMD_MEM	0x0002U		/* memory space enable */
+
 /* pci.c functions. */
 
 extern uint32_t in_pci_d_maybe_unaligned (uint32_t, uint8_t);
 extern void out_pci_d_maybe_unaligned (uint32_t, uint8_t, uint32_t);
-extern void *pci_va_map (uint32_t, uint8_t, size_t, uint64_t *);
+extern uint64_t pci_bar_size (uint32_t, uint8_t);
+extern void *pci_va_map (uint32_t, uint8_t, size_t, unsigned, uint64_t *);
+extern bool pci_shadow_fseg_open (bparm_t *);
+extern void pci_shadow_lock (bparm_t *);
 
 /* Read an aligned longword from a PCI device's PCI configuration space. */
 static inline uint32_t
@@ -30,6 +30,7 @@
 %define	KIBYTE		1024
 %define PARA_SIZE	0x10
 %define BMEM_MAX_ADDR	0x100000
+%define MTAG_RT16	9		; as in bparm.h
 
 	section	.text
 
@@ -44,10 +45,15 @@
 rm16_init:
 	push	esi
 	push	edi
-	mov	eax, _etext16		; allocate base memory for the real-
-	mov	edx, PARA_SIZE		; -mode code
+	test	al, al			; if we have shadow RAM at 0xf0000,
+	mov	eax, 0xf0000		; put the real-mode code there, as a
+	jnz	.got_text		; real BIOS would
+	push	MTAG_RT16		; otherwise allocate base memory for
+	mov	eax, _etext16		; the real-mode code
+	mov	edx, PARA_SIZE
 	mov	ecx, BMEM_MAX_ADDR
-	call	mem_alloc
+	call	mem_alloc		; (callee pops the tag)
+.got_text:
 	or	[gdt_desc_cs16+2], eax	; fix up the GDT entry for SEL_CS16
 	mov	esi, text16_load	; copy out the 16-bit code
 	lea	edi, [eax+_stext16]
@@ -58,10 +64,11 @@ rm16_init:
 	mov	[rm16_cs], cx
 	mov	[eax+rm16_call.rm_cs16], cx
 	push	ecx			; (1) --- see below
-	mov	eax, _end16		; allocate base memory for the real-
-	mov	edx, KIBYTE		; -mode data
+	push	MTAG_RT16		; allocate base memory for the real-
+	mov	eax, _end16		; -mode data
+	mov	edx, KIBYTE
 	mov	ecx, BMEM_MAX_ADDR
-	call	mem_alloc
+	call	mem_alloc		; (callee pops the tag)
 	or	[gdt_desc_ds16+2], eax	; fix up the GDT entry for SEL_DS16
 	mov	edx, eax		; initialize the EBDA pointer
 	shr	edx, 4
@@ -119,18 +126,25 @@ rm16_call:
 	mov	es, si
 	mov	ss, si
 	mov	gs, si
+	call	rm16_reload_ds16
+	popfd
+	pop	ebp
+	pop	edi
+	pop	esi
+	pop	ebx
+	ret	8
+
+	global	rm16_reload_ds16
+rm16_reload_ds16:
+	push	esi
 	movzx	esi, word [bda.ebda]	; properly update SEL_DS16 descriptor
 	shl	esi, 4			; in case EBDA has moved
 	or	esi, 0x92000000
 	mov	[gdt_desc_ds16+2], esi
 	mov	si, SEL_DS16
 	mov	fs, si
-	popfd
-	pop	ebp
-	pop	edi
 	pop	esi
-	pop	ebx
-	ret	8
+	ret
 
 	align	4
 data16_load:
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Optional scrub of free memory at boot, spread over all processors ---
+ * `make MEMSCRUB=1' zeroes the memory, & `make MEMSCRUB=2' also runs a
+ * quick moving inversions test over it first.
+ *
+ * The free memory is cut into units of at most a large page, none of which
+ * cross a large page boundary.  Each processor takes units off a shared
+ * counter until there are none left.  Memory above 4 GiB is reached
+ * through a per-processor large page window.
+ *
+ * Units which fail the test are marked as unusable in the memory map;
+ * other memory below 4 GiB goes back to mem_free (...).  Base memory, & the
+ * memory which stage 2 is already using, are left alone.
+ *
+ * The test works through the caches, so it catches stuck or shorted bits
+ * but not subtle timing faults.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "stage2/stage2.h"
+
+/* Slack for free blocks which appear between counting & taking them. */
+#define SLACK_BLKS	128U
+#if MEMSCRUB >= 2
+#define WHAT		"mem. scrub & test"
+#else
+#define WHAT		"mem. scrub"
+#endif
+
+static struct
+{
+  mem_blk_t *blks;			/* high RAM ranges, then free
+					   blocks below 4 GiB */
+  uint32_t *first_unit;			/* first unit no. in each block */
+  uint32_t *bad;			/* bitmap of failed units */
+  uint32_t num_blks, num_high, num_units;
+  uint32_t next_unit;
+  bool sse2;
+  void *wins[MAX_CPUS];
+  uint64_t bytes[MAX_CPUS], cycles[MAX_CPUS];
+} scrub;
+
+/* Divide `n' by `d', without help from libgcc. */
+static uint64_t
+udiv64 (uint64_t n, uint64_t d)
+{
+  uint64_t q = 0, r = 0;
+  int i;
+  if (!d)
+    return 0;
+  for (i = 63; i >= 0; --i)
+    {
+      r = r << 1 | (n >> i & 1);
+      if (r >= d)
+	{
+	  r -= d;
+	  q |= (uint64_t) 1 << i;
+	}
+    }
+  return q;
+}
+
+/* Return the no. of units in the block [start, start + len). */
+static uint32_t
+blk_units (uint64_t start, uint64_t len)
+{
+  return (uint32_t) ((start + len - 1) / LARGE_PAGE_SIZE
+		     - start / LARGE_PAGE_SIZE + 1);
+}
+
+/*
+ * Find the physical address & length of unit no. `u', & say which block it
+ * is in.
+ */
+static uint32_t
+unit_find (uint32_t u, uint64_t * p_start, uint32_t * p_len)
+{
+  uint32_t left = 0, right = scrub.num_blks, k;
+  const mem_blk_t *blk;
+  uint64_t start, end;
+  while (left < right - 1)
+    {
+      uint32_t mid = (left + right) / 2;
+      if (scrub.first_unit[mid] > u)
+	right = mid;
+      else
+	left = mid;
+    }
+  blk = &scrub.blks[left];
+  k = u - scrub.first_unit[left];
+  start = k ? (blk->start & -(uint64_t) LARGE_PAGE_SIZE)
+	      + (uint64_t) k * LARGE_PAGE_SIZE : blk->start;
+  end = (start & -(uint64_t) LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+  if (end > blk->start + blk->len)
+    end = blk->start + blk->len;
+  *p_start = start;
+  *p_len = (uint32_t) (end - start);
+  return left;
+}
+
+#if MEMSCRUB >= 2
+/*
+ * Run a moving inversions pass with the pattern `pat' over the `n' dwords
+ * at `p'.  Say whether all the read-backs were as expected.
+ */
+static bool
+mov_inv (volatile uint32_t * p, uint32_t n, uint32_t pat)
+{
+  uint32_t i;
+  bool ok = true;
+  for (i = 0; i < n; ++i)
+    p[i] = pat;
+  for (i = 0; i < n; ++i)
+    {
+      if (p[i] != pat)
+	ok = false;
+      p[i] = ~pat;
+    }
+  for (i = n; i-- != 0;)
+    {
+      if (p[i] != ~pat)
+	ok = false;
+      p[i] = pat;
+    }
+  for (i = n; i-- != 0;)
+    if (p[i] != pat)
+      ok = false;
+  return ok;
+}
+#endif
+
+/*
+ * Zero the `n' dwords at `p'.  Use non-temporal stores if we can, so as
+ * not to fill the caches with zeroes nobody will read soon.  `n' is a
+ * multiple of 4.
+ */
+static void
+zero (uint32_t * p, uint32_t n)
+{
+  if (scrub.sse2)
+    {
+      for (; n; n -= 4, p += 4)
+	__asm volatile ("movnti %4, %0; movnti %4, %1; "
+			"movnti %4, %2; movnti %4, %3"
+			: "=m" (p[0]), "=m" (p[1]), "=m" (p[2]), "=m" (p[3])
+			: "r" (0));
+      __asm volatile ("sfence" : : : "memory");
+    }
+  else
+    __asm volatile ("rep stosl" : "+D" (p), "+c" (n) : "a" (0) : "memory");
+}
+
+/* Scrub units on processor `cpu', until there are none left. */
+static void
+scrub_cpu (unsigned cpu, void *arg)
+{
+  void *win = scrub.wins[cpu];
+  uint32_t u;
+  if (scrub.num_high && !win)
+    return;
+  while ((u = __atomic_fetch_add (&scrub.next_unit, 1, __ATOMIC_RELAXED))
+	 < scrub.num_units)
+    {
+      uint64_t start, t;
+      uint32_t len, *p;
+      bool ok = true;
+      if (unit_find (u, &start, &len) < scrub.num_high)
+	{
+	  mem_va_window_map (win, start & -(uint64_t) LARGE_PAGE_SIZE);
+	  p = (uint32_t *) ((char *) win + (uint32_t) start % LARGE_PAGE_SIZE);
+	}
+      else
+	p = (uint32_t *) (uint32_t) start;
+      t = rdtsc ();
+#if MEMSCRUB >= 2
+      ok = mov_inv (p, len / 4, 0) && mov_inv (p, len / 4, 0x55555555U);
+#endif
+      zero (p, len / 4);
+      scrub.cycles[cpu] += rdtsc () - t;
+      scrub.bytes[cpu] += len;
+      if (!ok)
+	__atomic_fetch_or (&scrub.bad[u / 32], UINT32_C (1) << u % 32,
+			   __ATOMIC_RELAXED);
+    }
+}
+
+static bool
+unit_bad (uint32_t u)
+{
+  return (scrub.bad[u / 32] & UINT32_C (1) << u % 32) != 0;
+}
+
+/*
+ * Find the run of units starting at unit *`p_u' in block `b' which all
+ * passed or all failed, & advance *`p_u' past it.  Return true if the run
+ * failed.
+ */
+static bool
+next_run (uint32_t b, uint32_t * p_u, uint64_t * p_start, uint64_t * p_end)
+{
+  const mem_blk_t *blk = &scrub.blks[b];
+  uint32_t u = *p_u, u_end = scrub.first_unit[b]
+			    + blk_units (blk->start, blk->len), len;
+  bool bad = unit_bad (u);
+  uint64_t start;
+  unit_find (u, p_start, &len);
+  *p_end = *p_start + len;
+  while (++u < u_end && unit_bad (u) == bad)
+    {
+      unit_find (u, &start, &len);
+      *p_end = start + len;
+    }
+  *p_u = u;
+  return bad;
+}
+
+/*
+ * Once the units are done, give back the good ones below 4 GiB, then mark
+ * the bad ones as unusable --- marking them may need memory, to make room
+ * in the memory map.  Coalesce runs of units within each block.
+ */
+static void
+scrub_fini (void)
+{
+  uint32_t b, u, u_end;
+  uint64_t start, end;
+  for (b = scrub.num_high; b < scrub.num_blks; ++b)
+    {
+      u = scrub.first_unit[b];
+      u_end = u + blk_units (scrub.blks[b].start, scrub.blks[b].len);
+      while (u < u_end)
+	if (!next_run (b, &u, &start, &end))
+	  mem_free ((void *) (uint32_t) start, (size_t) (end - start),
+		    MTAG_SCRUB);
+    }
+  for (b = 0; b < scrub.num_blks; ++b)
+    {
+      u = scrub.first_unit[b];
+      u_end = u + blk_units (scrub.blks[b].start, scrub.blks[b].len);
+      while (u < u_end)
+	if (next_run (b, &u, &start, &end))
+	  {
+	    cprintf ("bad memory @0x%" PRIx32 "%08" PRIx32
+		     "-0x%" PRIx32 "%08" PRIx32 "\n",
+		     (uint32_t) (start >> 32), (uint32_t) start,
+		     (uint32_t) ((end - 1) >> 32), (uint32_t) (end - 1));
+	    mem_mark_unusable (start, end - start);
+	  }
+    }
+}
+
+/* Scrub (& maybe test) all free memory, using all processors. */
+void
+mem_scrub (void)
+{
+  unsigned num_cpus, i;
+  uint32_t cap, num_low, b, units_cap;
+  uint64_t total = 0, hz, t;
+  uint32_t feats;
+  cpuid (1, NULL, NULL, NULL, &feats);
+  scrub.sse2 = (feats & ID1D_SSE2) != 0;
+  num_cpus = smp_start ();
+  /*
+   * Set up everything which needs memory first, since the free lists
+   * will soon be empty.
+   */
+  scrub.num_high = mem_high_ram (NULL, 0);
+  cap = scrub.num_high + mem_take_free (NULL, 0, MTAG_SCRUB) + SLACK_BLKS;
+  scrub.blks = mem_alloc (cap * sizeof (mem_blk_t), 0, 0, MTAG_SCRUB);
+  scrub.first_unit = mem_alloc (cap * sizeof (uint32_t), 0, 0, MTAG_SCRUB);
+  mem_high_ram (scrub.blks, scrub.num_high);
+  if (scrub.num_high)
+    for (i = 0; i < num_cpus; ++i)
+      {
+	/* The bootstrap processor must have a window; others may not. */
+	uint64_t pa = scrub.blks[0].start & -(uint64_t) LARGE_PAGE_SIZE;
+	scrub.wins[i] = i ? mem_va_try_map (pa, LARGE_PAGE_SIZE, MT_WB)
+			  : mem_va_map (pa, LARGE_PAGE_SIZE, MT_WB);
+      }
+  units_cap = cap + (uint32_t) (mem_free_bytes () / LARGE_PAGE_SIZE);
+  for (b = 0; b < scrub.num_high; ++b)
+    {
+      total += scrub.blks[b].len;
+      units_cap += blk_units (scrub.blks[b].start, scrub.blks[b].len);
+    }
+  scrub.bad = mem_alloc ((units_cap + 31) / 32 * sizeof (uint32_t), 0, 0,
+			 MTAG_SCRUB);
+  num_low = mem_take_free (scrub.blks + scrub.num_high,
+			   cap - scrub.num_high, MTAG_SCRUB);
+  if (num_low > cap - scrub.num_high)
+    {
+      cputs ("too many free blocks to scrub\n");
+      num_low = 0;
+    }
+  scrub.num_blks = scrub.num_high + num_low;
+  scrub.num_units = 0;
+  for (b = 0; b < scrub.num_blks; ++b)
+    {
+      scrub.first_unit[b] = scrub.num_units;
+      scrub.num_units += blk_units (scrub.blks[b].start, scrub.blks[b].len);
+      if (b >= scrub.num_high)
+	total += scrub.blks[b].len;
+    }
+  for (b = 0; b < (scrub.num_units + 31) / 32; ++b)
+    scrub.bad[b] = 0;
+  scrub.next_unit = 0;
+  /* Go. */
+  t = rdtsc ();
+  smp_run (scrub_cpu, NULL);
+  t = rdtsc () - t;
+  hz = time_tsc_hz ();
+  cprintf (WHAT ": %" PRIu32 " MiB, %u CPU(s), %" PRIu32 " MiB/s\n",
+	   (uint32_t) (total >> 20),
+	   num_cpus, (uint32_t) udiv64 ((total >> 10) * (hz >> 10), t));
+  for (i = 0; i < num_cpus; ++i)
+    if (scrub.bytes[i])
+      cprintf ("  CPU %u: %" PRIu32 " MiB, %" PRIu32 " MiB/s\n", i,
+	       (uint32_t) (scrub.bytes[i] >> 20),
+	       (uint32_t) udiv64 ((scrub.bytes[i] >> 10) * (hz >> 10),
+				  scrub.cycles[i]));
+  scrub_fini ();
+  for (i = 0; i < num_cpus; ++i)
+    if (scrub.wins[i])
+      mem_va_unmap (scrub.wins[i], LARGE_PAGE_SIZE);
+  mem_free (scrub.bad, (units_cap + 31) / 32 * sizeof (uint32_t),
+	    MTAG_SCRUB);
+  mem_free (scrub.first_unit, cap * sizeof (uint32_t), MTAG_SCRUB);
+  mem_free (scrub.blks, cap * sizeof (mem_blk_t), MTAG_SCRUB);
+  smp_stop ();
+}
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Optional self tests & microbenchmarks, built in with `make SELFTEST=1'.
+ * The results go to the screen & to the serial port.  Each line of output
+ * starts with "ST ".
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include "stage2/stage2.h"
+
+static void
+st_printf (const char *fmt, ...)
+{
+  va_list ap;
+  va_start (ap, fmt);
+  vcprintf (fmt, ap);
+  va_end (ap);
+  va_start (ap, fmt);
+  vcomprintf (fmt, ap);
+  va_end (ap);
+}
+
+/*
+ * Time mem_va_map (...) & mem_va_unmap (...) pairs, with their targeted
+ * TLB invalidations, against the same pairs followed by full TLB flushes
+ * as was done before, & against pairs done in a single batch.
+ */
+static void
+st_va_map (void)
+{
+  enum
+  { ROUNDS = 256 };
+  void *page = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0, MTAG_TEST);
+  uint64_t pa = (uint32_t) page, start;
+  uint32_t cyc_new, cyc_old, cyc_batch;
+  volatile char *p;
+  unsigned i;
+  /* Warm up. */
+  p = mem_va_map (pa, PAGE_SIZE, MT_WB);
+  (void) *p;
+  mem_va_unmap (p, PAGE_SIZE);
+  start = rdtsc ();
+  for (i = 0; i < ROUNDS; ++i)
+    {
+      p = mem_va_map (pa, PAGE_SIZE, MT_WB);
+      (void) *p;
+      mem_va_unmap (p, PAGE_SIZE);
+    }
+  cyc_new = (uint32_t) (rdtsc () - start);
+  start = rdtsc ();
+  for (i = 0; i < ROUNDS; ++i)
+    {
+      p = mem_va_map (pa, PAGE_SIZE, MT_WB);
+      flush_cr3 ();
+      (void) *p;
+      mem_va_unmap (p, PAGE_SIZE);
+      flush_cr3 ();
+    }
+  cyc_old = (uint32_t) (rdtsc () - start);
+  start = rdtsc ();
+  mem_va_batch_begin ();
+  for (i = 0; i < ROUNDS; ++i)
+    {
+      p = mem_va_map (pa, PAGE_SIZE, MT_WB);
+      (void) *p;
+      mem_va_unmap (p, PAGE_SIZE);
+    }
+  mem_va_batch_end ();
+  cyc_batch = (uint32_t) (rdtsc () - start);
+  mem_free (page, PAGE_SIZE, MTAG_TEST);
+  st_printf ("ST va_map+unmap cycles/pair: invlpg %" PRIu32
+	     "  full flush %" PRIu32 "  batched %" PRIu32 "\n",
+	     cyc_new / ROUNDS, cyc_old / ROUNDS, cyc_batch / ROUNDS);
+}
+
+/*
+ * Map & unmap thousands of blocks of random sizes, keeping up to
+ * MAX_LIVE mappings at a time, & check that each mapping reaches the
+ * right physical memory.  Mappings of 2 MiB or more should be placed so
+ * that they can use large pages.  At the end, the unused virtual address
+ * space should be back to how it was.
+ */
+static void
+st_va_stress (void)
+{
+  enum
+  { ITERS = 8192, MAX_LIVE = 64, MAGIC = 0x5a17c0deU };
+  struct
+  {
+    volatile uint32_t *p;
+    uint32_t sz;
+  } live[MAX_LIVE];
+  uint32_t *page = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0, MTAG_TEST);
+  uint64_t pa = (uint32_t) page, start;
+  uint32_t free0, nr0, free1, nr1, max_nr = 0, rnd = 1, cyc;
+  unsigned i, n_live = 0, n_large = 0, n_misphased = 0, n_bad = 0;
+  for (i = 0; i < PAGE_SIZE / sizeof (uint32_t); ++i)
+    page[i] = MAGIC;
+  mem_va_stats (&free0, &nr0);
+  start = rdtsc ();
+  for (i = 0; i < ITERS; ++i)
+    {
+      uint32_t off, sz, nr;
+      rnd ^= rnd << 13;
+      rnd ^= rnd >> 17;
+      rnd ^= rnd << 5;
+      if (n_live == MAX_LIVE || (n_live && (rnd & 1) != 0))
+	{
+	  unsigned j = (rnd >> 1) % n_live;
+	  mem_va_unmap (live[j].p, live[j].sz);
+	  live[j] = live[--n_live];
+	  continue;
+	}
+      off = (rnd >> 4) % PAGE_SIZE & -(uint32_t) sizeof (uint32_t);
+      if ((rnd & 0xe) == 0)
+	sz = ((rnd >> 16) % 1024 + 1) * PAGE_SIZE;
+      else
+	sz = ((rnd >> 16) % 16 + 1) * PAGE_SIZE;
+      sz -= off;
+      live[n_live].p = mem_va_map (pa + off, sz, MT_WB);
+      live[n_live].sz = sz;
+      if (*live[n_live].p != MAGIC)
+	++n_bad;
+      if (sz + off >= LARGE_PAGE_SIZE)
+	{
+	  ++n_large;
+	  if (((uint32_t) live[n_live].p - (uint32_t) (pa + off))
+	      % LARGE_PAGE_SIZE != 0)
+	    ++n_misphased;
+	}
+      ++n_live;
+      mem_va_stats (NULL, &nr);
+      if (max_nr < nr)
+	max_nr = nr;
+    }
+  while (n_live)
+    {
+      --n_live;
+      mem_va_unmap (live[n_live].p, live[n_live].sz);
+    }
+  cyc = (uint32_t) (rdtsc () - start);
+  mem_va_stats (&free1, &nr1);
+  mem_free (page, PAGE_SIZE, MTAG_TEST);
+  st_printf ("ST va_stress: %u ops  %" PRIu32 " cycles/op  "
+	     "max ranges %" PRIu32 "\n", (unsigned) ITERS, cyc / ITERS,
+	     max_nr);
+  st_printf ("ST va_stress: %u large, %u not large-page aligned\n",
+	     n_large, n_misphased);
+  if (n_bad || free0 != free1 || nr0 != nr1)
+    st_printf ("ST va_stress: FAIL: %u bad mappings, free 0x%" PRIx32
+	       " -> 0x%" PRIx32 ", ranges %" PRIu32 " -> %" PRIu32 "\n",
+	       n_bad, free0, free1, nr0, nr1);
+  else
+    st_printf ("ST va_stress: ok\n");
+}
+
+/*
+ * Time repeated mmio_map (...) & mmio_unmap (.) of the same window, which
+ * should hit in the mapping cache, against mem_va_map (...) &
+ * mem_va_unmap (...) pairs.
+ */
+static void
+st_mmio (void)
+{
+  enum
+  { ROUNDS = 256 };
+  void *page = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0, MTAG_TEST);
+  uint64_t pa = (uint32_t) page, start;
+  uint32_t cyc_cached, cyc_raw;
+  volatile char *p, *q;
+  unsigned i, n_miss = 0;
+  p = mmio_map (pa, PAGE_SIZE, MT_WB);
+  mmio_unmap (p);
+  start = rdtsc ();
+  for (i = 0; i < ROUNDS; ++i)
+    {
+      q = mmio_map (pa + 0x10, 0x20, MT_WB);
+      if (q != p + 0x10)
+	++n_miss;
+      (void) *q;
+      mmio_unmap (q);
+    }
+  cyc_cached = (uint32_t) (rdtsc () - start);
+  start = rdtsc ();
+  for (i = 0; i < ROUNDS; ++i)
+    {
+      q = mem_va_map (pa + 0x10, 0x20, MT_WB);
+      (void) *q;
+      mem_va_unmap (q, 0x20);
+    }
+  cyc_raw = (uint32_t) (rdtsc () - start);
+  mem_free (page, PAGE_SIZE, MTAG_TEST);
+  st_printf ("ST mmio_map+unmap cycles/pair: cached %" PRIu32
+	     "  uncached %" PRIu32 "  misses %u\n", cyc_cached / ROUNDS,
+	     cyc_raw / ROUNDS, n_miss);
+}
+
+/*
+ * Compare the bandwidth of filling a buffer through uncached,
+ * write-combining, & write-back mappings.  The cpuid instruction at the
+ * end of each fill is there to drain the write-combining buffers.
+ */
+static void
+st_fill (void)
+{
+  enum
+  { BUF_SZ = 0x10000 };
+  static const struct
+  {
+    unsigned mt;
+    const char *name;
+  } mts[] = { { MT_UC, "UC" }, { MT_WC, "WC" }, { MT_WB, "WB" } };
+  void *buf = mem_alloc (BUF_SZ, PAGE_SIZE, 0, MTAG_TEST);
+  unsigned i, j;
+  for (i = 0; i < sizeof (mts) / sizeof (mts[0]); ++i)
+    {
+      volatile uint32_t *p = mem_va_map ((uint32_t) buf, BUF_SZ, mts[i].mt);
+      uint64_t start = rdtsc ();
+      uint32_t cyc;
+      for (j = 0; j < BUF_SZ / sizeof (uint32_t); ++j)
+	p[j] = j;
+      cpuid (0, NULL, NULL, NULL, NULL);
+      cyc = (uint32_t) (rdtsc () - start);
+      mem_va_unmap (p, BUF_SZ);
+      st_printf ("ST fill %s: %" PRIu32 " cycles/KiB\n", mts[i].name,
+		 cyc / (BUF_SZ / 1024));
+    }
+  mem_free (buf, BUF_SZ, MTAG_TEST);
+}
+
+/* Fashion a data segment descriptor for int 0x15, ah = 0x87. */
+static uint64_t
+st_desc (uint32_t base, uint32_t limit)
+{
+  return (uint64_t) (limit & 0xffff) | (uint64_t) (base & 0xffffff) << 16
+	 | (uint64_t) 0x93 << 40 | (uint64_t) (limit >> 16 & 0x0f) << 48
+	 | (uint64_t) (base >> 24) << 56;
+}
+
+/*
+ * Time 64 KiB block moves through int 0x15, ah = 0x87, including the trip
+ * from & back to protected mode, & compare with a plain memcpy (...).
+ */
+static void
+st_xmove (void)
+{
+  enum
+  { BLK_SZ = 0x10000, ROUNDS = 64 };
+  extern int xmove16f (/* ... */);
+  uint64_t gdt[6], start;
+  char *src = mem_alloc (BLK_SZ, PAGE_SIZE, 0, MTAG_TEST),
+       *dst = mem_alloc (BLK_SZ, PAGE_SIZE, 0, MTAG_TEST);
+  uint32_t cyc_move, cyc_memcpy, hz_1k = (uint32_t) (time_tsc_hz () >> 10);
+  unsigned i;
+  int err = 0;
+  for (i = 0; i < BLK_SZ; ++i)
+    src[i] = (char) (i * 7);
+  memset (dst, 0, BLK_SZ);
+  memset (gdt, 0, sizeof (gdt));
+  gdt[2] = st_desc ((uint32_t) src, BLK_SZ - 1);
+  gdt[3] = st_desc ((uint32_t) dst, BLK_SZ - 1);
+  copy_to_tb (gdt, sizeof (gdt));
+  start = rdtsc ();
+  for (i = 0; i < ROUNDS; ++i)
+    err |= rm16_cs_call (0, 0, BLK_SZ / 2, 0, xmove16f);
+  cyc_move = (uint32_t) (rdtsc () - start) / (ROUNDS * (BLK_SZ / 1024));
+  if (memcmp (src, dst, BLK_SZ) != 0)
+    err = -1;
+  start = rdtsc ();
+  for (i = 0; i < ROUNDS; ++i)
+    memcpy (dst, src, BLK_SZ);
+  cyc_memcpy = (uint32_t) (rdtsc () - start) / (ROUNDS * (BLK_SZ / 1024));
+  /* (TSC Hz / 1024) / (cycles per KiB) = MiB/s */
+  st_printf ("ST xmove: int 0x15 ah=0x87 %" PRIu32 " cycles/KiB "
+	     "%" PRIu32 " MiB/s  memcpy %" PRIu32 " cycles/KiB "
+	     "%" PRIu32 " MiB/s  %s\n",
+	     cyc_move, cyc_move ? hz_1k / cyc_move : 0,
+	     cyc_memcpy, cyc_memcpy ? hz_1k / cyc_memcpy : 0,
+	     err ? "FAIL" : "ok");
+  mem_free (dst, BLK_SZ, MTAG_TEST);
+  mem_free (src, BLK_SZ, MTAG_TEST);
+}
+
+/*
+ * Check that the fixed-range MTRRs now make the VGA window WC (or UC, if
+ * the CPU has no WC), & conventional memory WB.
+ */
+static void
+st_mtrr (void)
+{
+  uint32_t pa;
+  unsigned type, n_bad = 0;
+  if (mtrr_fixed_type (0) == ~0U)
+    {
+      st_printf ("ST mtrr: no fixed-range MTRRs\n");
+      return;
+    }
+  for (pa = 0xa0000U; pa < 0xc0000U; pa += 0x4000U)
+    {
+      type = mtrr_fixed_type (pa);
+      if (type != MTRR_WC && type != MTRR_UC)
+	++n_bad;
+    }
+  if (mtrr_fixed_type (0) != MTRR_WB)
+    ++n_bad;
+  st_printf ("ST mtrr: VGA window %s  %s\n",
+	     mtrr_fixed_type (0xa0000U) == MTRR_WC ? "WC" : "not WC",
+	     n_bad ? "FAIL" : "ok");
+}
+
+/*
+ * Allocate many buffers from DMA pools with various constraints, & check
+ * that each buffer meets them.  Then free the buffers & allocate them
+ * again; the pools should not need to grow the second time round.
+ */
+static void
+st_dma (void)
+{
+  enum
+  { NUM_BUFS = 200 };
+  static const struct
+  {
+    uint32_t buf_sz, align, boundary;
+    uintptr_t max_addr;
+  } cfgs[] =
+    {
+      { 16, 16, 0x1000, 0 },		/* e.g. xHCI TRBs */
+      { 1024, 1024, 0x10000, 0x1000000 },
+      { 3000, 128, 0x1000, 0 }
+    };
+  static void *bufs[NUM_BUFS];
+  unsigned i, j, k, n_bad = 0;
+  for (i = 0; i < sizeof (cfgs) / sizeof (cfgs[0]); ++i)
+    {
+      dma_pool_t pool;
+      uint32_t grown;
+      dma_pool_init (&pool, "selftest", cfgs[i].buf_sz, cfgs[i].align,
+		     cfgs[i].boundary, cfgs[i].max_addr);
+      for (k = 0; k < 2; ++k)
+	{
+	  for (j = 0; j < NUM_BUFS; ++j)
+	    {
+	      uint32_t pa, end;
+	      bufs[j] = dma_alloc (&pool);
+	      pa = (uint32_t) dma_pa (bufs[j]);
+	      end = pa + cfgs[i].buf_sz - 1;
+	      if (pa % cfgs[i].align != 0
+		  || pa / cfgs[i].boundary != end / cfgs[i].boundary
+		  || (cfgs[i].max_addr && end >= cfgs[i].max_addr)
+		  || dma_va (pa) != bufs[j]
+		  || *(volatile uint32_t *) bufs[j] != 0)
+		++n_bad;
+	      memset (bufs[j], 0xa5, cfgs[i].buf_sz);
+	    }
+	  if (k == 0)
+	    grown = pool.num_bufs;
+	  else if (pool.num_bufs != grown)
+	    ++n_bad;
+	  for (j = 0; j < NUM_BUFS; ++j)
+	    dma_free (&pool, bufs[j]);
+	}
+      st_printf ("ST dma: %" PRIu32 "-byte bufs: %" PRIu32
+		 " carved for %u\n", cfgs[i].buf_sz, pool.num_bufs,
+		 (unsigned) NUM_BUFS);
+    }
+  st_printf ("ST dma: %s\n", n_bad ? "FAIL" : "ok");
+}
+
+/*
+ * Allocate & free thousands of small objects of random sizes through
+ * slab_alloc (.) & slab_free (.), checking alignment & that objects do not
+ * overlap.  Once everything is freed, at most one empty slab per size
+ * class should still be holding memory.
+ */
+static void
+st_slab (void)
+{
+  enum
+  { ITERS = 8192, MAX_LIVE = 512 };
+  static struct
+  {
+    uint8_t *p;
+    uint32_t sz;
+  } live[MAX_LIVE];
+  uint64_t free0, free1, start;
+  uint32_t rnd = 12345, cyc, k;
+  unsigned i, j, n_live = 0, n_bad = 0;
+  free0 = mem_free_bytes ();
+  start = rdtsc ();
+  for (i = 0; i < ITERS; ++i)
+    {
+      rnd ^= rnd << 13;
+      rnd ^= rnd >> 17;
+      rnd ^= rnd << 5;
+      if (n_live == MAX_LIVE || (n_live && (rnd & 3) == 0))
+	{
+	  j = (rnd >> 2) % n_live;
+	  for (k = 0; k < live[j].sz; ++k)
+	    if (live[j].p[k] != (uint8_t) j)
+	      {
+		++n_bad;
+		break;
+	      }
+	  slab_free (live[j].p);
+	  live[j] = live[--n_live];
+	  /* The moved object's fill pattern is now out of date. */
+	  if (j < n_live)
+	    for (k = 0; k < live[j].sz; ++k)
+	      live[j].p[k] = (uint8_t) j;
+	  continue;
+	}
+      live[n_live].sz = (rnd >> 8) % SLAB_MAX_SZ + 1;
+      live[n_live].p = slab_alloc (live[n_live].sz);
+      if ((uint32_t) live[n_live].p % 64 != 0 && live[n_live].sz > 32)
+	++n_bad;
+      for (k = 0; k < live[n_live].sz; ++k)
+	live[n_live].p[k] = (uint8_t) n_live;
+      ++n_live;
+    }
+  cyc = (uint32_t) (rdtsc () - start);
+  while (n_live)
+    slab_free (live[--n_live].p);
+  free1 = mem_free_bytes ();
+  /* Allow for one cached empty slab per size class. */
+  if (free0 - free1 > (uint64_t) 7 * PAGE_SIZE)
+    ++n_bad;
+  st_printf ("ST slab: %u ops  %" PRIu32 " cycles/op (incl. fills)  %s\n",
+	     (unsigned) ITERS, cyc / ITERS, n_bad ? "FAIL" : "ok");
+  slab_dump ();
+}
+
+void
+selftest (void)
+{
+  st_printf ("ST start\n");
+  st_va_map ();
+  st_va_stress ();
+  st_mmio ();
+  st_fill ();
+  st_xmove ();
+  st_mtrr ();
+  st_dma ();
+  st_slab ();
+  st_printf ("ST end\n");
+}
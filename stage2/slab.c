@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Slab allocator for small objects.  Requests are rounded up to one of a
+ * few power-of-2 size classes.  Each class has its own slabs, each slab
+ * being one page with a slab_t header at its start, followed by equal-size
+ * objects.  Objects of 64 bytes or more start on a cache line boundary,
+ * & smaller objects never straddle one.
+ *
+ * Slabs with free objects sit on their class's `partial' list.  Full slabs
+ * are not on any list.  When a slab becomes empty, it is kept if its
+ * class has no other empty slab, & otherwise its page goes back to
+ * mem_free (...).  Allocation & freeing thus take constant time.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "stage2/stage2.h"
+
+#define SLAB_MIN_SHIFT	4		/* smallest class is 16 bytes */
+#define NUM_CLASSES	7		/* classes go up to SLAB_MAX_SZ */
+#define CACHE_LINE	64
+
+typedef struct slab_obj
+{
+  struct slab_obj *next;
+} slab_obj_t;
+
+typedef struct slab
+{
+  struct slab *next, *prev;		/* links in `partial' list */
+  slab_obj_t *free;			/* free objects in this slab */
+  uint16_t cls, in_use;
+} slab_t;
+
+typedef struct
+{
+  slab_t *partial, *empty;
+  uint32_t obj_sz, first_off, objs_per_slab;
+  uint32_t num_slabs, in_use, peak_in_use;
+} slab_class_t;
+
+static slab_class_t classes[NUM_CLASSES];
+
+_Static_assert (SLAB_MAX_SZ == 1U << (SLAB_MIN_SHIFT + NUM_CLASSES - 1),
+		"SLAB_MAX_SZ does not match the size classes");
+
+static slab_class_t *
+size_to_class (size_t sz)
+{
+  unsigned cls = 0;
+  if (sz > (1U << SLAB_MIN_SHIFT))
+    cls = 32 - __builtin_clz (sz - 1) - SLAB_MIN_SHIFT;
+  if (cls >= NUM_CLASSES)
+    hlt ();
+  return &classes[cls];
+}
+
+static void
+partial_push (slab_class_t * c, slab_t * s)
+{
+  s->prev = NULL;
+  s->next = c->partial;
+  if (c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+partial_unlink (slab_class_t * c, slab_t * s)
+{
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+}
+
+/* Get a new page for a slab, & thread its objects onto its free list. */
+static slab_t *
+slab_new (slab_class_t * c)
+{
+  slab_t *s = mem_alloc (PAGE_SIZE, PAGE_SIZE, 0, MTAG_SLAB);
+  char *obj = (char *) s + c->first_off;
+  slab_obj_t *head = NULL;
+  uint32_t i = c->objs_per_slab;
+  obj += i * c->obj_sz;
+  while (i-- != 0)
+    {
+      obj -= c->obj_sz;
+      ((slab_obj_t *) obj)->next = head;
+      head = (slab_obj_t *) obj;
+    }
+  s->free = head;
+  s->cls = c - classes;
+  s->in_use = 0;
+  ++c->num_slabs;
+  return s;
+}
+
+/* Set up the size classes. */
+static void
+slab_init (void)
+{
+  unsigned i;
+  for (i = 0; i < NUM_CLASSES; ++i)
+    {
+      slab_class_t *c = &classes[i];
+      uint32_t obj_sz = 1U << (SLAB_MIN_SHIFT + i),
+	       align = obj_sz < CACHE_LINE ? obj_sz : CACHE_LINE;
+      c->obj_sz = obj_sz;
+      c->first_off = (sizeof (slab_t) + align - 1) & -align;
+      c->objs_per_slab = (PAGE_SIZE - c->first_off) / obj_sz;
+    }
+}
+
+/* Allocate an object of up to SLAB_MAX_SZ bytes.  The object is not zeroed. */
+void *
+slab_alloc (size_t sz)
+{
+  slab_class_t *c;
+  slab_t *s;
+  slab_obj_t *obj;
+  if (!classes[0].obj_sz)
+    slab_init ();
+  c = size_to_class (sz);
+  s = c->partial;
+  if (!s)
+    {
+      s = c->empty;
+      if (s)
+	c->empty = NULL;
+      else
+	s = slab_new (c);
+      partial_push (c, s);
+    }
+  obj = s->free;
+  s->free = obj->next;
+  if (++s->in_use == c->objs_per_slab)
+    partial_unlink (c, s);
+  if (++c->in_use > c->peak_in_use)
+    c->peak_in_use = c->in_use;
+  return obj;
+}
+
+/* Free an object obtained from slab_alloc (.). */
+void
+slab_free (void *p)
+{
+  slab_t *s = (slab_t *) ((uintptr_t) p & -(uintptr_t) PAGE_SIZE);
+  slab_obj_t *obj = p;
+  slab_class_t *c;
+  if (!p)
+    return;
+  if (s->cls >= NUM_CLASSES || !s->in_use)
+    hlt ();
+  c = &classes[s->cls];
+  if (s->in_use == c->objs_per_slab)
+    partial_push (c, s);
+  obj->next = s->free;
+  s->free = obj;
+  --c->in_use;
+  if (--s->in_use != 0)
+    return;
+  /* The slab is now empty.  Keep one empty slab per class for reuse. */
+  partial_unlink (c, s);
+  if (!c->empty)
+    c->empty = s;
+  else
+    {
+      --c->num_slabs;
+      mem_free (s, PAGE_SIZE, MTAG_SLAB);
+    }
+}
+
+/*
+ * Print each size class's usage.  "frag." is the proportion of the
+ * class's slab pages that is not holding live objects, whether because
+ * of free objects, slab headers, or leftover space at the ends of pages.
+ */
+void
+slab_dump (void)
+{
+  unsigned i;
+  cputs ("slab  size  slabs  in use   peak  frag.\n");
+  for (i = 0; i < NUM_CLASSES; ++i)
+    {
+      const slab_class_t *c = &classes[i];
+      uint32_t bytes = c->num_slabs * PAGE_SIZE, frag = 0;
+      if (!c->num_slabs && !c->peak_in_use)
+	continue;
+      if (bytes)
+	frag = 100 - c->in_use * c->obj_sz / (bytes / 100);
+      cprintf ("     %5" PRIu32 " %6" PRIu32 " %7" PRIu32 " %6" PRIu32
+	       " %5" PRIu32 "%%\n", c->obj_sz, c->num_slabs, c->in_use,
+	       c->peak_in_use, frag);
+    }
+}
@@ -0,0 +1,89 @@
+; Copyright (c) 2023 TK Chia
+;
+; Redistribution and use in source and binary forms, with or without
+; modification, are permitted provided that the following conditions are
+; met:
+;
+;   * Redistributions of source code must retain the above copyright
+;     notice, this list of conditions and the following disclaimer.
+;   * Redistributions in binary form must reproduce the above copyright
+;     notice, this list of conditions and the following disclaimer in the
+;     documentation and/or other materials provided with the distribution.
+;   * Neither the name of the developer(s) nor the names of its
+;     contributors may be used to endorse or promote products derived from
+;     this software without specific prior written permission.
+;
+; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+; IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+; TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+; PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+; HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+; SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+; TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+; PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+; LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+; NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+; SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+%include "stage2/stage2.inc"
+
+	section	.text
+
+	extern	ap_main
+
+; Real mode start-up code for application processors (APs).  smp_start ()
+; copies this to a page in base memory, fills in ap_tramp_gdtr, & points
+; each AP's startup IPI there.  The code must work at any segment, with
+; ip = 0.
+	bits	16
+
+	global	ap_tramp, ap_tramp_gdtr, ap_tramp_end
+ap_tramp:
+	cli
+	o32 lgdt [cs:ap_tramp_gdtr-ap_tramp]
+	mov	eax, cr0
+	or	al, 1			; set cr0.PE
+	mov	cr0, eax
+	jmp	dword SEL_CS32:ap_entry32
+
+	align	4
+ap_tramp_gdtr:
+	dw	0			; GDT limit & base, as given by sgdt
+	dd	0
+ap_tramp_end:
+
+	bits	32
+
+; Continue in 32-bit protected mode, with paging still off.  Turn on
+; paging with the bootstrap processor's page tables, switch to the stack
+; allotted to this AP, & go to ap_main ().
+	global	ap_entry32
+ap_entry32:
+	mov	ax, SEL_DS32
+	mov	ds, ax
+	mov	es, ax
+	mov	ss, ax
+	mov	gs, ax
+	mov	al, SEL_DS16
+	mov	fs, ax
+	mov	eax, [ap_cr4]
+	mov	cr4, eax
+	mov	eax, [ap_cr3]
+	mov	cr3, eax
+	mov	eax, [ap_cr0]
+	mov	cr0, eax
+	mov	esp, [ap_stack]
+	cld
+	call	ap_main
+.hang:
+	cli
+	hlt
+	jmp	.hang
+
+	section	.bss
+
+	global	ap_cr0, ap_cr3, ap_cr4, ap_stack
+ap_cr0:	resd	1			; control register settings for APs,
+ap_cr3:	resd	1			; copied from the bootstrap processor
+ap_cr4:	resd	1
+ap_stack: resd	1			; initial stack pointer for next AP
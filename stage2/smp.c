@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Bring-up of the application processors (APs), so that stage 2 can spread
+ * bulk work --- such as the memory scrub --- over all the processors.
+ *
+ * smp_start () puts each AP listed in the ACPI MADT through the usual
+ * INIT-SIPI-SIPI sequence.  The APs come up in stage 2's own address space
+ * via smp-start.asm, & wait for work.  smp_run (...) hands the same job to
+ * all processors, & waits for all of them to finish.  smp_stop () puts the
+ * APs back into the wait-for-SIPI state, so that the OS can start them
+ * afresh later.
+ *
+ * Only xAPIC mode is handled.  If the bootstrap processor is in x2APIC
+ * mode, or the MADT lists no other processors, jobs just run on the
+ * bootstrap processor.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include "apic.h"
+#include "stage2/stage2.h"
+
+#define AP_STACK_SZ	0x2000U		/* stack size for each AP */
+
+static lapic_t *lapic = NULL;
+static char *tramp = NULL;
+static unsigned num_aps = 0;
+static uint8_t ap_ids[MAX_CPUS];
+static void *ap_stacks[MAX_CPUS];
+/* Handshake between the bootstrap processor & the APs. */
+static volatile uint32_t ap_next_idx = 0, ap_alive = 0, job_gen = 0,
+			 job_done = 0;
+static void (*volatile job_fn) (unsigned, void *) = NULL;
+static void *volatile job_arg = NULL;
+
+/* Send an inter-processor interrupt to the processor with APIC id. `id'. */
+static void
+lapic_ipi (uint8_t id, uint32_t icr)
+{
+  lapic->ICR[1].value = (uint32_t) id << 24;
+  lapic->ICR[0].value = icr;
+  while ((lapic->ICR[0].value & ICR_BUSY) != 0)
+    cpu_relax ();
+}
+
+/* Send an INIT IPI, which leaves the target in the wait-for-SIPI state. */
+static void
+lapic_init_ipi (uint8_t id)
+{
+  lapic_ipi (id, ICR_INIT | ICR_LEVEL | ICR_ASSERT);
+  lapic_ipi (id, ICR_INIT | ICR_LEVEL);
+}
+
+/*
+ * Wait until the AP being started says it is alive, or until `cyc' TSC
+ * cycles pass.  Say whether the AP is alive.
+ */
+static bool
+wait_alive (uint64_t cyc)
+{
+  uint64_t start = rdtsc ();
+  while (!__atomic_load_n (&ap_alive, __ATOMIC_ACQUIRE))
+    {
+      if (rdtsc () - start >= cyc)
+	return false;
+      cpu_relax ();
+    }
+  return true;
+}
+
+/*
+ * Start up the APs, & return the total number of processors which can now
+ * run jobs, including the bootstrap processor.
+ */
+unsigned
+smp_start (void)
+{
+  const uint8_t *ids;
+  unsigned n, i, bsp_id;
+  uint64_t apic_base, hz, start;
+  uint32_t sipi;
+  n = irq_cpu_apic_ids (&ids);
+  apic_base = rdmsr (MSR_APIC_BASE);
+  if (n <= 1
+      || (apic_base & (APIC_BASE_EN | APIC_BASE_EXTD)) != APIC_BASE_EN)
+    return 1;
+  lapic = mmio_map (apic_base & 0x000ffffffffff000ULL, sizeof (lapic_t),
+		    MT_UC);
+  bsp_id = lapic->ID >> 24;
+  /* Set up the real mode start-up code in base memory. */
+  tramp = mem_alloc (PAGE_SIZE, PAGE_SIZE, BMEM_MAX_ADDR, MTAG_SMP);
+  memcpy (tramp, ap_tramp, ap_tramp_end - ap_tramp);
+  __asm volatile ("sgdt %0"
+		  : "=m" (*(char (*)[6]) (tramp + (ap_tramp_gdtr - ap_tramp))));
+  ap_cr0 = rd_cr0 ();
+  ap_cr3 = rd_cr3 ();
+  ap_cr4 = rd_cr4 ();
+  sipi = ICR_SIPI | (uint32_t) tramp / PAGE_SIZE;
+  hz = time_tsc_hz ();
+  /*
+   * INIT all the APs at once, then wait (at least) 10 ms.  Then start the
+   * APs one at a time, since they share `ap_stack' & `ap_next_idx'.  Try
+   * a second SIPI if the AP does not answer the first within 200 us.
+   */
+  for (i = 0; i < n; ++i)
+    if (ids[i] != bsp_id)
+      lapic_init_ipi (ids[i]);
+  start = rdtsc ();
+  while (rdtsc () - start < hz >> 6)
+    cpu_relax ();
+  for (i = 0; i < n; ++i)
+    {
+      void *stack;
+      if (ids[i] == bsp_id)
+	continue;
+      stack = mem_alloc (AP_STACK_SZ, PAGE_SIZE, 0, MTAG_SMP);
+      ap_stack = (uint32_t) stack + AP_STACK_SZ;
+      ap_next_idx = num_aps + 1;
+      __atomic_store_n (&ap_alive, 0, __ATOMIC_RELEASE);
+      lapic_ipi (ids[i], sipi);
+      if (!wait_alive (hz >> 12))
+	{
+	  lapic_ipi (ids[i], sipi);
+	  if (!wait_alive (hz >> 3))
+	    {
+	      /* Make sure a late starter cannot trample on the next AP. */
+	      lapic_init_ipi (ids[i]);
+	      mem_free (stack, AP_STACK_SZ, MTAG_SMP);
+	      cprintf ("CPU w/ APIC id %u did not start\n", ids[i]);
+	      continue;
+	    }
+	}
+      ap_ids[num_aps] = ids[i];
+      ap_stacks[num_aps] = stack;
+      ++num_aps;
+    }
+  return num_aps + 1;
+}
+
+/*
+ * Entry point for each AP, from ap_entry32.  Set up the AP's PAT & MTRRs
+ * like the bootstrap processor's, then wait for jobs.
+ */
+void
+ap_main (void)
+{
+  unsigned idx = ap_next_idx;
+  uint32_t gen = job_gen;
+  mem_ap_init ();
+  mtrr_ap_init ();
+  __atomic_store_n (&ap_alive, 1, __ATOMIC_RELEASE);
+  for (;;)
+    {
+      while (__atomic_load_n (&job_gen, __ATOMIC_ACQUIRE) == gen)
+	cpu_relax ();
+      gen = job_gen;
+      job_fn (idx, job_arg);
+      __atomic_add_fetch (&job_done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Run `fn' (`idx', `arg') on every processor which smp_start () brought up,
+ * where `idx' runs from 0 (the bootstrap processor) up to one less than the
+ * number of processors.  Return when all of them are done.
+ */
+void
+smp_run (void (*fn) (unsigned, void *), void *arg)
+{
+  job_fn = fn;
+  job_arg = arg;
+  job_done = 0;
+  __atomic_add_fetch (&job_gen, 1, __ATOMIC_RELEASE);
+  fn (0, arg);
+  while (__atomic_load_n (&job_done, __ATOMIC_ACQUIRE) != num_aps)
+    cpu_relax ();
+}
+
+/* Park the APs, & release the memory used to start them. */
+void
+smp_stop (void)
+{
+  unsigned i;
+  for (i = 0; i < num_aps; ++i)
+    {
+      lapic_init_ipi (ap_ids[i]);
+      mem_free (ap_stacks[i], AP_STACK_SZ, MTAG_SMP);
+    }
+  num_aps = 0;
+  if (tramp)
+    {
+      mem_free (tramp, PAGE_SIZE, MTAG_SMP);
+      tramp = NULL;
+    }
+  if (lapic)
+    {
+      mmio_unmap (lapic);
+      lapic = NULL;
+    }
+}
@@ -32,6 +32,7 @@
 
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include "bparm.h"
 
@@ -48,6 +49,41 @@ typedef uint32_t farptr16_t;
 /* Address space specifier for our 16-bit data segment. */
 #define DATA16		__seg_fs
 
+/*
+ * A pool of fixed-size, physically contiguous buffers for bus-master DMA.
+ * See stage2/dma.c.
+ */
+typedef struct dma_pool
+{
+  const char *name;
+  uint32_t buf_sz;			/* buffer size, rounded up to the
+					   alignment */
+  uint32_t align;			/* buffer alignment (power of 2) */
+  uint32_t boundary;			/* buffers must not cross multiples
+					   of this (power of 2), or 0 */
+  uintptr_t max_addr;			/* buffers must end below this, or
+					   0 */
+  uint32_t chunk_sz;			/* size of each memory chunk
+					   obtained from mem_alloc (...) */
+  void *free_list;
+  uint32_t num_bufs, num_free;
+} dma_pool_t;
+
+/* An address range descriptor as returned by int 0x15, ax = 0xe820. */
+typedef struct __attribute__ ((packed))
+{
+  uint64_t start;
+  uint64_t len;
+  uint32_t e820_type;
+  uint32_t e820_ext_attr;
+} e820_ent_t;
+
+/* A block of physical memory.  See mem_take_free (...). */
+typedef struct
+{
+  uint64_t start, len;
+} mem_blk_t;
+
 /* conio.c functions. */
 
 extern int cputs (const char *);
@@ -57,43 +93,133 @@ extern int vcprintf (const char *, va_list)
 extern int cprintf (const char *, ...)
 	   __attribute__ ((format (printf, 1, 2)));
 extern int wherex (void);
+extern int vcomprintf (const char *, va_list)
+	   __attribute__ ((format (printf, 1, 0)));
+extern int comprintf (const char *, ...)
+	   __attribute__ ((format (printf, 1, 2)));
+
+/* dma.c functions. */
+
+extern void dma_pool_init (dma_pool_t *, const char *, uint32_t, uint32_t,
+			   uint32_t, uintptr_t);
+extern void *dma_alloc (dma_pool_t *);
+extern void dma_free (dma_pool_t *, void *);
 
 /* irq.c functions. */
 
 extern void irq_init (bparm_t *);
+extern unsigned irq_cpu_apic_ids (const uint8_t **);
 
 /* mem.c functions. */
 
 extern void mem_init (bparm_t *);
-extern void *mem_alloc (size_t, size_t, uintptr_t);
+extern void *mem_alloc (size_t, size_t, uintptr_t, unsigned);
+extern void mem_free (void *, size_t, unsigned);
+extern uint64_t mem_free_bytes (void);
+extern void *mem_va_try_map (uint64_t, size_t, unsigned);
 extern void *mem_va_map (uint64_t, size_t, unsigned);
 extern void mem_va_unmap (volatile void *, size_t);
+extern void mem_va_batch_begin (void);
+extern void mem_va_batch_end (void);
+extern void mem_va_stats (uint32_t *, uint32_t *);
+extern bool mem_wb_capable (uint64_t, uint64_t);
+extern void mem_bmem_mark (void);
+extern void mem_bmem_fini (void);
+extern uint32_t mem_take_free (mem_blk_t *, uint32_t, unsigned);
+extern uint32_t mem_high_ram (mem_blk_t *, uint32_t);
+extern void mem_mark_unusable (uint64_t, uint64_t);
+extern void mem_va_window_map (void *, uint64_t);
+extern void mem_ap_init (void);
+extern void mem_acct_dump (bparm_t *);
+
+/* mmio.c functions. */
+
+extern void *mmio_map (uint64_t, size_t, unsigned);
+extern void mmio_unmap (volatile void *);
+
+/* mtrr.c functions. */
+
+extern void mtrr_init (bparm_t *);
+extern unsigned mtrr_fixed_type (uint32_t);
+extern void mtrr_ap_init (void);
 
 /* rm16.asm functions and data. */
 
 extern uint16_t rm16_cs;
-extern void rm16_init (void);
+extern void rm16_init (bool);
+extern void rm16_reload_ds16 (void);
 extern int rm16_call (uint32_t eax, uint32_t edx, uint32_t ecx, uint32_t ebx,
 		      farptr16_t callee);
 extern void copy_to_tb (const void *, size_t);
 
+/* scrub.c functions. */
+
+extern void mem_scrub (void);
+
+/* selftest.c functions. */
+
+extern void selftest (void);
+
+/* slab.c functions. */
+
+#define SLAB_MAX_SZ	1024U		/* largest object size for
+					   slab_alloc (.) */
+
+extern void *slab_alloc (size_t);
+extern void slab_free (void *);
+extern void slab_dump (void);
+
+/* smp.c functions. */
+
+extern unsigned smp_start (void);
+extern void smp_run (void (*) (unsigned, void *), void *);
+extern void smp_stop (void);
+extern void ap_main (void);
+
+/* smp-start.asm functions and data. */
+
+extern char ap_tramp[], ap_tramp_gdtr[], ap_tramp_end[];
+extern uint32_t ap_cr0, ap_cr3, ap_cr4, ap_stack;
+extern void ap_entry32 (void);
+
 /* time.c functions. */
 
 extern void time_init (bparm_t *);
+extern uint64_t time_tsc_hz (void);
+
+/* timeline.c functions. */
+
+extern void tl_init (bparm_t *);
+extern void tl_begin (const char *, uint32_t);
+extern void tl_end (const char *, uint32_t);
+extern void tl_dump (void);
 
 /* usb.c functions. */
 
 extern void usb_init (bparm_t *);
 
+/* 16/isr-15.c data. */
+
+extern DATA16 farptr16_t e820_tab16;
+extern DATA16 uint16_t e820_cnt16, ext_kib16, e801_kib16, e801_blks16;
+
 /* 16/vecs16.asm functions. */
 
 extern void isr16_unimpl (uint32_t eax, uint32_t edx, uint8_t int_no)
 	    __attribute__ ((noreturn));
 
+/* 16/xmove16.asm functions. */
+
+extern void xmove16 (uint32_t, uint32_t, uint32_t);
+
 /* 16/tb16.c data. */
 
 extern DATA16 char tb16[TB_SZ];
 
+/* 16/16.ld symbols. */
+
+extern char _etext16[];		/* its address is the 16-bit text size */
+
 /* Macros, inline functions, & other definitions (part 2). */
 
 #define XM32_MAX_ADDR	0x100000000ULL	/* end of 32-bit extended memory,
@@ -102,6 +228,8 @@ extern DATA16 char tb16[TB_SZ];
 #define LARGE_PAGE_SIZE	0x200000UL	/* size of a larger VM page */
 #define PDPT_ALIGN	0x20U		/* alignment of the page-dir.-ptr.
 					   table (PDPT) for PAE paging */
+#define MAX_CPUS	256U		/* max. no. of processors we handle,
+					   i.e. no. of xAPIC ids. */
 
 /* Flags in the eflags register. */
 #define EFL_C		(1U << 0)	/* carry */
@@ -113,13 +241,30 @@ extern DATA16 char tb16[TB_SZ];
 #define PTE_WT		(1UL <<  3)	/* write-through */
 #define PTE_CD		(1UL <<  4)	/* cache disable */
 #define PDE_PS		(1UL <<  7)	/* (page dir.) large page size */
+#define PTE_PAT		(1UL <<  7)	/* (page table) PAT index bit */
+#define PTE_G		(1UL <<  8)	/* global page */
+#define PDE_PAT		(1UL << 12)	/* (page dir.) PAT index bit for
+					   large page */
+
+/*
+ * Memory types which can be asked for in mem_va_map (...) &
+ * mmio_map (...).
+ */
+#define MT_WB		0U		/* write-back */
+#define MT_WT		1U		/* write-through */
+#define MT_UCM		2U		/* uncached, unless MTRRs say WC (UC-) */
+#define MT_UC		3U		/* uncached */
+#define MT_WC		4U		/* write-combining */
 
 /* Flags in the cr0 register. */
 #define CR0_PG		(1UL << 31)	/* paging */
+#define CR0_CD		(1UL << 30)	/* cache disable */
+#define CR0_NW		(1UL << 29)	/* not write-through */
 #define CR0_PE		(1UL <<  0)	/* protection enable */
 
 /* Flags in the cr4 register. */
 #define CR4_PAE		(1UL <<  5)	/* physical address extension (PAE) */
+#define CR4_PGE		(1UL <<  7)	/* page global enable */
 
 /* Legacy 8259 programmable interrupt controller (PIC) I/O port numbers. */
 #define PIC1_CMD	0x0020
@@ -381,6 +526,23 @@ wr_cr3 (uint32_t v)
   __asm volatile ("movl %0, %%cr3" : : "r" (v):"memory");
 }
 
+/*
+ * Give the physical address of a DMA buffer.  Stage 2 identity maps all
+ * the memory that mem_alloc (...) hands out, so this is just a cast.
+ */
+static inline uint64_t
+dma_pa (const volatile void *va)
+{
+  return (uint32_t) va;
+}
+
+/* Give the virtual address of a DMA buffer from its physical address. */
+static inline void *
+dma_va (uint64_t pa)
+{
+  return (void *) (uint32_t) pa;
+}
+
 /* Flush page table caches by reading & writing cr3. */
 static inline void
 flush_cr3 (void)
@@ -388,6 +550,13 @@ flush_cr3 (void)
   wr_cr3 (rd_cr3 ());
 }
 
+/* Invalidate any TLB entries for the page at the given virtual address. */
+static inline void
+invlpg (volatile void *va)
+{
+  __asm volatile ("invlpg %0" : : "m" (*(volatile char *) va) : "memory");
+}
+
 /* Read cr4. */
 static inline uint32_t
 rd_cr4 (void)
@@ -523,6 +692,13 @@ sti (void)
   __asm volatile ("sti" : : : "memory");
 }
 
+/* Hint to the processor that we are in a spin-wait loop. */
+static inline void
+cpu_relax (void)
+{
+  __asm volatile ("pause" : : : "memory");
+}
+
 /*
  * Temporary enable interrupts, wait for an IRQ, then disable interrupts
  * (again).
@@ -543,7 +719,7 @@ peekb (uint16_t s, uint32_t o)
 		  "movw %2, %%ds; "
 		  "movb %a3, %1; "
 		  "movw %0, %%ds"
-		  : "=&g" (scratch), "=r" (v)
+		  : "=&g" (scratch), "=q" (v)
 		  : "rm" (s), "p" (o));
   return v;
 }
@@ -557,7 +733,7 @@ pokeb (uint16_t s, uint32_t o, uint8_t v)
 		  "movw %1, %%ds; "
 		  "movb %3, %a2; "
 		  "movw %0, %%ds":"=&g" (scratch):"rm" (s), "p" (o),
-		  "r" (v):"memory");
+		  "q" (v):"memory");
 }
 
 /* Write a shortword at a segment:offset address. */
@@ -43,9 +43,25 @@
 #define PITC_LO		0x10		/* low byte only */
 #define PITC_HI		0x20		/* high byte only */
 #define PITC_LOHI	0x30		/* low byte then high byte */
+#define PITC_MODE0	0x00		/* mode 0 (interrupt on terminal
+					   count) */
 #define PITC_MODE3	0x06		/* mode 3 (square wave) */
 #define PITC_BCD	0x01		/* BCD (vs. binary) mode */
 
+/* System control port B, & its bit fields. */
+#define PORT_SYS_CTL_B	0x0061
+#define SCB_T2_GATE	0x01		/* PIT channel 2 gate */
+#define SCB_SPKR_ENA	0x02		/* speaker data enable */
+#define SCB_T2_OUT	0x20		/* PIT channel 2 output */
+
+/*
+ * PIT count & equivalent no. of ticks per second for the TSC calibration
+ * interval.  The PIT runs at 1 193 182 Hz, so this interval is 1/100 s
+ * (to within about 0.002%).
+ */
+#define TSC_CAL_PIT_CNT	11932U
+#define TSC_CAL_PER_SEC	100U
+
 void
 time_init (bparm_t * bparms)
 {
@@ -72,3 +88,26 @@ time_init (bparm_t * bparms)
   cmos_read (CMOS_RTC_STA_C | CMOS_NMI_DIS);
   cmos_home ();
 }
+
+/*
+ * Work out the frequency of the time stamp counter, by timing an interval
+ * of PIT channel 2.
+ */
+uint64_t
+time_tsc_hz (void)
+{
+  uint8_t scb = inp (PORT_SYS_CTL_B);
+  uint64_t start, end;
+  /* Disable the speaker, & enable the gate on PIT channel 2. */
+  outp (PORT_SYS_CTL_B, (scb & ~SCB_SPKR_ENA) | SCB_T2_GATE);
+  /* Program channel 2 to count down once. */
+  outp (PIT_CMD, PITC_SEL2 | PITC_LOHI | PITC_MODE0);
+  outp (PIT_DATA2, TSC_CAL_PIT_CNT & 0xff);
+  outp (PIT_DATA2, TSC_CAL_PIT_CNT >> 8);
+  /* Wait for the count down to finish. */
+  start = rdtsc ();
+  while ((inp (PORT_SYS_CTL_B) & SCB_T2_OUT) == 0);
+  end = rdtsc ();
+  outp (PORT_SYS_CTL_B, scb);
+  return (end - start) * TSC_CAL_PER_SEC;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Routines for recording a timeline of the boot phases in both stage 1 &
+ * stage 2, & for dumping the timeline at the end.
+ *
+ * The dump gives raw time stamp counter values, together with the TSC
+ * frequency; tools/tldecode.c can turn it into a table of phase durations.
+ */
+
+#include <inttypes.h>
+#include "stage2/stage2.h"
+
+/* Maximum total no. of events which we can record. */
+#define TL_MAX_EVS	128
+
+static bdat_tl_ev_t tl_evs[TL_MAX_EVS];
+static unsigned tl_num_evs = 0;
+
+static void
+tl_add (char kind, const char *name, uint32_t arg)
+{
+  bdat_tl_ev_t *ev;
+  unsigned i;
+  if (tl_num_evs >= TL_MAX_EVS)
+    return;
+  ev = &tl_evs[tl_num_evs++];
+  ev->tsc = rdtsc ();
+  ev->arg = arg;
+  ev->kind = kind;
+  for (i = 0; i < TL_NAME_LEN && name[i]; ++i)
+    ev->name[i] = name[i];
+  while (i < TL_NAME_LEN)
+    ev->name[i++] = 0;
+}
+
+/*
+ * Start the timeline off with the events recorded by stage 1.  This should
+ * be called before any calls to tl_begin (...) or tl_end (...).
+ */
+void
+tl_init (bparm_t * bparms)
+{
+  const bdat_timeline_t *bd;
+  uint32_t iter;
+  FOR_EACH_BPARM (bd, bparms, BPI_TIML, iter)
+  {
+    uint32_t i, n = bd->num_evs;
+    if (n > TL_MAX_EVS_1)
+      n = TL_MAX_EVS_1;
+    for (i = 0; i < n && tl_num_evs < TL_MAX_EVS; ++i)
+      tl_evs[tl_num_evs++] = bd->evs[i];
+  }
+}
+
+/* Record the start of a boot phase. */
+void
+tl_begin (const char *name, uint32_t arg)
+{
+  tl_add (TL_BEGIN, name, arg);
+}
+
+/* Record the end of a boot phase. */
+void
+tl_end (const char *name, uint32_t arg)
+{
+  tl_add (TL_END, name, arg);
+}
+
+static void
+tl_printf (const char *fmt, ...)
+{
+  va_list ap;
+  va_start (ap, fmt);
+  vcprintf (fmt, ap);
+  va_end (ap);
+  va_start (ap, fmt);
+  vcomprintf (fmt, ap);
+  va_end (ap);
+}
+
+/*
+ * Dump the whole timeline, to the screen & to the serial port.  Each line
+ * of the dump starts with "TL ".
+ */
+void
+tl_dump (void)
+{
+  uint64_t hz = time_tsc_hz ();
+  unsigned i;
+  tl_printf ("TL hz 0x%08" PRIx32 "%08" PRIx32 "\n",
+	     (uint32_t) (hz >> 32), (uint32_t) hz);
+  for (i = 0; i < tl_num_evs; ++i)
+    {
+      const bdat_tl_ev_t *ev = &tl_evs[i];
+      tl_printf ("TL %c 0x%08" PRIx32 "%08" PRIx32 " %08" PRIx32 " %.*s\n",
+		 ev->kind, (uint32_t) (ev->tsc >> 32), (uint32_t) ev->tsc,
+		 ev->arg, (int) TL_NAME_LEN, ev->name);
+    }
+  if (tl_num_evs >= TL_MAX_EVS)
+    tl_printf ("TL full\n");
+}
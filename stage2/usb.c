@@ -124,7 +124,7 @@ ehci_init_bus (bdat_pci_dev_t * pd)
   uint64_t hc_pa;
   unsigned seg = locn >> 16, bus = (locn >> 8) & 0xff,
 	   dev = (locn >> 3) & 0x1f, fn = locn & 7;
-  hc = pci_va_map (locn, 0, 0x200, &hc_pa);
+  hc = pci_va_map (locn, 0, 0x200, MT_UC, &hc_pa);
   cprintf ("USB EHCI @ %04x:%02x:%02x.%x  "
 	   "USBBASE: @0x%" PRIx32 "%08" PRIx32 "\n",
 	   seg, bus, dev, fn, (uint32_t) (hc_pa >> 32), (uint32_t) hc_pa);
@@ -133,7 +133,7 @@ ehci_init_bus (bdat_pci_dev_t * pd)
 	   "HCSPARAMS: 0x%" PRIx32 "  HCCPARAMS: 0x%" PRIx32 "\n",
 	   hc->CAPLENGTH, hc->HCIVERSION, hc->HCSPARAMS, hccp);
   ehci_start_legacy (locn, hccp);
-  mem_va_unmap (hc, 0x200);
+  mmio_unmap (hc);
 }
 
 static void
@@ -146,7 +146,7 @@ xhci_start_legacy (uint32_t locn, uint64_t hc_pa, uint32_t hccp1)
     {
       usb_xhci_xec_t *xec;
       pa += (uint64_t) off *4;
-      xec = mem_va_map (pa, sizeof (usb_xhci_xec_t), PTE_CD);
+      xec = mmio_map (pa, sizeof (usb_xhci_xec_t), MT_UC);
       cap_id = xec->CAPID;
       if (cap_id == XHCI_XECP_LEGACY)
 	{
@@ -165,14 +165,14 @@ xhci_start_legacy (uint32_t locn, uint64_t hc_pa, uint32_t hccp1)
 		       (uint32_t) (pa >> 32), (uint32_t) pa, cap1, new_cap1);
 	      xec->legacy.USBLEGSUP = new_cap1;
 	    }
-	  mem_va_unmap (xec, sizeof (usb_xhci_xec_t));
-	  return;
+	  mmio_unmap (xec);
+	  break;
 	}
       off = xec->NXT;
       cprintf ("  cap. @ 0x%" PRIx32 "%08" PRIx32 ": "
 	       "(0x%" PRIx16 ") 0x%" PRIx8 "\n",
 	       (uint32_t) (pa >> 32), (uint32_t) pa, off, cap_id);
-      mem_va_unmap (xec, sizeof (usb_xhci_xec_t));
+      mmio_unmap (xec);
     }
 }
 
@@ -184,7 +184,7 @@ xhci_init_bus (bdat_pci_dev_t * pd)
   uint64_t hc_pa;
   unsigned seg = locn >> 16, bus = (locn >> 8) & 0xff,
 	   dev = (locn >> 3) & 0x1f, fn = locn & 7;
-  hc = pci_va_map (locn, 0, sizeof (usb_xhci_t), &hc_pa);
+  hc = pci_va_map (locn, 0, sizeof (usb_xhci_t), MT_UC, &hc_pa);
   cprintf ("USB XHCI @ %04x:%02x:%02x.%x  BASE: @0x%" PRIx32 "%08" PRIx32 "\n",
 	   seg, bus, dev, fn, (uint32_t) (hc_pa >> 32), (uint32_t) hc_pa);
   hccp1 = hc->HCCPARAMS1;
@@ -195,29 +195,26 @@ xhci_init_bus (bdat_pci_dev_t * pd)
 	   hc->HCSPARAMS1, hc->HCSPARAMS2, hc->HCSPARAMS3,
 	   hccp1, hc->HCCPARAMS2);
   xhci_start_legacy (locn, hc_pa, hccp1);
-  mem_va_unmap (hc, sizeof (usb_xhci_t));
+  mmio_unmap (hc);
 }
 
 void
 usb_init (bparm_t * bparms)
 {
-  bparm_t *bp;
-  for (bp = bparms; bp; bp = bp->next)
-    {
-      bdat_pci_dev_t *pd;
-      if (bp->type != BP_PCID)
-	continue;
-      pd = &bp->u->pci_dev;
-      switch (pd->class_if)
-	{
-	case PCI_CIF_BUS_USB_EHCI:
-	  ehci_init_bus (pd);
-	  break;
-	case PCI_CIF_BUS_USB_XHCI:
-	  xhci_init_bus (pd);
-	  break;
-	default:
-	  ;
-	}
-    }
+  bdat_pci_dev_t *pd;
+  uint32_t iter;
+  FOR_EACH_BPARM (pd, bparms, BPI_PCID, iter)
+  {
+    switch (pd->class_if)
+      {
+      case PCI_CIF_BUS_USB_EHCI:
+	ehci_init_bus (pd);
+	break;
+      case PCI_CIF_BUS_USB_XHCI:
+	xhci_init_bus (pd);
+	break;
+      default:
+	;
+      }
+  }
 }
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host-side utility to pack the linked stage 2 ELF file into a compressed
+ * stage 2 container (see s2pack.h), which stage 1 can load with a single
+ * large read.
+ *
+ * Usage: s2pack ELF-FILE OUTPUT-FILE
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "elf.h"
+#include "s2pack.h"
+
+#define HASH_BITS	16
+
+static const char *in_name;
+
+static void
+fail (const char *msg)
+{
+  fprintf (stderr, "s2pack: %s: %s\n", in_name, msg);
+  exit (1);
+}
+
+static uint32_t
+read32 (const uint8_t *p)
+{
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8
+	 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static unsigned
+hash4 (uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Output an LZ4 length extension, for a length beyond the token's 15. */
+static size_t
+put_len (uint8_t *out, size_t op, size_t len)
+{
+  while (len >= 255)
+    {
+      out[op++] = 255;
+      len -= 255;
+    }
+  out[op++] = (uint8_t) len;
+  return op;
+}
+
+/*
+ * Output one LZ4 sequence: some literals, then (if MATCH_LEN is not 0) a
+ * back reference.
+ */
+static size_t
+put_seq (uint8_t *out, size_t op, const uint8_t *lits, size_t num_lits,
+	 size_t off, size_t match_len)
+{
+  size_t tok_op = op++;
+  uint8_t tok;
+  tok = num_lits >= 15 ? 15 << 4 : num_lits << 4;
+  if (num_lits >= 15)
+    op = put_len (out, op, num_lits - 15);
+  memcpy (out + op, lits, num_lits);
+  op += num_lits;
+  if (match_len)
+    {
+      size_t ml = match_len - LZ4_MIN_MATCH;
+      out[op++] = (uint8_t) off;
+      out[op++] = (uint8_t) (off >> 8);
+      tok |= ml >= 15 ? 15 : ml;
+      if (ml >= 15)
+	op = put_len (out, op, ml - 15);
+    }
+  out[tok_op] = tok;
+  return op;
+}
+
+/*
+ * Compress a buffer into a single LZ4 block, using a simple greedy match
+ * finder.  Return the compressed size.  OUT must have space for at least
+ * N + N / 255 + 16 bytes.
+ */
+static size_t
+lz4_compress (const uint8_t *in, size_t n, uint8_t *out)
+{
+  static uint32_t ht[1U << HASH_BITS];
+  size_t ip = 0, anchor = 0, op = 0;
+  memset (ht, 0, sizeof ht);
+  if (n > LZ4_MF_LIMIT)
+    {
+      size_t mf_limit = n - LZ4_MF_LIMIT, match_limit = n - LZ4_LAST_LITS;
+      while (ip < mf_limit)
+	{
+	  uint32_t v = read32 (in + ip);
+	  unsigned h = hash4 (v);
+	  size_t ref = ht[h], len;
+	  ht[h] = (uint32_t) ip + 1;
+	  if (!ref || ip - (ref - 1) > LZ4_MAX_OFF
+	      || read32 (in + ref - 1) != v)
+	    {
+	      ++ip;
+	      continue;
+	    }
+	  --ref;
+	  len = LZ4_MIN_MATCH;
+	  while (ip + len < match_limit && in[ref + len] == in[ip + len])
+	    ++len;
+	  op = put_seq (out, op, in + anchor, ip - anchor, ip - ref, len);
+	  ip += len;
+	  anchor = ip;
+	}
+    }
+  return put_seq (out, op, in + anchor, n - anchor, 0, 0);
+}
+
+static uint8_t *
+read_file (const char *name, size_t *p_sz)
+{
+  FILE *fp = fopen (name, "rb");
+  uint8_t *buf;
+  long sz;
+  if (!fp)
+    {
+      perror (name);
+      exit (1);
+    }
+  if (fseek (fp, 0, SEEK_END) != 0 || (sz = ftell (fp)) < 0
+      || fseek (fp, 0, SEEK_SET) != 0)
+    fail ("cannot get file size");
+  buf = malloc (sz ? sz : 1);
+  if (!buf)
+    fail ("out of memory");
+  if (fread (buf, 1, sz, fp) != (size_t) sz)
+    fail ("cannot read file");
+  fclose (fp);
+  *p_sz = sz;
+  return buf;
+}
+
+int
+main (int argc, char **argv)
+{
+  s2pk_hdr_t hdr;
+  s2pk_seg_t segs[S2PK_MAX_SEGS];
+  uint8_t *elf, **data;
+  size_t elf_sz, total_in = 0, total_out = 0;
+  const Elf32_Ehdr *ehdr;
+  const Elf32_Phdr *phdrs;
+  unsigned ph_idx, num_segs = 0, seg_idx;
+  uint32_t off;
+  FILE *fp;
+  if (argc != 3)
+    {
+      fprintf (stderr, "usage: s2pack ELF-FILE OUTPUT-FILE\n");
+      return 2;
+    }
+  in_name = argv[1];
+  elf = read_file (in_name, &elf_sz);
+  ehdr = (const Elf32_Ehdr *) elf;
+  if (elf_sz < sizeof (*ehdr)
+      || ehdr->e_ident[EI_MAG0] != ELFMAG0
+      || ehdr->e_ident[EI_MAG1] != ELFMAG1
+      || ehdr->e_ident[EI_MAG2] != ELFMAG2
+      || ehdr->e_ident[EI_MAG3] != ELFMAG3
+      || ehdr->e_machine != EM_386
+      || ehdr->e_phentsize != sizeof (Elf32_Phdr)
+      || ehdr->e_phoff > elf_sz
+      || ehdr->e_phnum > (elf_sz - ehdr->e_phoff) / sizeof (Elf32_Phdr))
+    fail ("not a usable x86-32 ELF file");
+  phdrs = (const Elf32_Phdr *) (elf + ehdr->e_phoff);
+  data = calloc (S2PK_MAX_SEGS, sizeof (uint8_t *));
+  if (!data)
+    fail ("out of memory");
+  for (ph_idx = 0; ph_idx < ehdr->e_phnum; ++ph_idx)
+    {
+      const Elf32_Phdr *phdr = &phdrs[ph_idx];
+      s2pk_seg_t *seg;
+      if (phdr->p_type != PT_LOAD)
+	continue;
+      if (num_segs >= S2PK_MAX_SEGS)
+	fail ("too many segments");
+      if (phdr->p_filesz > phdr->p_memsz || phdr->p_offset > elf_sz
+	  || phdr->p_filesz > elf_sz - phdr->p_offset)
+	fail ("bad segment");
+      seg = &segs[num_segs];
+      seg->paddr = phdr->p_paddr;
+      seg->filesz = phdr->p_filesz;
+      seg->memsz = phdr->p_memsz;
+      data[num_segs] = malloc (seg->filesz + seg->filesz / 255 + 16);
+      if (!data[num_segs])
+	fail ("out of memory");
+      seg->comp_sz = lz4_compress (elf + phdr->p_offset, seg->filesz,
+				   data[num_segs]);
+      total_in += seg->filesz;
+      total_out += seg->comp_sz;
+      ++num_segs;
+    }
+  off = sizeof (hdr) + num_segs * sizeof (s2pk_seg_t);
+  for (seg_idx = 0; seg_idx < num_segs; ++seg_idx)
+    {
+      segs[seg_idx].comp_off = off;
+      off += segs[seg_idx].comp_sz;
+    }
+  hdr.magic = S2PK_MAGIC;
+  hdr.ver = S2PK_VER;
+  hdr.num_segs = num_segs;
+  hdr.entry = ehdr->e_entry;
+  hdr.data_sz = total_out;
+  fp = fopen (argv[2], "wb");
+  if (!fp)
+    {
+      perror (argv[2]);
+      return 1;
+    }
+  fwrite (&hdr, sizeof hdr, 1, fp);
+  fwrite (segs, sizeof (s2pk_seg_t), num_segs, fp);
+  for (seg_idx = 0; seg_idx < num_segs; ++seg_idx)
+    fwrite (data[seg_idx], 1, segs[seg_idx].comp_sz, fp);
+  if (fclose (fp) != 0)
+    {
+      perror (argv[2]);
+      return 1;
+    }
+  printf ("s2pack: %s: %u seg(s)., 0x%zx -> 0x%zx bytes\n",
+	  in_name, num_segs, total_in, total_out);
+  return 0;
+}
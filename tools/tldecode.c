@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2023 TK Chia
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the developer(s) nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host-side utility to decode a boot timeline dump from the stage 2
+ * bootloader (see stage2/timeline.c) into a table of boot phases & their
+ * durations in milliseconds.
+ *
+ * Usage: tldecode [LOG-FILE]
+ *
+ * The log file (or standard input) may contain other output besides the
+ * timeline dump; only lines starting with "TL " are looked at.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_EVS		1024
+#define MAX_NAME_LEN	64
+
+typedef struct
+{
+  uint64_t tsc;
+  uint32_t arg;
+  char kind;
+  char name[MAX_NAME_LEN];
+} ev_t;
+
+static ev_t evs[MAX_EVS];
+static unsigned num_evs = 0;
+static uint64_t hz = 0;
+
+static void
+parse_line (char *line)
+{
+  char kind, name[MAX_NAME_LEN];
+  uint64_t val;
+  uint32_t arg;
+  line[strcspn (line, "\r\n")] = 0;
+  if (strncmp (line, "TL ", 3) != 0)
+    return;
+  if (sscanf (line, "TL hz %" SCNx64, &val) == 1)
+    {
+      hz = val;
+      return;
+    }
+  name[0] = 0;
+  if (sscanf (line, "TL %c %" SCNx64 " %" SCNx32 " %63s",
+	      &kind, &val, &arg, name) < 3)
+    return;
+  if (kind != 'B' && kind != 'E')
+    return;
+  if (num_evs >= MAX_EVS)
+    {
+      fprintf (stderr, "tldecode: too many events\n");
+      exit (1);
+    }
+  evs[num_evs].tsc = val;
+  evs[num_evs].arg = arg;
+  evs[num_evs].kind = kind;
+  strcpy (evs[num_evs].name, name);
+  ++num_evs;
+}
+
+static double
+to_ms (uint64_t ticks)
+{
+  return (double) ticks * 1000. / (double) hz;
+}
+
+/* Find the event which ends the phase started by event number IDX. */
+static const ev_t *
+find_end (unsigned idx)
+{
+  const ev_t *begin = &evs[idx];
+  unsigned depth = 0;
+  while (++idx < num_evs)
+    {
+      const ev_t *ev = &evs[idx];
+      if (ev->arg != begin->arg || strcmp (ev->name, begin->name) != 0)
+	continue;
+      if (ev->kind == 'B')
+	++depth;
+      else if (depth)
+	--depth;
+      else
+	return ev;
+    }
+  return NULL;
+}
+
+int
+main (int argc, char **argv)
+{
+  FILE *fp = stdin;
+  char line[256];
+  unsigned idx, depth = 0;
+  uint64_t base;
+  if (argc > 2)
+    {
+      fprintf (stderr, "usage: tldecode [LOG-FILE]\n");
+      return 2;
+    }
+  if (argc == 2)
+    {
+      fp = fopen (argv[1], "r");
+      if (!fp)
+	{
+	  perror (argv[1]);
+	  return 1;
+	}
+    }
+  while (fgets (line, sizeof line, fp))
+    parse_line (line);
+  if (fp != stdin)
+    fclose (fp);
+  if (!num_evs)
+    {
+      fprintf (stderr, "tldecode: no timeline events found\n");
+      return 1;
+    }
+  if (!hz)
+    {
+      fprintf (stderr, "tldecode: no TSC frequency found\n");
+      return 1;
+    }
+  printf ("TSC frequency: %.3f MHz\n\n", (double) hz / 1e6);
+  printf ("%12s %12s  %s\n", "start/ms", "duration/ms", "phase");
+  base = evs[0].tsc;
+  for (idx = 0; idx < num_evs; ++idx)
+    {
+      const ev_t *ev = &evs[idx], *end;
+      if (ev->kind == 'E')
+	{
+	  if (depth)
+	    --depth;
+	  continue;
+	}
+      end = find_end (idx);
+      printf ("%12.3f ", to_ms (ev->tsc - base));
+      if (end)
+	printf ("%12.3f  ", to_ms (end->tsc - ev->tsc));
+      else
+	printf ("%12s  ", "?");
+      printf ("%*s%s", (int) depth * 2, "", ev->name);
+      if (ev->arg)
+	printf (" [%08" PRIx32 "]", ev->arg);
+      putchar ('\n');
+      ++depth;
+    }
+  return 0;
+}